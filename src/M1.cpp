@@ -1,65 +1,4 @@
-#include <glad/glad.h>
-#include <GLFW/glfw3.h>
-#include <glm/glm.hpp>
-#include <glm/gtc/matrix_transform.hpp>
-#include <glm/gtc/type_ptr.hpp>
-
-#include <iostream>
-#include <string>
-#include <vector>
-#include <fstream>
-#include <sstream>
-#include <algorithm>
-
-// Shader sources
-const char* vertexShaderSource = R"(
-    #version 330 core
-    layout (location = 0) in vec3 aPos;
-    layout (location = 1) in vec3 aNormal;
-    
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
-    uniform bool selected;
-    
-    out vec3 Normal;
-    out vec3 FragPos;
-    out vec3 SelColor;
-    
-    void main() {
-        FragPos = vec3(model * vec4(aPos, 1.0));
-        Normal = mat3(transpose(inverse(model))) * aNormal;
-        gl_Position = projection * view * model * vec4(aPos, 1.0);
-        SelColor = selected ? vec3(0.9, 0.6, 0.1) : vec3(1.0, 1.0, 1.0);
-    }
-)";
-
-const char* fragmentShaderSource = R"(
-    #version 330 core
-    out vec4 FragColor;
-    
-    in vec3 Normal;
-    in vec3 FragPos;
-    in vec3 SelColor;
-    
-    uniform vec3 lightPos;
-    uniform vec3 lightColor;
-    
-    void main() {
-        // Ambient
-        float ambientStrength = 0.3;
-        vec3 ambient = ambientStrength * lightColor;
-        
-        // Diffuse
-        vec3 norm = normalize(Normal);
-        vec3 lightDir = normalize(lightPos - FragPos);
-        float diff = max(dot(norm, lightDir), 0.0);
-        vec3 diffuse = diff * lightColor;
-        
-        vec3 result = (ambient + diffuse) * SelColor;
-        FragColor = vec4(result, 1.0);
-    }
-)";
+#include "M1Core.h"
 
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
@@ -68,177 +7,103 @@ const unsigned int SCR_HEIGHT = 600;
 glm::vec3 cameraPos = glm::vec3(0.0f, 0.0f, 5.0f);
 glm::vec3 cameraFront = glm::vec3(0.0f, 0.0f, -1.0f);
 glm::vec3 cameraUp = glm::vec3(0.0f, 1.0f, 0.0f);
+float cameraFar = 100.0f;
 
-class OBJ {
-public:
-    std::vector<glm::vec3> vertices;
-    std::vector<glm::vec3> normals;
-    std::vector<GLuint> indices;
-    
-    GLuint VAO, VBO, EBO, NBO;
-    
-    glm::vec3 position = glm::vec3(0.0f);
-    glm::vec3 rotation = glm::vec3(0.0f);
-    glm::vec3 scale = glm::vec3(1.0f);
-    
-    std::string name;
-    
-    OBJ(const std::string& objFilePath) {
-        name = objFilePath;
-        loadOBJ(objFilePath);
-        setupMesh();
-    }
-    
-    ~OBJ() {
-        glDeleteVertexArrays(1, &VAO);
-        glDeleteBuffers(1, &VBO);
-        glDeleteBuffers(1, &EBO);
-        glDeleteBuffers(1, &NBO);
-    }
-    
-    void loadOBJ(const std::string& filePath);
-    void setupMesh();
-    void draw(GLuint shaderProgram, bool selected, bool wireframeMode); // Updated parameter list
-};
+// Reach of the extra lights --lights scatters over the scene
+const float LIGHT_RADIUS = 4.0f;
 
-void OBJ::loadOBJ(const std::string& filePath) {
-    std::ifstream file(filePath);
-    if (!file) {
-        std::cerr << "Failed to open file: " << filePath << std::endl;
-        return;
-    }
-    
-    std::vector<glm::vec3> temp_vertices;
-    std::vector<glm::vec3> temp_normals;
-    std::vector<GLuint> vertexIndices, normalIndices;
-    
-    std::string line;
-    while (std::getline(file, line)) {
-        std::istringstream iss(line);
-        std::string prefix;
-        iss >> prefix;
-        
-        if (prefix == "v") {
-            glm::vec3 vertex;
-            iss >> vertex.x >> vertex.y >> vertex.z;
-            temp_vertices.push_back(vertex);
-        } 
-        else if (prefix == "vn") {
-            glm::vec3 normal;
-            iss >> normal.x >> normal.y >> normal.z;
-            temp_normals.push_back(normal);
-        } 
-        else if (prefix == "f") {
-            std::string vertexData;
-            unsigned int vertexIndex, textureIndex, normalIndex;
-            
-            for (int i = 0; i < 3; i++) {
-                iss >> vertexData;
-                std::replace(vertexData.begin(), vertexData.end(), '/', ' ');
-                std::istringstream vdss(vertexData);
-                vdss >> vertexIndex;
-                
-                // Skip texture coordinate if present
-                if (vertexData.find(' ') != std::string::npos) {
-                    vdss >> textureIndex;
-                    if (vertexData.find(' ', vertexData.find(' ') + 1) != std::string::npos) {
-                        vdss >> normalIndex;
-                        normalIndices.push_back(normalIndex - 1);
-                    }
-                }
-                
-                vertexIndices.push_back(vertexIndex - 1);
-            }
-        }
-    }
-    
-    // Process indices
-    for (unsigned int i = 0; i < vertexIndices.size(); i++) {
-        GLuint vertexIndex = vertexIndices[i];
-        vertices.push_back(temp_vertices[vertexIndex]);
-        
-        if (i < normalIndices.size()) {
-            GLuint normalIndex = normalIndices[i];
-            if (normalIndex < temp_normals.size()) {
-                normals.push_back(temp_normals[normalIndex]);
-            } else {
-                normals.push_back(glm::vec3(0.0f, 1.0f, 0.0f));
-            }
-        } else {
-            normals.push_back(glm::vec3(0.0f, 1.0f, 0.0f));
+// Input is sampled and the scene updated at this rate, independently of how
+// fast the render thread presents frames
+const double SIMULATION_STEP = 1.0 / 240.0;
+
+// Frame rate the on-demand mode caps animation at unless --max-fps says
+// otherwise
+const int ON_DEMAND_MAX_FPS = 60;
+
+// Keys held down, kept from key_callback events so the simulation reads
+// them without asking GLFW about each key every tick. GLFW sends releases
+// for every held key when the window loses focus, so none stay stuck.
+struct KeyboardState {
+    bool down[GLFW_KEY_LAST + 1] = {};
+    int held = 0;
+    
+    void set(int key, bool pressed) {
+        if (key < 0 || key > GLFW_KEY_LAST || down[key] == pressed) {
+            return;
         }
-        
-        indices.push_back(i);
+        down[key] = pressed;
+        held += pressed ? 1 : -1;
     }
     
-    std::cout << "Loaded " << vertices.size() << " vertices from " << filePath << std::endl;
-}
+    bool isDown(int key) const { return down[key]; }
+    bool isDown(int key, int alternative) const { return down[key] || down[alternative]; }
+};
 
-void OBJ::setupMesh() {
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-    glGenBuffers(1, &NBO);
-    glGenBuffers(1, &EBO);
-    
-    glBindVertexArray(VAO);
-    
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), &vertices[0], GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
-    glEnableVertexAttribArray(0);
-    
-    glBindBuffer(GL_ARRAY_BUFFER, NBO);
-    glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(glm::vec3), &normals[0], GL_STATIC_DRAW);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
-    glEnableVertexAttribArray(1);
-    
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), &indices[0], GL_STATIC_DRAW);
-    
-    glBindVertexArray(0);
-}
+// Past this fraction of the instances changed at once, a snapshot carries
+// whole transform arrays instead of a change list
+const size_t SNAPSHOT_FULL_COPY_DIVISOR = 8;
 
-void OBJ::draw(GLuint shaderProgram, bool selected, bool wireframeMode) {
-    glm::mat4 model = glm::mat4(1.0f);
-    model = glm::translate(model, position);
-    model = glm::rotate(model, glm::radians(rotation.x), glm::vec3(1.0f, 0.0f, 0.0f));
-    model = glm::rotate(model, glm::radians(rotation.y), glm::vec3(0.0f, 1.0f, 0.0f));
-    model = glm::rotate(model, glm::radians(rotation.z), glm::vec3(0.0f, 0.0f, 1.0f));
-    model = glm::scale(model, scale);
-    
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
-    glUniform1i(glGetUniformLocation(shaderProgram, "selected"), selected ? 1 : 0);
-    
-    // Set polygon mode based on wireframe state if this object is selected
-    if (selected && wireframeMode) {
-        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    } else {
-        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    }
-    
-    glBindVertexArray(VAO);
-    glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
-    glBindVertexArray(0);
-    
-    // Reset polygon mode to fill after drawing this object
-    if (selected && wireframeMode) {
-        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    }
-}
+// What the render thread needs from one simulation tick. Transforms travel
+// as the current values of the instances changed since the revision the
+// render thread last applied, so moving one object copies one object; only
+// bulk changes copy the whole arrays.
+struct SceneSnapshot {
+    bool fullCopy = false; // positions/rotations/scales hold every instance
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> rotations;
+    std::vector<glm::vec3> scales;
+    std::vector<uint32_t> changedIndices; // Instances the arrays hold, otherwise
+    uint64_t revision = 0; // sceneRevision the transforms are current at
+    
+    int selectedIndex = 0;
+    bool wireframeMode = false;
+    bool depthPrepass = false;
+    bool overdrawView = false;
+    glm::vec3 eye = glm::vec3(0.0f);
+    glm::mat4 view = glm::mat4(1.0f);
+    glm::mat4 projection = glm::mat4(1.0f);
+};
 
 // Function declarations
-GLuint createShaderProgram(const char* vertexShaderSource, const char* fragmentShaderSource);
 void processInput(GLFWwindow* window, float deltaTime);
+void publishSnapshot();
+void renderLoop(GLFWwindow* window);
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
+void window_refresh_callback(GLFWwindow* window);
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
 void displayHelp();
 
 // Global variables
-std::vector<OBJ*> objects;
+MeshLoader meshLoader;
+UploadStream uploadStream;
+MeshCache meshCache;
+MeshResidency meshResidency;
+SceneRenderer renderer;
+InstanceArray objects;         // Simulation thread's copy; transforms are edited here
+InstanceArray renderInstances; // Render thread's copy, updated from snapshots
+uint64_t sceneRevision = 0;    // Bumped whenever the simulation moves an instance
+std::vector<std::pair<uint64_t, uint32_t>> changeLog; // Revision and instance of each move not yet applied
+KeyboardState keyboard;
+bool snapshotStale = false;  // Something the render thread shows changed since the last publish
 int selectedObjectIndex = 0;
 bool transformMode = false;  // false = translate, true = rotate
 bool transformMode2 = false; // false = translate/rotate, true = scale
 bool wireframeMode = false;  // false = solid, true = wireframe
+bool depthPrepass = false;   // Depth-only pass before the lit one
+bool overdrawView = false;   // Shows shaded layers instead of lighting
+
+// Simulation to render thread handoff. GLFW only allows window calls on the
+// main thread, so the render thread leaves the title and viewport size to it.
+TripleBuffer<SceneSnapshot> snapshots;
+std::atomic<bool> renderThreadStop{ false };
+std::atomic<uint64_t> renderedRevision{ 0 }; // Last sceneRevision the render thread applied
+WakeSignal redrawRequest; // Wakes an idle render thread in on-demand mode
+std::atomic<uint32_t> framebufferSize{ (SCR_WIDTH << 16) | SCR_HEIGHT }; // Width in the high half
+std::mutex titleMutex;
+std::string windowTitle; // Set by the render thread, empty once applied
+int swapInterval = 1;
+bool onDemand = false; // Redraw only when something changed
+int maxFps = -1;       // 0 uncapped; negative picks the mode's default
 
 // Transformation speed
 float rotationSpeed = 50.0f;   // degrees per second
@@ -254,7 +119,9 @@ void displayHelp() {
     std::cout << "1 - Rotation mode\n";
     std::cout << "2 - Translation mode\n";
     std::cout << "3 - Scale mode\n";
-    std::cout << "4 - Toggle wireframe mode\n\n";
+    std::cout << "4 - Toggle wireframe mode\n";
+    std::cout << "5 - Toggle depth pre-pass\n";
+    std::cout << "6 - Toggle overdraw view\n\n";
     
     std::cout << "== Controls (in respective modes) ==\n";
     std::cout << "W/S or Up/Down - Y-axis movement/rotation/scale\n";
@@ -264,13 +131,85 @@ void displayHelp() {
     std::cout << "===============================\n\n";
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // --instances N lays out N copies of the model on a grid for stress testing
+    // --cpu-culling keeps visibility on the CPU even when GL 4.3 is available
+    // --upload-budget MB caps how much mesh data is uploaded per frame
+    // --trace FILE writes the profiler's timings as a Chrome trace on exit
+    // --swap-interval N waits for N refreshes per frame: 0 disables vsync, -1
+    //   asks for adaptive vsync where the driver supports it
+    // --jobs N sets the extra threads CPU culling and transforms are split
+    //   across, one per core beyond the render thread by default
+    // --depth-prepass starts with the depth pre-pass on
+    // --lights N lights the scene with N point lights through the clustered
+    //   shader; the default of one uses the single-light shader
+    // --shader-dir DIR reads the shaders from DIR, writing the built-in ones
+    //   there first, and reloads them whenever a file changes
+    // --no-shader-cache always compiles, instead of reusing the program
+    //   binaries saved in .shadercache by earlier runs
+    // --scene FILE loads the instances from a scene file, text or binary,
+    //   instead of laying out Suzannes
+    // --save-scene FILE writes the loaded instances as a binary scene file
+    // --vram-budget MB evicts the meshes out of view longest once theirs
+    //   exceeds MB, and reloads them from the mesh cache when seen again
+    // --on-demand only redraws when the scene, a setting or the window
+    //   changes, instead of every refresh
+    // --max-fps N caps the frame rate, 0 for no cap; on-demand mode caps
+    //   animation at 60 by default
+    int instanceCount = 2;
+    int lightCount = 1;
+    bool allowGpuCulling = true;
+    int jobThreads = -1;
+    size_t uploadBudget = 8;
+    std::string tracePath;
+    std::string scenePath;
+    std::string savePath;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            instanceCount = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--cpu-culling") == 0) {
+            allowGpuCulling = false;
+        } else if (std::strcmp(argv[i], "--upload-budget") == 0 && i + 1 < argc) {
+            uploadBudget = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (std::strcmp(argv[i], "--swap-interval") == 0 && i + 1 < argc) {
+            swapInterval = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobThreads = std::max(0, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--depth-prepass") == 0) {
+            depthPrepass = true;
+        } else if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc) {
+            lightCount = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--shader-dir") == 0 && i + 1 < argc) {
+            renderer.shaders.sourceDirectory = argv[++i];
+        } else if (std::strcmp(argv[i], "--no-shader-cache") == 0) {
+            renderer.shaders.cacheDirectory.clear();
+        } else if (std::strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            scenePath = argv[++i];
+        } else if (std::strcmp(argv[i], "--save-scene") == 0 && i + 1 < argc) {
+            savePath = argv[++i];
+        } else if (std::strcmp(argv[i], "--vram-budget") == 0 && i + 1 < argc) {
+            meshResidency.budgetBytes = static_cast<size_t>(std::max(0.0, std::atof(argv[++i])) * 1024 * 1024);
+        } else if (std::strcmp(argv[i], "--on-demand") == 0) {
+            onDemand = true;
+        } else if (std::strcmp(argv[i], "--max-fps") == 0 && i + 1 < argc) {
+            maxFps = std::max(0, std::atoi(argv[++i]));
+        }
+    }
+    
+    // Prefer GL 4.3 for GPU culling, falling back to 3.3 where it's missing
     glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     
     GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "OBJ Viewer", NULL, NULL);
+    if (window == NULL) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "OBJ Viewer", NULL, NULL);
+    }
     if (window == NULL) {
         std::cout << "Failed to create GLFW window" << std::endl;
         glfwTerminate();
@@ -279,27 +218,89 @@ int main() {
     glfwMakeContextCurrent(window);
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
     glfwSetKeyCallback(window, key_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
     
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
         std::cout << "Failed to initialize GLAD" << std::endl;
         return -1;
     }
     
-    GLuint shaderProgram = createShaderProgram(vertexShaderSource, fragmentShaderSource);
-    
-    glEnable(GL_DEPTH_TEST);
-    
-    try {
-        objects.push_back(new OBJ("../assets/Suzanne.obj"));
-        objects[0]->position = glm::vec3(-1.5f, 0.0f, 0.0f);
+    unsigned int cores = std::thread::hardware_concurrency();
+    if (jobThreads < 0) {
+        jobThreads = cores > 1 ? cores - 1 : 0;
+    }
+    if (!renderer.init(allowGpuCulling, !tracePath.empty(), jobThreads)) {
+        glfwTerminate();
+        return -1;
+    }
+    std::cout << "OpenGL " << glGetString(GL_VERSION) << ", "
+              << (renderer.gpuCulling ? "GPU culling (compute + multi-draw indirect)" : "CPU culling") << ", "
+              << renderer.jobs.threadCount() << " job threads, " << simdKernels().name << " kernels" << std::endl;
+    std::cout << "Shaders: " << renderer.shaders.programsBuilt << " programs in " << std::round(renderer.shaders.buildSeconds * 10000.0) / 10.0
+              << " ms, " << renderer.shaders.cacheHits << " from the binary cache"
+              << (renderer.shaders.binaryCache() ? "" : " (off)")
+              << (renderer.shaders.parallelCompile() ? ", parallel compile" : "") << std::endl;
+    
+    // Meshes load in the background while the window is already up
+    meshLoader.start(cores > 1 ? cores - 1 : 1);
+    uploadStream.init(uploadBudget * 1024 * 1024, glStorage.load());
+    std::cout << "Mesh loader: " << meshLoader.threadCount() << " threads, " << uploadBudget << " MB/frame upload budget ("
+              << (uploadStream.persistentlyMapped() ? "persistently mapped staging" : "glBufferSubData") << ")" << std::endl;
+    
+    float sceneHalfWidth = 1.5f;
+    if (!scenePath.empty()) {
+        auto loadStart = std::chrono::steady_clock::now();
+        if (loadSceneFile(scenePath, objects, meshCache, meshLoader)) {
+            std::cout << "Scene file " << scenePath << ": " << objects.size() << " instances in "
+                      << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count()
+                      << " ms" << std::endl;
+        }
         
-        objects.push_back(new OBJ("../assets/Suzanne.obj"));
-        objects[1]->position = glm::vec3(1.5f, 0.0f, 0.0f);
+        // Scenes wider than the default pair are framed like the grid, from
+        // the instance farthest off the z axis
+        for (const glm::vec3& position : objects.positions) {
+            sceneHalfWidth = std::max(sceneHalfWidth, std::max(std::abs(position.x), std::abs(position.y)));
+        }
+        if (sceneHalfWidth > 1.5f) {
+            cameraPos.z = std::max(cameraPos.z, sceneHalfWidth * 2.5f + 5.0f);
+            cameraFar = std::max(cameraFar, cameraPos.z * 2.0f);
+        }
+    } else {
+        try {
+            std::shared_ptr<Mesh> suzanne = meshCache.loadAsync("../assets/Suzanne.obj", meshLoader);
+            if (suzanne && instanceCount == 2) {
+                objects.add(suzanne, glm::vec3(-1.5f, 0.0f, 0.0f));
+                objects.add(meshCache.loadAsync("../assets/Suzanne.obj", meshLoader), glm::vec3(1.5f, 0.0f, 0.0f));
+            } else if (suzanne) {
+                const float spacing = 3.0f;
+                int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(instanceCount))));
+                float halfWidth = (columns - 1) * spacing * 0.5f;
+                sceneHalfWidth = halfWidth;
+                objects.reserve(instanceCount);
+                for (int i = 0; i < instanceCount; i++) {
+                    glm::vec3 position((i % columns) * spacing - halfWidth, (i / columns) * spacing - halfWidth, 0.0f);
+                    objects.add(suzanne, position);
+                }
+                // Back the camera off until the whole grid is in view
+                cameraPos.z = std::max(cameraPos.z, halfWidth * 2.5f + 5.0f);
+                cameraFar = std::max(cameraFar, cameraPos.z * 2.0f);
+            }
+        }
+        catch(const std::exception& e) {
+            std::cerr << "Error loading OBJ: " << e.what() << std::endl;
+        }
     }
-    catch(const std::exception& e) {
-        std::cerr << "Error loading OBJ: " << e.what() << std::endl;
+    if (!savePath.empty()) {
+        if (saveSceneFile(savePath, objects)) {
+            std::cout << "Wrote " << objects.size() << " instances to " << savePath << std::endl;
+        }
     }
     
+    renderer.lights = scatterLights(lightCount, sceneHalfWidth, LIGHT_RADIUS);
+    std::cout << "Scene: " << objects.size() << " instances of " << meshCache.size() << " meshes ("
+              << meshCache.misses << " loaded, " << meshCache.hits << " shared), " << renderer.lights.size()
+              << (renderer.lights.size() > 1 ? " clustered lights" : " light") << std::endl;
+    
     if (objects.empty()) {
         std::cout << "No objects loaded. Exiting." << std::endl;
         glfwTerminate();
@@ -309,194 +310,424 @@ int main() {
     // Show help at startup
     displayHelp();
     
-    // Set light parameters
-    glUseProgram(shaderProgram);
-    glUniform3f(glGetUniformLocation(shaderProgram, "lightPos"), 5.0f, 5.0f, 5.0f);
-    glUniform3f(glGetUniformLocation(shaderProgram, "lightColor"), 1.0f, 1.0f, 1.0f);
+    // The render thread draws its own copy of the instances
+    renderInstances = objects;
     
-    float lastFrame = 0.0f;
+    // GL moves to the render thread; this one keeps events, input and the simulation
+    publishSnapshot();
+    redrawRequest.notify();
+    glfwMakeContextCurrent(NULL);
+    std::thread renderThread(renderLoop, window);
     
+    // Ticks at the simulation rate only while a key is held; otherwise
+    // sleeps until the next event, which includes the render thread posting
+    // a new title
+    float lastFrame = glfwGetTime();
     while (!glfwWindowShouldClose(window)) {
+        bool idle = keyboard.held == 0;
+        if (idle) {
+            glfwWaitEvents();
+        } else {
+            glfwWaitEventsTimeout(SIMULATION_STEP);
+        }
         float currentFrame = glfwGetTime();
         float deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
         
-        processInput(window, deltaTime);
-        
-        glClearColor(0.1f, 0.1f, 0.2f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        
-        glUseProgram(shaderProgram);
-        glm::mat4 view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-        
-        glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+        // A key pressed after a long wait moves by one step, not by the wait
+        if (idle) {
+            deltaTime = std::min(deltaTime, static_cast<float>(SIMULATION_STEP));
+        }
         
-        for (size_t i = 0; i < objects.size(); i++) {
-            objects[i]->draw(shaderProgram, i == selectedObjectIndex, wireframeMode); // Pass wireframeMode here
+        processInput(window, deltaTime);
+        if (snapshotStale) {
+            publishSnapshot();
+            snapshotStale = false;
+            redrawRequest.notify();
         }
         
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        std::lock_guard<std::mutex> lock(titleMutex);
+        if (!windowTitle.empty()) {
+            glfwSetWindowTitle(window, windowTitle.c_str());
+            windowTitle.clear();
+        }
     }
     
-    for (auto obj : objects) {
-        delete obj;
+    renderThreadStop = true;
+    redrawRequest.notify();
+    renderThread.join();
+    glfwMakeContextCurrent(window);
+    
+    if (!tracePath.empty()) {
+        if (renderer.profiler.writeTrace(tracePath)) {
+            std::cout << "Wrote profiler trace to " << tracePath << std::endl;
+        } else {
+            std::cerr << "Failed to write profiler trace: " << tracePath << std::endl;
+        }
     }
+    
+    // Release GL resources while the context is still alive
+    meshLoader.stop();
+    uploadStream.destroy();
     objects.clear();
+    renderInstances.clear();
+    meshCache.clear();
+    renderer.destroy();
     
     glfwTerminate();
     return 0;
 }
 
-GLuint createShaderProgram(const char* vertexShaderSource, const char* fragmentShaderSource) {
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-    glCompileShader(vertexShader);
-    
-    int success;
-    char infoLog[512];
-    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+// Copies the simulation's current state into the snapshot the render thread
+// picks up next
+void publishSnapshot() {
+    SceneSnapshot& snapshot = snapshots.back();
+    
+    // The render thread only ever moves forward, so whatever it applies next
+    // is at least as new as what it has acknowledged. Changes up to there are
+    // already on its side; values sent again are current, so resending is
+    // harmless.
+    uint64_t rendered = renderedRevision.load(std::memory_order_acquire);
+    changeLog.erase(std::remove_if(changeLog.begin(), changeLog.end(),
+                                   [&](const std::pair<uint64_t, uint32_t>& change) { return change.first <= rendered; }),
+                    changeLog.end());
+    
+    snapshot.revision = sceneRevision;
+    snapshot.changedIndices.clear();
+    for (const std::pair<uint64_t, uint32_t>& change : changeLog) {
+        snapshot.changedIndices.push_back(change.second);
     }
-    
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-    glCompileShader(fragmentShader);
-    
-    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
-    }
-    
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-    
-    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-    if (!success) {
-        glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+    std::sort(snapshot.changedIndices.begin(), snapshot.changedIndices.end());
+    snapshot.changedIndices.erase(std::unique(snapshot.changedIndices.begin(), snapshot.changedIndices.end()),
+                                  snapshot.changedIndices.end());
+    
+    snapshot.fullCopy = snapshot.changedIndices.size() > objects.size() / SNAPSHOT_FULL_COPY_DIVISOR;
+    if (snapshot.fullCopy) {
+        snapshot.positions = objects.positions;
+        snapshot.rotations = objects.rotations;
+        snapshot.scales = objects.scales;
+        snapshot.changedIndices.clear();
+    } else {
+        snapshot.positions.clear();
+        snapshot.rotations.clear();
+        snapshot.scales.clear();
+        for (uint32_t index : snapshot.changedIndices) {
+            snapshot.positions.push_back(objects.positions[index]);
+            snapshot.rotations.push_back(objects.rotations[index]);
+            snapshot.scales.push_back(objects.scales[index]);
+        }
     }
-    
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
-    
-    return shaderProgram;
+    snapshot.selectedIndex = selectedObjectIndex;
+    snapshot.wireframeMode = wireframeMode;
+    snapshot.depthPrepass = depthPrepass;
+    snapshot.overdrawView = overdrawView;
+    snapshot.eye = cameraPos;
+    snapshot.view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
+    snapshot.projection = glm::perspective(glm::radians(45.0f), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, cameraFar);
+    snapshots.publish();
 }
 
-void processInput(GLFWwindow* window, float deltaTime) {
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
-        glfwSetWindowShouldClose(window, true);
+// Owns the GL context until asked to stop: streams uploads, applies the
+// latest snapshot, draws and presents, so a slow swap or vsync wait never
+// holds up input
+void renderLoop(GLFWwindow* window) {
+    glfwMakeContextCurrent(window);
+    if (swapInterval < 0 && !glfwExtensionSupported("WGL_EXT_swap_control_tear")
+        && !glfwExtensionSupported("GLX_EXT_swap_control_tear")) {
+        std::cout << "Adaptive vsync is not supported, using swap interval 1" << std::endl;
+        swapInterval = 1;
     }
-    
-    if (glfwGetKey(window, GLFW_KEY_H) == GLFW_PRESS) {
-        displayHelp();
+    glfwSwapInterval(swapInterval);
+    if (maxFps < 0) {
+        maxFps = onDemand ? ON_DEMAND_MAX_FPS : 0;
+    }
+    std::cout << "Render thread started, swap interval " << swapInterval
+              << (onDemand ? ", on-demand" : ", continuous") << " rendering";
+    if (maxFps > 0) {
+        std::cout << " capped at " << maxFps << " fps";
+    }
+    std::cout << std::endl;
+    auto frameInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(maxFps > 0 ? 1.0 / maxFps : 0.0));
+    auto nextFrame = std::chrono::steady_clock::now();
+    
+    // With a shader directory an idle render thread still wakes to let the
+    // shader manager look for changed files
+    double idleTimeout = renderer.shaders.sourceDirectory.empty() ? -1.0 : ShaderManager::SOURCE_POLL_SECONDS;
+    
+    // Pixels covered by one unit at distance one, for LOD selection
+    float pixelsPerUnit = SCR_HEIGHT / (2.0f * std::tan(glm::radians(45.0f) * 0.5f));
+    
+    float lastTitleUpdate = 0.0f;
+    uint32_t viewportSize = framebufferSize.load();
+    uint64_t appliedRevision = 0;
+    std::vector<const Mesh*> finishedMeshes;
+    
+    FrameProfiler& profiler = renderer.profiler;
+    RenderState& renderState = renderer.state;
+    
+    while (!renderThreadStop.load(std::memory_order_relaxed)) {
+        // Meshes still loading or streaming in keep frames coming; anything
+        // else that changes the picture notifies redrawRequest
+        if (onDemand && meshLoader.pending() == 0) {
+            redrawRequest.wait(idleTimeout);
+            if (renderThreadStop.load(std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        if (maxFps > 0) {
+            std::this_thread::sleep_until(nextFrame);
+            nextFrame = std::max(nextFrame, std::chrono::steady_clock::now()) + frameInterval;
+        }
+        
+        profiler.beginFrame();
+        float currentFrame = glfwGetTime();
+        renderState.beginFrame();
+        
+        {
+            ProfileScope scope(profiler, "snapshot");
+            snapshots.acquire();
+            const SceneSnapshot& snapshot = snapshots.front();
+            if (snapshot.revision != appliedRevision) {
+                if (snapshot.fullCopy) {
+                    for (size_t i = 0; i < renderInstances.size(); i++) {
+                        renderInstances.setPosition(i, snapshot.positions[i]);
+                        renderInstances.setRotation(i, snapshot.rotations[i]);
+                        renderInstances.setScale(i, snapshot.scales[i]);
+                    }
+                } else {
+                    for (size_t c = 0; c < snapshot.changedIndices.size(); c++) {
+                        uint32_t index = snapshot.changedIndices[c];
+                        renderInstances.setPosition(index, snapshot.positions[c]);
+                        renderInstances.setRotation(index, snapshot.rotations[c]);
+                        renderInstances.setScale(index, snapshot.scales[c]);
+                    }
+                }
+                appliedRevision = snapshot.revision;
+                renderedRevision.store(appliedRevision, std::memory_order_release);
+            }
+            
+            uint32_t size = framebufferSize.load(std::memory_order_relaxed);
+            if (size != viewportSize) {
+                viewportSize = size;
+                glViewport(0, 0, size >> 16, size & 0xFFFF);
+            }
+        }
+        
+        // Upload what the loader finished, within this frame's budget.
+        // Buffer creation binds VAOs and buffers behind the tracker's back.
+        {
+            ProfileScope scope(profiler, "upload");
+            finishedMeshes.clear();
+            renderState.stats.uploadedBytes = meshLoader.update(uploadStream, finishedMeshes);
+            for (const Mesh* mesh : finishedMeshes) {
+                renderInstances.meshResident(mesh);
+            }
+            if (renderState.stats.uploadedBytes > 0 || !finishedMeshes.empty()) {
+                renderState.invalidate();
+            }
+        }
+        {
+            ProfileScope scope(profiler, "transforms");
+            renderInstances.updateTransforms(&renderer.jobs);
+        }
+        
+        const SceneSnapshot& snapshot = snapshots.front();
+        {
+            ProfileScope scope(profiler, "residency");
+            Frustum frustum = Frustum::fromMatrix(snapshot.projection * snapshot.view);
+            if (meshResidency.update(renderInstances, frustum, meshLoader) > 0) {
+                renderer.invalidateMeshes();
+            }
+        }
+        renderer.depthPrepass = snapshot.depthPrepass;
+        renderer.overdrawView = snapshot.overdrawView;
+        renderer.measureOverdraw = snapshot.overdrawView;
+        renderer.draw(renderInstances, snapshot.selectedIndex, snapshot.wireframeMode, snapshot.view,
+                      snapshot.projection, snapshot.eye, pixelsPerUnit);
+        
+        // Driver overhead at a glance, refreshed twice a second
+        if (currentFrame - lastTitleUpdate >= 0.5f) {
+            lastTitleUpdate = currentFrame;
+            const FrameStats& stats = renderState.stats;
+            std::string title = "OBJ Viewer | " + std::to_string(stats.glCalls) + " GL calls ("
+                + std::to_string(stats.skippedCalls) + " skipped), " + std::to_string(stats.drawCalls) + " draws, ";
+            if (stats.gpuCulled) {
+                title += std::to_string(renderInstances.size()) + " instances culled on GPU";
+            } else {
+                title += std::to_string(stats.triangles) + " triangles, " + std::to_string(stats.visibleInstances)
+                    + " visible / " + std::to_string(stats.culledInstances) + " culled";
+            }
+            if (stats.lights > 1) {
+                title += ", " + std::to_string(stats.lights) + " lights (" + std::to_string(stats.lightReferences)
+                    + " in clusters)";
+            }
+            if (snapshot.overdrawView) {
+                char overdraw[32];
+                std::snprintf(overdraw, sizeof(overdraw), ", %.2f shaded/pixel", renderer.overdraw.latest());
+                title += overdraw;
+            }
+            if (meshLoader.pending() > 0) {
+                title += ", loading " + std::to_string(meshLoader.pending()) + " meshes";
+            }
+            char memory[96];
+            std::snprintf(memory, sizeof(memory), " | meshes %.1f MB", meshResidency.residentBytes / (1024.0 * 1024.0));
+            title += memory;
+            if (meshResidency.budgetBytes > 0) {
+                std::snprintf(memory, sizeof(memory), " of %.0f MB, %zu evicted",
+                              meshResidency.budgetBytes / (1024.0 * 1024.0), meshResidency.evictions);
+                title += memory;
+            }
+            long long freeBytes = driverFreeVideoMemory();
+            if (freeBytes >= 0) {
+                std::snprintf(memory, sizeof(memory), ", %lld MB free", freeBytes / (1024 * 1024));
+                title += memory;
+            }
+            title += " | " + profiler.summary();
+            
+            {
+                std::lock_guard<std::mutex> lock(titleMutex);
+                windowTitle = title;
+            }
+            glfwPostEmptyEvent();
+        }
+        
+        ProfileScope scope(profiler, "present");
+        glfwSwapBuffers(window);
     }
     
-    if (objects.empty() || selectedObjectIndex >= objects.size()) {
+    glfwMakeContextCurrent(NULL);
+}
+
+// Moves the selected object by the keys held this tick. One-shot keys are
+// handled by key_callback.
+void processInput(GLFWwindow* window, float deltaTime) {
+    if (keyboard.held == 0 || objects.empty() || selectedObjectIndex >= objects.size()) {
         return;
     }
     
-    OBJ* selectedObj = objects[selectedObjectIndex];
+    // Edit local copies; the setters only mark the instance dirty on change
+    size_t selected = static_cast<size_t>(selectedObjectIndex);
+    glm::vec3 position = objects.positions[selected];
+    glm::vec3 rotation = objects.rotations[selected];
+    glm::vec3 scale = objects.scales[selected];
     
     if (transformMode2) { // Scale mode
         float scaleChange = scaleSpeed * deltaTime;
         
         // Remove the uniform vs non-uniform condition, just keep the non-uniform scaling
-        if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
-            selectedObj->scale.y += scaleChange;
+        if (keyboard.isDown(GLFW_KEY_W)) {
+            scale.y += scaleChange;
         }
-        if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
-            selectedObj->scale.y -= scaleChange;
+        if (keyboard.isDown(GLFW_KEY_S)) {
+            scale.y -= scaleChange;
         }
-        if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
-            selectedObj->scale.x -= scaleChange;
+        if (keyboard.isDown(GLFW_KEY_A)) {
+            scale.x -= scaleChange;
         }
-        if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
-            selectedObj->scale.x += scaleChange;
+        if (keyboard.isDown(GLFW_KEY_D)) {
+            scale.x += scaleChange;
         }
-        if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) {
-            selectedObj->scale.z += scaleChange;
+        if (keyboard.isDown(GLFW_KEY_Q)) {
+            scale.z += scaleChange;
         }
-        if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) {
-            selectedObj->scale.z -= scaleChange;
+        if (keyboard.isDown(GLFW_KEY_E)) {
+            scale.z -= scaleChange;
         }
         
-        selectedObj->scale = glm::max(selectedObj->scale, glm::vec3(0.1f));
+        scale = glm::max(scale, glm::vec3(0.1f));
     } else if (transformMode) { // Rotation mode
         float rotChange = rotationSpeed * deltaTime;
         
-        if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
-            selectedObj->rotation.x += rotChange;
+        if (keyboard.isDown(GLFW_KEY_W)) {
+            rotation.x += rotChange;
         }
-        if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
-            selectedObj->rotation.x -= rotChange;
+        if (keyboard.isDown(GLFW_KEY_S)) {
+            rotation.x -= rotChange;
         }
-        if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
-            selectedObj->rotation.y += rotChange;
+        if (keyboard.isDown(GLFW_KEY_A)) {
+            rotation.y += rotChange;
         }
-        if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
-            selectedObj->rotation.y -= rotChange;
+        if (keyboard.isDown(GLFW_KEY_D)) {
+            rotation.y -= rotChange;
         }
-        if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) {
-            selectedObj->rotation.z += rotChange;
+        if (keyboard.isDown(GLFW_KEY_Q)) {
+            rotation.z += rotChange;
         }
-        if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) {
-            selectedObj->rotation.z -= rotChange;
+        if (keyboard.isDown(GLFW_KEY_E)) {
+            rotation.z -= rotChange;
         }
         
-        selectedObj->rotation.x = fmod(selectedObj->rotation.x, 360.0f);
-        selectedObj->rotation.y = fmod(selectedObj->rotation.y, 360.0f);
-        selectedObj->rotation.z = fmod(selectedObj->rotation.z, 360.0f);
+        rotation.x = fmod(rotation.x, 360.0f);
+        rotation.y = fmod(rotation.y, 360.0f);
+        rotation.z = fmod(rotation.z, 360.0f);
     } else { // Translation mode
         float moveSpeed = translationSpeed * deltaTime;
         
-        if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS || 
-            glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS) {
-            selectedObj->position.y += moveSpeed;
+        if (keyboard.isDown(GLFW_KEY_W, GLFW_KEY_UP)) {
+            position.y += moveSpeed;
         }
-        if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS || 
-            glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS) {
-            selectedObj->position.y -= moveSpeed;
+        if (keyboard.isDown(GLFW_KEY_S, GLFW_KEY_DOWN)) {
+            position.y -= moveSpeed;
         }
-        if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS || 
-            glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) {
-            selectedObj->position.x -= moveSpeed;
+        if (keyboard.isDown(GLFW_KEY_A, GLFW_KEY_LEFT)) {
+            position.x -= moveSpeed;
         }
-        if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS || 
-            glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS) {
-            selectedObj->position.x += moveSpeed;
+        if (keyboard.isDown(GLFW_KEY_D, GLFW_KEY_RIGHT)) {
+            position.x += moveSpeed;
         }
-        if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) {
-            selectedObj->position.z -= moveSpeed;
+        if (keyboard.isDown(GLFW_KEY_Q)) {
+            position.z -= moveSpeed;
         }
-        if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) {
-            selectedObj->position.z += moveSpeed;
+        if (keyboard.isDown(GLFW_KEY_E)) {
+            position.z += moveSpeed;
         }
     }
+    
+    if (position != objects.positions[selected] || rotation != objects.rotations[selected]
+        || scale != objects.scales[selected]) {
+        objects.setPosition(selected, position);
+        objects.setRotation(selected, rotation);
+        objects.setScale(selected, scale);
+        sceneRevision++;
+        changeLog.emplace_back(sceneRevision, static_cast<uint32_t>(selected));
+        snapshotStale = true;
+    }
 }
 
+// The render thread owns the context and applies the new viewport
 void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
-    glViewport(0, 0, width, height);
+    framebufferSize = (static_cast<uint32_t>(width) << 16) | static_cast<uint32_t>(height);
+    redrawRequest.notify();
 }
 
+// The window was uncovered or needs repainting for another reason
+void window_refresh_callback(GLFWwindow* window) {
+    redrawRequest.notify();
+}
+
+// Records held keys for processInput and acts on one-shot keys once per
+// press, ignoring key repeat
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    if (action == GLFW_RELEASE) {
+        keyboard.set(key, false);
+        return;
+    }
     if (action != GLFW_PRESS) {
         return;
     }
+    keyboard.set(key, true);
     
     switch (key) {
+        case GLFW_KEY_ESCAPE:
+            glfwSetWindowShouldClose(window, true);
+            break;
         case GLFW_KEY_TAB:
             if (!objects.empty()) {
                 selectedObjectIndex = (selectedObjectIndex + 1) % objects.size();
                 std::cout << "Selected object: " << selectedObjectIndex + 1 << "/" << objects.size()
-                          << " (" << objects[selectedObjectIndex]->name << ")" << std::endl;
+                          << " (" << objects.meshes[selectedObjectIndex]->name << ")" << std::endl;
+                snapshotStale = true;
             }
             break;
         case GLFW_KEY_1:
@@ -518,6 +749,17 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
             // Toggle wireframe mode
             wireframeMode = !wireframeMode;
             std::cout << "Wireframe mode: " << (wireframeMode ? "ON" : "OFF") << std::endl;
+            snapshotStale = true;
+            break;
+        case GLFW_KEY_5:
+            depthPrepass = !depthPrepass;
+            std::cout << "Depth pre-pass: " << (depthPrepass ? "ON" : "OFF") << std::endl;
+            snapshotStale = true;
+            break;
+        case GLFW_KEY_6:
+            overdrawView = !overdrawView;
+            std::cout << "Overdraw view: " << (overdrawView ? "ON" : "OFF") << std::endl;
+            snapshotStale = true;
             break;
         case GLFW_KEY_H:
             displayHelp();
@@ -0,0 +1,535 @@
+// Headless benchmark: loads a scene description, renders a fixed camera path
+// into an offscreen framebuffer with vsync off and prints the results as JSON
+#include "M1Core.h"
+
+#include <cstdio>
+
+// Frames the CPU may run ahead of the GPU before it waits on a fence, so
+// frame times include the GPU's work instead of just queueing it
+const unsigned int BENCH_FRAMES_IN_FLIGHT = 2;
+
+// What to load and how to look at it, read from a text file:
+//   mesh <path> <count>        instances of an OBJ, relative to the scene file
+//   scene <path>               every instance of a scene file (see
+//                              loadSceneFile), relative to this one
+//   spacing <units>            grid spacing between instances (default 3)
+//   lights <count> [radius]    point lights, as the viewer's --lights, with
+//                              the given reach (default 1 light, radius 4)
+//   camera <px py pz> <tx ty tz> camera keyframe: position and target
+//   frames <n> / warmup <n>    measured and discarded frames
+//   resolution <width> <height>
+// Instances of every mesh share one grid centered on the origin, which scene
+// files' instances are added to where they stand. The camera
+// moves linearly through its keyframes over the measured frames; without any
+// it looks at the grid from far enough away to see all of it.
+struct BenchScene {
+    struct MeshEntry {
+        std::string path;
+        int count;
+    };
+    
+    struct CameraKey {
+        glm::vec3 position;
+        glm::vec3 target;
+    };
+    
+    std::vector<MeshEntry> meshes;
+    std::vector<std::string> sceneFiles;
+    std::vector<CameraKey> camera;
+    float spacing = 3.0f;
+    int lights = 1;
+    float lightRadius = 4.0f;
+    int frames = 600;
+    int warmup = 60;
+    int width = 1280;
+    int height = 720;
+    
+    bool load(const std::string& path);
+    int instanceCount() const;
+    CameraKey cameraAt(float t) const;
+};
+
+bool BenchScene::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open scene file: " << path << std::endl;
+        return false;
+    }
+    
+    std::filesystem::path directory = std::filesystem::path(path).parent_path();
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        std::istringstream words(line);
+        std::string keyword;
+        if (!(words >> keyword) || keyword[0] == '#') {
+            continue;
+        }
+        
+        bool valid = false;
+        if (keyword == "mesh") {
+            MeshEntry entry;
+            if (words >> entry.path >> entry.count && entry.count > 0) {
+                entry.path = (directory / entry.path).string();
+                meshes.push_back(entry);
+                valid = true;
+            }
+        } else if (keyword == "scene") {
+            std::string scenePath;
+            if (words >> scenePath) {
+                sceneFiles.push_back((directory / scenePath).string());
+                valid = true;
+            }
+        } else if (keyword == "camera") {
+            CameraKey key;
+            valid = static_cast<bool>(words >> key.position.x >> key.position.y >> key.position.z
+                                            >> key.target.x >> key.target.y >> key.target.z);
+            if (valid) {
+                camera.push_back(key);
+            }
+        } else if (keyword == "spacing") {
+            valid = static_cast<bool>(words >> spacing) && spacing > 0.0f;
+        } else if (keyword == "lights") {
+            valid = static_cast<bool>(words >> lights) && lights > 0;
+            if (valid && !(words >> lightRadius)) {
+                lightRadius = 4.0f;
+            }
+            valid = valid && lightRadius > 0.0f;
+        } else if (keyword == "frames") {
+            valid = static_cast<bool>(words >> frames) && frames > 0;
+        } else if (keyword == "warmup") {
+            valid = static_cast<bool>(words >> warmup) && warmup >= 0;
+        } else if (keyword == "resolution") {
+            valid = static_cast<bool>(words >> width >> height) && width > 0 && height > 0;
+        }
+        if (!valid) {
+            std::cerr << path << ":" << lineNumber << ": invalid line: " << line << std::endl;
+            return false;
+        }
+    }
+    
+    if (meshes.empty() && sceneFiles.empty()) {
+        std::cerr << "Scene file has no meshes: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int BenchScene::instanceCount() const {
+    int count = 0;
+    for (const MeshEntry& entry : meshes) {
+        count += entry.count;
+    }
+    return count;
+}
+
+// Position along the camera path, t from 0 to 1
+BenchScene::CameraKey BenchScene::cameraAt(float t) const {
+    if (camera.size() == 1) {
+        return camera[0];
+    }
+    float position = std::clamp(t, 0.0f, 1.0f) * (camera.size() - 1);
+    size_t segment = std::min(static_cast<size_t>(position), camera.size() - 2);
+    float blend = position - segment;
+    return { glm::mix(camera[segment].position, camera[segment + 1].position, blend),
+             glm::mix(camera[segment].target, camera[segment + 1].target, blend) };
+}
+
+// Offscreen color and depth target, so the resolution doesn't depend on the
+// window and nothing waits on presentation
+struct BenchTarget {
+    GLuint framebuffer = 0;
+    GLuint color = 0;
+    GLuint depth = 0;
+    
+    bool create(int width, int height);
+    void destroy();
+};
+
+bool BenchTarget::create(int width, int height) {
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Offscreen framebuffer is incomplete" << std::endl;
+        return false;
+    }
+    glViewport(0, 0, width, height);
+    return true;
+}
+
+void BenchTarget::destroy() {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(1, &color);
+    glDeleteRenderbuffers(1, &depth);
+}
+
+static std::string jsonString(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+int main(int argc, char** argv) {
+    // M1Bench SCENE [--frames N] [--output FILE] [--cpu-culling] [--upload-budget MB] [--trace FILE] [--jobs N]
+    //               [--depth-prepass] [--no-shader-cache] [--vram-budget MB]
+    // --frames overrides the scene's measured frame count
+    // --output writes the JSON to FILE instead of stdout
+    // --jobs sets the extra threads CPU culling and transforms are split across
+    // --depth-prepass draws depth only before the lit pass
+    // --no-shader-cache compiles every program instead of loading saved binaries
+    // --vram-budget evicts meshes out of view once theirs exceeds MB, as the viewer's
+    std::string scenePath;
+    std::string outputPath;
+    std::string tracePath;
+    int framesOverride = 0;
+    bool allowGpuCulling = true;
+    size_t uploadBudget = 8;
+    int jobThreads = -1;
+    bool depthPrepass = false;
+    bool shaderCache = true;
+    size_t vramBudget = 0;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            framesOverride = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--cpu-culling") == 0) {
+            allowGpuCulling = false;
+        } else if (std::strcmp(argv[i], "--upload-budget") == 0 && i + 1 < argc) {
+            uploadBudget = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (std::strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobThreads = std::max(0, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--depth-prepass") == 0) {
+            depthPrepass = true;
+        } else if (std::strcmp(argv[i], "--no-shader-cache") == 0) {
+            shaderCache = false;
+        } else if (std::strcmp(argv[i], "--vram-budget") == 0 && i + 1 < argc) {
+            vramBudget = static_cast<size_t>(std::max(0.0, std::atof(argv[++i])) * 1024 * 1024);
+        } else if (scenePath.empty()) {
+            scenePath = argv[i];
+        }
+    }
+    if (scenePath.empty()) {
+        std::cerr << "Usage: M1Bench SCENE [--frames N] [--output FILE] [--cpu-culling] [--upload-budget MB] [--trace FILE]"
+                  << " [--jobs N] [--depth-prepass] [--no-shader-cache] [--vram-budget MB]" << std::endl;
+        return -1;
+    }
+    
+    // Keep stdout for the JSON; the loader's and renderer's logs go to stderr
+    std::streambuf* stdoutBuffer = std::cout.rdbuf(std::cerr.rdbuf());
+    
+    BenchScene scene;
+    if (!scene.load(scenePath)) {
+        std::cout.rdbuf(stdoutBuffer);
+        return -1;
+    }
+    if (framesOverride > 0) {
+        scene.frames = framesOverride;
+    }
+    
+    SceneRenderer renderer;
+    BenchTarget target;
+    MeshLoader meshLoader;
+    UploadStream uploadStream;
+    MeshCache meshCache;
+    MeshResidency residency;
+    InstanceArray objects;
+    GLsync fences[BENCH_FRAMES_IN_FLIGHT] = {};
+    bool glLoaded = false;
+    
+    // Every exit from here on, failed or not, releases what was created
+    // while the context is still current, restores stdout and shuts GLFW down
+    auto finish = [&](int status) {
+        meshLoader.stop();
+        if (glLoaded) {
+            for (GLsync fence : fences) {
+                if (fence) {
+                    glDeleteSync(fence);
+                }
+            }
+            uploadStream.destroy();
+            objects.clear();
+            meshCache.clear();
+            target.destroy();
+            renderer.destroy();
+        }
+        std::cout.rdbuf(stdoutBuffer);
+        glfwTerminate();
+        return status;
+    };
+    
+    glfwInit();
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    
+    GLFWwindow* window = glfwCreateWindow(64, 64, "OBJ Viewer Benchmark", NULL, NULL);
+    if (window == NULL) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        window = glfwCreateWindow(64, 64, "OBJ Viewer Benchmark", NULL, NULL);
+    }
+    if (window == NULL) {
+        std::cerr << "Failed to create GLFW window" << std::endl;
+        return finish(-1);
+    }
+    glfwMakeContextCurrent(window);
+    glfwSwapInterval(0);
+    
+    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
+        std::cerr << "Failed to initialize GLAD" << std::endl;
+        return finish(-1);
+    }
+    glLoaded = true;
+    
+    unsigned int cores = std::thread::hardware_concurrency();
+    if (jobThreads < 0) {
+        jobThreads = cores > 1 ? cores - 1 : 0;
+    }
+    if (!shaderCache) {
+        renderer.shaders.cacheDirectory.clear();
+    }
+    if (!renderer.init(allowGpuCulling, !tracePath.empty(), jobThreads) || !target.create(scene.width, scene.height)) {
+        return finish(-1);
+    }
+    // Shaded fragments are counted on every frame to show what the pre-pass saves
+    renderer.depthPrepass = depthPrepass;
+    renderer.measureOverdraw = true;
+    std::string glVersion = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+    std::string glRenderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+    long long freeBefore = driverFreeVideoMemory();
+    
+    // Load everything up front and time it, uploads included
+    meshLoader.start(cores > 1 ? cores - 1 : 1);
+    uploadStream.init(uploadBudget * 1024 * 1024, glStorage.load());
+    residency.budgetBytes = vramBudget;
+    
+    auto loadStart = std::chrono::steady_clock::now();
+    int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(scene.instanceCount()))));
+    float halfWidth = std::max(columns - 1, 0) * scene.spacing * 0.5f;
+    objects.reserve(scene.instanceCount());
+    for (const BenchScene::MeshEntry& entry : scene.meshes) {
+        std::shared_ptr<Mesh> mesh = meshCache.loadAsync(entry.path, meshLoader);
+        for (int i = 0; i < entry.count; i++) {
+            int slot = static_cast<int>(objects.size());
+            glm::vec3 position((slot % columns) * scene.spacing - halfWidth, (slot / columns) * scene.spacing - halfWidth, 0.0f);
+            objects.add(mesh, position);
+        }
+    }
+    for (const std::string& sceneFile : scene.sceneFiles) {
+        if (!loadSceneFile(sceneFile, objects, meshCache, meshLoader)) {
+            return finish(-1);
+        }
+    }
+    for (size_t i = scene.instanceCount(); i < objects.size(); i++) {
+        halfWidth = std::max(halfWidth, std::max(std::abs(objects.positions[i].x), std::abs(objects.positions[i].y)));
+    }
+    
+    std::vector<const Mesh*> finishedMeshes;
+    while (meshLoader.pending() > 0) {
+        finishedMeshes.clear();
+        meshLoader.update(uploadStream, finishedMeshes);
+        for (const Mesh* mesh : finishedMeshes) {
+            objects.meshResident(mesh);
+        }
+    }
+    double loadMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+    renderer.state.invalidate();
+    
+    // Every distinct mesh once, for the memory tally
+    std::vector<const Mesh*> meshes;
+    for (const std::shared_ptr<Mesh>& mesh : objects.meshes) {
+        if (std::find(meshes.begin(), meshes.end(), mesh.get()) == meshes.end()) {
+            meshes.push_back(mesh.get());
+        }
+    }
+    size_t vramAllocated = static_cast<size_t>(scene.width) * scene.height * 8; // RGBA8 + 32-bit depth
+    for (const Mesh* mesh : meshes) {
+        if (!mesh->resident) {
+            std::cerr << "Failed to load mesh: " << mesh->name << std::endl;
+            return finish(-1);
+        }
+        vramAllocated += mesh->gpuBytes;
+    }
+    
+    if (scene.camera.empty()) {
+        scene.camera.push_back({ glm::vec3(0.0f, 0.0f, std::max(5.0f, halfWidth * 2.5f + 5.0f)), glm::vec3(0.0f) });
+    }
+    float farPlane = 100.0f;
+    for (const BenchScene::CameraKey& key : scene.camera) {
+        farPlane = std::max(farPlane, (glm::length(key.position) + halfWidth * 1.5f) * 2.0f);
+    }
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)scene.width / (float)scene.height, 0.1f, farPlane);
+    float pixelsPerUnit = scene.height / (2.0f * std::tan(glm::radians(45.0f) * 0.5f));
+    
+    std::vector<double> frameTimes;
+    frameTimes.reserve(scene.frames);
+    double drawCalls = 0.0, glCalls = 0.0, triangles = 0.0, lightReferences = 0.0;
+    renderer.lights = scatterLights(scene.lights, halfWidth, scene.lightRadius);
+    
+    int totalFrames = scene.warmup + scene.frames;
+    auto measureStart = std::chrono::steady_clock::now();
+    auto frameStart = measureStart;
+    for (int frame = 0; frame < totalFrames; frame++) {
+        // Wait for the frame that last used this slot before queueing another
+        GLsync& fence = fences[frame % BENCH_FRAMES_IN_FLIGHT];
+        if (fence) {
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {
+            }
+            glDeleteSync(fence);
+        }
+        
+        auto now = std::chrono::steady_clock::now();
+        if (frame == scene.warmup) {
+            measureStart = now;
+            renderer.overdraw.reset();
+        } else if (frame > scene.warmup) {
+            frameTimes.push_back(std::chrono::duration<double, std::milli>(now - frameStart).count());
+        }
+        frameStart = now;
+        
+        renderer.profiler.beginFrame();
+        renderer.state.beginFrame();
+        
+        // Only meshes evicted under a budget are ever reloaded here
+        finishedMeshes.clear();
+        renderer.state.stats.uploadedBytes = meshLoader.update(uploadStream, finishedMeshes);
+        for (const Mesh* mesh : finishedMeshes) {
+            objects.meshResident(mesh);
+        }
+        if (renderer.state.stats.uploadedBytes > 0 || !finishedMeshes.empty()) {
+            renderer.state.invalidate();
+        }
+        objects.updateTransforms(&renderer.jobs);
+        
+        int measured = std::max(0, frame - scene.warmup);
+        BenchScene::CameraKey camera = scene.cameraAt(scene.frames > 1 ? measured / float(scene.frames - 1) : 0.0f);
+        glm::mat4 view = glm::lookAt(camera.position, camera.target, glm::vec3(0.0f, 1.0f, 0.0f));
+        if (residency.update(objects, Frustum::fromMatrix(projection * view), meshLoader) > 0) {
+            renderer.invalidateMeshes();
+        }
+        renderer.draw(objects, -1, false, view, projection, camera.position, pixelsPerUnit);
+        
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glfwPollEvents();
+        
+        if (frame >= scene.warmup) {
+            const FrameStats& stats = renderer.state.stats;
+            drawCalls += stats.drawCalls;
+            glCalls += stats.glCalls;
+            triangles += stats.triangles;
+            lightReferences += stats.lightReferences;
+        }
+    }
+    glFinish();
+    auto measureEnd = std::chrono::steady_clock::now();
+    frameTimes.push_back(std::chrono::duration<double, std::milli>(measureEnd - frameStart).count());
+    double measureSeconds = std::chrono::duration<double>(measureEnd - measureStart).count();
+    long long freeAfter = driverFreeVideoMemory();
+    
+    std::vector<double> sorted = frameTimes;
+    std::sort(sorted.begin(), sorted.end());
+    // Nearest rank: the smallest time at least that fraction of frames fit under
+    auto percentile = [&](double fraction) {
+        size_t rank = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+        return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+    };
+    double meanFrame = 0.0;
+    for (double time : frameTimes) {
+        meanFrame += time;
+    }
+    meanFrame /= frameTimes.size();
+    
+    std::ostream stdoutStream(stdoutBuffer);
+    std::ofstream outputFile;
+    if (!outputPath.empty()) {
+        outputFile.open(outputPath, std::ios::trunc);
+        if (!outputFile.is_open()) {
+            std::cerr << "Failed to open output file: " << outputPath << std::endl;
+        }
+    }
+    std::ostream& out = outputFile.is_open() ? static_cast<std::ostream&>(outputFile) : stdoutStream;
+    
+    // Triangles are only counted when culling on the CPU; with GPU culling the
+    // CPU never learns which LODs were drawn
+    double frames = scene.frames;
+    out << std::fixed << std::setprecision(3);
+    out << "{\n";
+    out << "  \"scene\": " << jsonString(scenePath) << ",\n";
+    out << "  \"renderer\": " << jsonString(glRenderer) << ",\n";
+    out << "  \"glVersion\": " << jsonString(glVersion) << ",\n";
+    out << "  \"culling\": \"" << (renderer.gpuCulling ? "gpu" : "cpu") << "\",\n";
+    out << "  \"jobThreads\": " << renderer.jobs.threadCount() << ",\n";
+    out << "  \"simd\": \"" << simdKernels().name << "\",\n";
+    out << "  \"lights\": " << renderer.lights.size() << ",\n";
+    out << "  \"depthPrepass\": " << (depthPrepass ? "true" : "false") << ",\n";
+    out << "  \"resolution\": [" << scene.width << ", " << scene.height << "],\n";
+    out << "  \"instances\": " << objects.size() << ",\n";
+    out << "  \"meshes\": " << meshes.size() << ",\n";
+    out << "  \"loadMilliseconds\": " << loadMilliseconds << ",\n";
+    out << "  \"shaderPrograms\": " << renderer.shaders.programsBuilt << ",\n";
+    out << "  \"shaderCacheHits\": " << renderer.shaders.cacheHits << ",\n";
+    out << "  \"shaderBuildMilliseconds\": " << renderer.shaders.buildSeconds * 1000.0 << ",\n";
+    out << "  \"warmupFrames\": " << scene.warmup << ",\n";
+    out << "  \"frames\": " << scene.frames << ",\n";
+    out << "  \"framesPerSecond\": " << frames / measureSeconds << ",\n";
+    out << "  \"frameMilliseconds\": { \"mean\": " << meanFrame << ", \"p50\": " << percentile(0.5)
+        << ", \"p99\": " << percentile(0.99) << ", \"max\": " << sorted.back() << " },\n";
+    out << "  \"drawCallsPerFrame\": " << drawCalls / frames << ",\n";
+    out << "  \"glCallsPerFrame\": " << glCalls / frames << ",\n";
+    if (renderer.gpuCulling) {
+        out << "  \"trianglesPerFrame\": null,\n";
+    } else {
+        out << "  \"trianglesPerFrame\": " << triangles / frames << ",\n";
+    }
+    out << "  \"lightReferencesPerFrame\": " << lightReferences / frames << ",\n";
+    out << "  \"shadedSamplesPerPixel\": " << renderer.overdraw.average() << ",\n";
+    out << "  \"vramAllocatedBytes\": " << vramAllocated << ",\n";
+    out << "  \"vramBudgetBytes\": " << residency.budgetBytes << ",\n";
+    out << "  \"meshBytesResident\": " << residency.residentBytes << ",\n";
+    out << "  \"meshBytesPeak\": " << residency.peakBytes << ",\n";
+    out << "  \"meshEvictions\": " << residency.evictions << ",\n";
+    out << "  \"meshReloads\": " << residency.reloads << ",\n";
+    if (freeBefore >= 0 && freeAfter >= 0) {
+        out << "  \"vramDriverBytes\": " << freeBefore - freeAfter << "\n";
+    } else {
+        out << "  \"vramDriverBytes\": null\n";
+    }
+    out << "}" << std::endl;
+    
+    if (!tracePath.empty()) {
+        if (renderer.profiler.writeTrace(tracePath)) {
+            std::cout << "Wrote profiler trace to " << tracePath << std::endl;
+        } else {
+            std::cerr << "Failed to write profiler trace: " << tracePath << std::endl;
+        }
+    }
+    
+    return finish(0);
+}
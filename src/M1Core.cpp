@@ -0,0 +1,3007 @@
+#include "M1Core.h"
+
+// Shader sources. Each program is a permutation of these, picked by the
+// #defines ShaderManager inserts after the #version line:
+//   DEPTH_ONLY        positions only, for the depth pre-pass
+//   OVERDRAW          flat additive color for the overdraw view
+//   CLUSTERED_LIGHTS  many point lights, looked up per cluster
+// and the plain single-light shader without any.
+const char* sceneVertexShaderSource = R"(
+    #version 330 core
+    layout (location = 0) in vec3 aPos;
+    #ifndef DEPTH_ONLY
+    layout (location = 1) in vec3 aNormal;
+    #endif
+    
+    // Per-instance attributes (divisor 1)
+    layout (location = 3) in mat4 instanceModel;
+    #ifndef DEPTH_ONLY
+    layout (location = 7) in float instanceSelected;
+    layout (location = 8) in mat3 instanceNormalMatrix;
+    #endif
+    
+    // Decodes quantized positions back to model space
+    uniform vec3 positionScale;
+    uniform vec3 positionOffset;
+    
+    // Shared by every program; see CameraBlock
+    layout (std140) uniform Camera {
+        mat4 view;
+        mat4 projection;
+    };
+    
+    #ifndef DEPTH_ONLY
+    out vec3 Normal;
+    out vec3 FragPos;
+    out vec3 SelColor;
+    out vec3 ViewPos; // For the clustered shader's cluster lookup
+    #endif
+    
+    // Computed the same way in every permutation, so after the depth
+    // pre-pass GL_EQUAL matches
+    invariant gl_Position;
+    
+    void main() {
+        mat4 model = instanceModel;
+        vec3 position = aPos * positionScale + positionOffset;
+        gl_Position = projection * view * model * vec4(position, 1.0);
+    #ifndef DEPTH_ONLY
+        FragPos = vec3(model * vec4(position, 1.0));
+        ViewPos = vec3(view * vec4(FragPos, 1.0));
+        Normal = instanceNormalMatrix * aNormal;
+        SelColor = instanceSelected > 0.5 ? vec3(0.9, 0.6, 0.1) : vec3(1.0, 1.0, 1.0);
+    #endif
+    }
+)";
+
+// The clustered permutation finds the fragment's cluster from its screen
+// tile and view depth, then only loops over that cluster's lights, which
+// LightClusters binned on the CPU. All tables live in one RGBA32UI buffer
+// texture; see LightClusters for the layout.
+//
+// The overdraw permutation adds the same amount for every shaded fragment
+// under additive blending, so brightness counts the layers the lit shader
+// ran for. Red saturates at 5 layers, yellow at 10 and white at 20.
+const char* sceneFragmentShaderSource = R"(
+    #version 330 core
+    #if defined(DEPTH_ONLY)
+    void main() {
+    }
+    #elif defined(OVERDRAW)
+    out vec4 FragColor;
+    
+    void main() {
+        FragColor = vec4(0.2, 0.1, 0.05, 1.0);
+    }
+    #elif defined(CLUSTERED_LIGHTS)
+    out vec4 FragColor;
+    
+    in vec3 Normal;
+    in vec3 FragPos;
+    in vec3 SelColor;
+    in vec3 ViewPos;
+    
+    layout (std140) uniform Camera {
+        mat4 view;
+        mat4 projection;
+    };
+    
+    uniform usamplerBuffer lightData;
+    uniform ivec3 lightTables;   // First texel of the lights, clusters and indices
+    uniform ivec3 clusterCounts; // Tiles across, tiles down, depth slices
+    uniform vec2 sliceScaleBias; // slice = log(depth) * scale + bias
+    uniform vec3 ambientColor;
+    
+    void main() {
+        vec4 clip = projection * vec4(ViewPos, 1.0);
+        ivec2 tile = ivec2(floor((clip.xy / clip.w * 0.5 + 0.5) * vec2(clusterCounts.xy)));
+        tile = clamp(tile, ivec2(0), clusterCounts.xy - 1);
+        int slice = int(floor(log(-ViewPos.z) * sliceScaleBias.x + sliceScaleBias.y));
+        slice = clamp(slice, 0, clusterCounts.z - 1);
+        uvec4 cluster = texelFetch(lightData, lightTables.y + (slice * clusterCounts.y + tile.y) * clusterCounts.x + tile.x);
+        
+        vec3 norm = normalize(Normal);
+        vec3 diffuse = vec3(0.0);
+        for (uint n = 0u; n < cluster.y; n++) {
+            uint entry = cluster.x + n;
+            int light = int(texelFetch(lightData, lightTables.z + int(entry >> 2u))[int(entry & 3u)]);
+            vec4 positionRadius = uintBitsToFloat(texelFetch(lightData, lightTables.x + light * 2));
+            vec3 color = uintBitsToFloat(texelFetch(lightData, lightTables.x + light * 2 + 1)).rgb;
+            
+            // Smooth falloff to zero at the radius; radius 0 never falls off
+            vec3 toLight = positionRadius.xyz - FragPos;
+            float attenuation = 1.0;
+            if (positionRadius.w > 0.0) {
+                float fraction = min(dot(toLight, toLight) / (positionRadius.w * positionRadius.w), 1.0);
+                attenuation = (1.0 - fraction) * (1.0 - fraction);
+            }
+            diffuse += max(dot(norm, normalize(toLight)), 0.0) * attenuation * color;
+        }
+        
+        vec3 result = (0.3 * ambientColor + diffuse) * SelColor;
+        FragColor = vec4(result, 1.0);
+    }
+    #else
+    out vec4 FragColor;
+    
+    in vec3 Normal;
+    in vec3 FragPos;
+    in vec3 SelColor;
+    
+    uniform vec3 lightPos;
+    uniform vec3 lightColor;
+    
+    void main() {
+        // Ambient
+        float ambientStrength = 0.3;
+        vec3 ambient = ambientStrength * lightColor;
+        
+        // Diffuse
+        vec3 norm = normalize(Normal);
+        vec3 lightDir = normalize(lightPos - FragPos);
+        float diff = max(dot(norm, lightDir), 0.0);
+        vec3 diffuse = diff * lightColor;
+        
+        vec3 result = (ambient + diffuse) * SelColor;
+        FragColor = vec4(result, 1.0);
+    }
+    #endif
+)";
+
+// GPU culling pass (GL 4.3). Frustum-tests every instance's bounding sphere
+// and appends the survivors to their mesh and LOD's range of the visible
+// instance buffer, bumping the instance count of that indirect draw command.
+// Each mesh owns MAX_LODS + 1 commands: one per LOD, then the selected one.
+const char* cullComputeSource = R"(
+    #version 430 core
+    layout (local_size_x = 64) in;
+    
+    struct Instance {
+        mat4 model;
+        vec4 normalMatrix[3];
+        vec4 sphere;
+        uint batch;
+        uint index;
+        uint padding[2];
+    };
+    
+    struct DrawCommand {
+        uint count;
+        uint instanceCount;
+        uint firstIndex;
+        int baseVertex;
+        uint baseInstance;
+    };
+    
+    layout (std430, binding = 0) readonly buffer Instances { Instance instances[]; };
+    layout (std430, binding = 1) buffer Commands { DrawCommand commands[]; };
+    
+    // Tightly packed InstanceData records, read back as vertex attributes
+    layout (std430, binding = 2) writeonly buffer Visible { float visibleData[]; };
+    
+    // Relative simplification error of each mesh's LODs, huge when unused
+    layout (std430, binding = 3) readonly buffer LodErrors { vec4 lodErrors[]; };
+    
+    const uint MAX_LODS = 4u; // Matches MAX_LODS on the CPU
+    
+    uniform vec4 planes[6];
+    uniform uint instanceCount;
+    uniform int selectedIndex;
+    uniform vec3 eye;
+    uniform float pixelsPerUnit;
+    uniform float lodPixelError;
+    
+    void main() {
+        uint i = gl_GlobalInvocationID.x;
+        if (i >= instanceCount) {
+            return;
+        }
+        
+        Instance instance = instances[i];
+        for (int p = 0; p < 6; p++) {
+            if (dot(planes[p].xyz, instance.sphere.xyz) + planes[p].w < -instance.sphere.w) {
+                return;
+            }
+        }
+        
+        // Coarsest LOD whose error still projects below the pixel threshold
+        float distance = max(length(instance.sphere.xyz - eye) - instance.sphere.w, 0.001);
+        float pixelsPerError = instance.sphere.w / distance * pixelsPerUnit;
+        vec4 errors = lodErrors[instance.batch];
+        uint lod = 0u;
+        for (uint l = 1u; l < MAX_LODS; l++) {
+            if (errors[l] * pixelsPerError <= lodPixelError) {
+                lod = l;
+            }
+        }
+        
+        uint command = instance.batch * (MAX_LODS + 1u) + lod;
+        uint slot;
+        float selected = 0.0;
+        if (int(instance.index) == selectedIndex) {
+            uint selectedCommand = instance.batch * (MAX_LODS + 1u) + MAX_LODS;
+            commands[selectedCommand].count = commands[command].count;
+            commands[selectedCommand].firstIndex = commands[command].firstIndex;
+            commands[selectedCommand].instanceCount = 1u;
+            slot = commands[selectedCommand].baseInstance;
+            selected = 1.0;
+        } else {
+            slot = commands[command].baseInstance + atomicAdd(commands[command].instanceCount, 1u);
+        }
+        
+        uint o = slot * 26u;
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) {
+                visibleData[o++] = instance.model[c][r];
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            for (int r = 0; r < 3; r++) {
+                visibleData[o++] = instance.normalMatrix[c][r];
+            }
+        }
+        visibleData[o] = selected;
+    }
+)";
+
+GLComputeFunctions glCompute;
+GLBufferStorageFunctions glStorage;
+GLProgramBinaryFunctions glProgramBinaries;
+GLParallelCompileFunctions glParallelCompile;
+
+// Sets up the attribute pointers for the currently bound VAO and VBO
+void VertexFormat::apply() const {
+    for (int i = 0; i < attributeCount; i++) {
+        const VertexAttribute& attribute = attributes[i];
+        glVertexAttribPointer(attribute.location, attribute.components, attribute.type, attribute.normalized,
+                              stride, (void*)(uintptr_t)attribute.offset);
+        glEnableVertexAttribArray(attribute.location);
+    }
+}
+
+// Continues the upload with whatever budget the stream has left this frame.
+// Returns true once the mesh is resident.
+bool Mesh::streamUpload(UploadStream& stream) {
+    if (VAO == 0) {
+        uploadMesh(nullptr, pending->vertexBytes, nullptr, pending->indexBytes);
+    }
+    
+    size_t totalBytes = pending->vertexBytes + pending->indexBytes;
+    while (pending->uploadedBytes < totalBytes && stream.remaining() > 0) {
+        bool vertexPart = pending->uploadedBytes < pending->vertexBytes;
+        size_t offset = vertexPart ? pending->uploadedBytes : pending->uploadedBytes - pending->vertexBytes;
+        size_t bytes = (vertexPart ? pending->vertexBytes : pending->indexBytes) - offset;
+        const unsigned char* data = (vertexPart ? pending->vertexData : pending->indexData) + offset;
+        pending->uploadedBytes += stream.write(vertexPart ? VBO : EBO, offset, data, bytes);
+    }
+    if (pending->uploadedBytes < totalBytes) {
+        return false;
+    }
+    
+    finishUpload();
+    return true;
+}
+
+// Synchronous load; needs a current GL context
+void Mesh::load() {
+    loadStart = std::chrono::steady_clock::now();
+    if (!prepare()) {
+        return;
+    }
+    uploadMesh(pending->vertexData, pending->vertexBytes, pending->indexData, pending->indexBytes);
+    finishUpload();
+}
+
+void Mesh::finishUpload() {
+    std::cout << "Uploaded " << name << ": " << format.stride << " bytes/vertex, "
+              << pending->vertexBytes / 1024 << " KB vertices, " << pending->indexBytes / 1024 << " KB indices" << std::endl;
+    gpuBytes = pending->vertexBytes + pending->indexBytes;
+    pending.reset();
+    resident = true;
+    
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+    std::cout << "Mesh " << name << " ready in " << std::fixed << std::setprecision(2) << milliseconds << " ms ("
+              << (warm ? "warm, from mesh cache" : "cold, parsed") << " in " << prepareMilliseconds << " ms), memory peak "
+              << peakBytes / (1024.0 * 1024.0) << " MB heap + " << mappedBytes / (1024.0 * 1024.0) << " MB mapped, steady "
+              << cpuBytes() / 1024.0 << " KB"
+              << std::defaultfloat << std::setprecision(6) << std::endl;
+}
+
+// Creates the VAO and buffers. Null data only allocates the storage, for
+// streamUpload() to fill in later.
+void Mesh::uploadMesh(const void* vertexData, size_t vertexBytes, const void* indexData, size_t indexBytes) {
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glGenBuffers(1, &EBO);
+    
+    glBindVertexArray(VAO);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, vertexBytes, vertexData, GL_STATIC_DRAW);
+    format.apply();
+    
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes, indexData, GL_STATIC_DRAW);
+    
+    glBindVertexArray(0);
+}
+
+// Frees the GPU buffers and makes the mesh loadable again: prepare() and
+// streamUpload() bring it back exactly as a first load would
+void Mesh::releaseBuffers() {
+    glDeleteVertexArrays(1, &VAO);
+    glDeleteBuffers(1, &VBO);
+    glDeleteBuffers(1, &EBO);
+    VAO = VBO = EBO = 0;
+    gpuBytes = 0;
+    resident = false;
+}
+
+void UploadStream::init(size_t bytesPerFrame, bool persistent) {
+    budget = bytesPerFrame;
+    used = 0;
+    if (!persistent || !glStorage.bufferStorage) {
+        return;
+    }
+    
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &staging);
+    glBindBuffer(GL_COPY_READ_BUFFER, staging);
+    glStorage.bufferStorage(GL_COPY_READ_BUFFER, budget * UPLOAD_SEGMENTS, NULL, flags);
+    mapped = static_cast<unsigned char*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, budget * UPLOAD_SEGMENTS, flags));
+    if (!mapped) {
+        glDeleteBuffers(1, &staging);
+        staging = 0;
+    }
+}
+
+void UploadStream::destroy() {
+    for (GLsync& fence : fences) {
+        if (fence) {
+            glDeleteSync(fence);
+            fence = 0;
+        }
+    }
+    if (staging != 0) {
+        glBindBuffer(GL_COPY_READ_BUFFER, staging);
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        glDeleteBuffers(1, &staging);
+    }
+    staging = 0;
+    mapped = nullptr;
+}
+
+// Waits for the GPU to finish copying out of the segment about to be reused
+void UploadStream::beginFrame() {
+    used = 0;
+    GLsync& fence = fences[segment];
+    if (!fence) {
+        return;
+    }
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {
+    }
+    glDeleteSync(fence);
+    fence = 0;
+}
+
+void UploadStream::endFrame() {
+    if (mapped && used > 0) {
+        fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        segment = (segment + 1) % UPLOAD_SEGMENTS;
+    }
+}
+
+// Writes as much of data as this frame's budget allows; returns the bytes written
+size_t UploadStream::write(GLuint buffer, size_t offset, const void* data, size_t bytes) {
+    bytes = std::min(bytes, remaining());
+    if (bytes == 0) {
+        return 0;
+    }
+    
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    if (mapped) {
+        size_t stagingOffset = segment * budget + used;
+        memcpy(mapped + stagingOffset, data, bytes);
+        glBindBuffer(GL_COPY_READ_BUFFER, staging);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, stagingOffset, offset, bytes);
+    } else {
+        glBufferSubData(GL_COPY_WRITE_BUFFER, offset, bytes, data);
+    }
+    used += bytes;
+    return bytes;
+}
+
+void RingBuffer::init(size_t bytesPerFrame, bool usePersistent) {
+    persistent = usePersistent && glStorage.bufferStorage;
+    createStorage(bytesPerFrame);
+}
+
+void RingBuffer::destroy() {
+    destroyStorage();
+    segmentSize = 0;
+    segment = 0;
+}
+
+// Persistent storage holds a segment per frame in flight. The fallback needs
+// only one, since orphaning hands out fresh storage every frame.
+void RingBuffer::createStorage(size_t bytesPerFrame) {
+    segmentSize = bytesPerFrame;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    if (persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glStorage.bufferStorage(GL_COPY_WRITE_BUFFER, segmentSize * RING_SEGMENTS, NULL, flags);
+        mapped = static_cast<unsigned char*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, segmentSize * RING_SEGMENTS, flags));
+        if (mapped) {
+            return;
+        }
+        
+        // Immutable storage can't be respecified, so start over with a plain buffer
+        glDeleteBuffers(1, &buffer);
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        persistent = false;
+    }
+    glBufferData(GL_COPY_WRITE_BUFFER, segmentSize, NULL, GL_STREAM_DRAW);
+}
+
+// GL keeps the storage alive until draws still reading it have finished
+void RingBuffer::destroyStorage() {
+    for (GLsync& fence : fences) {
+        if (fence) {
+            glDeleteSync(fence);
+            fence = 0;
+        }
+    }
+    if (buffer != 0 && mapped) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    }
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+    mapped = nullptr;
+}
+
+// Makes room for bytes of this frame's data, alignment padding included.
+// Returns true when that meant replacing the buffer, so anything pointing
+// at the old one must be re-pointed.
+bool RingBuffer::beginFrame(size_t bytes) {
+    bool replaced = false;
+    if (bytes > segmentSize) {
+        size_t size = std::max(bytes, segmentSize * 2);
+        destroyStorage();
+        createStorage(size);
+        segment = 0;
+        replaced = true;
+    }
+    used = 0;
+    
+    if (persistent) {
+        // Waits for the GPU to finish with the segment about to be reused
+        GLsync& fence = fences[segment];
+        if (fence) {
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {
+            }
+            glDeleteSync(fence);
+            fence = 0;
+        }
+        return replaced;
+    }
+    
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, segmentSize, NULL, GL_STREAM_DRAW);
+    mapped = static_cast<unsigned char*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, segmentSize,
+                                                          GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+    return replaced;
+}
+
+// Returns where to write bytes aligned to alignment in this frame's
+// segment, setting offset to their position in the buffer, or nullptr when
+// they don't fit. Alignment needn't be a power of two, so instance data can
+// start on a whole slot.
+void* RingBuffer::allocate(size_t bytes, size_t alignment, size_t& offset) {
+    size_t base = persistent ? segment * segmentSize : 0;
+    size_t start = (base + used + alignment - 1) / alignment * alignment;
+    if (!mapped || start + bytes > base + segmentSize) {
+        return nullptr;
+    }
+    used = start + bytes - base;
+    offset = start;
+    return mapped + start;
+}
+
+// Ends this frame's writes; call before the draws that read them.
+// Persistent, coherent mappings need nothing.
+void RingBuffer::flush() {
+    if (!persistent && mapped) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        mapped = nullptr;
+    }
+}
+
+// Fences the segment after the draws that read it, then moves to the next
+void RingBuffer::endFrame() {
+    if (persistent) {
+        fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        segment = (segment + 1) % RING_SEGMENTS;
+    }
+}
+
+// The same file loaded with different options produces different buffers
+std::string MeshCache::key(const std::string& path, const MeshLoadOptions& options) {
+    std::string key = std::filesystem::absolute(path).lexically_normal().string();
+    key += '|';
+    key += std::to_string(static_cast<int>(options.vertexLayout));
+    key += options.keepTexCoords ? "t" : "";
+    key += options.optimize ? "o" : "";
+    key += options.generateLods ? "l" : "";
+    return key;
+}
+
+// Loads on the calling thread, which needs a current GL context
+std::shared_ptr<Mesh> MeshCache::load(const std::string& path, const MeshLoadOptions& options) {
+    std::string meshKey = key(path, options);
+    auto it = meshes.find(meshKey);
+    if (it != meshes.end()) {
+        hits++;
+        return it->second;
+    }
+    
+    misses++;
+    std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>(path, options);
+    mesh->load();
+    if (mesh->empty()) {
+        return nullptr;
+    }
+    meshes[meshKey] = mesh;
+    return mesh;
+}
+
+// Returns at once with a mesh that becomes resident once the loader has
+// prepared and uploaded it. A mesh that fails to load never does.
+std::shared_ptr<Mesh> MeshCache::loadAsync(const std::string& path, MeshLoader& loader, const MeshLoadOptions& options) {
+    std::string meshKey = key(path, options);
+    auto it = meshes.find(meshKey);
+    if (it != meshes.end()) {
+        hits++;
+        return it->second;
+    }
+    
+    misses++;
+    std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>(path, options);
+    meshes[meshKey] = mesh;
+    loader.enqueue(mesh);
+    return mesh;
+}
+
+void MeshLoader::start(unsigned int threadCount) {
+    stopping = false;
+    for (unsigned int i = 0; i < threadCount; i++) {
+        workers.emplace_back(&MeshLoader::work, this);
+    }
+}
+
+// Joins the workers and drops unfinished loads. Call on the GL thread, since
+// the dropped meshes may be destroyed here.
+void MeshLoader::stop() {
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        stopping = true;
+        jobs.clear();
+    }
+    jobAvailable.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    
+    std::shared_ptr<Mesh> mesh;
+    while (prepared.pop(mesh)) {
+    }
+    uploads.clear();
+    inFlight.store(0, std::memory_order_relaxed);
+}
+
+void MeshLoader::enqueue(std::shared_ptr<Mesh> mesh) {
+    inFlight.fetch_add(1, std::memory_order_relaxed);
+    if (workers.empty()) {
+        prepareMesh(*mesh);
+        prepared.push(std::move(mesh));
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        jobs.push_back(std::move(mesh));
+    }
+    jobAvailable.notify_one();
+}
+
+void MeshLoader::prepareMesh(Mesh& mesh) {
+    try {
+        if (!mesh.prepare()) {
+            std::cerr << "Error loading OBJ: nothing usable in " << mesh.name << std::endl;
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error loading OBJ: " << e.what() << std::endl;
+    }
+}
+
+void MeshLoader::work() {
+    for (;;) {
+        std::shared_ptr<Mesh> mesh;
+        {
+            std::unique_lock<std::mutex> lock(jobMutex);
+            jobAvailable.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) {
+                return;
+            }
+            mesh = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        
+        // Moved into the queue so the render thread holds the last reference
+        prepareMesh(*mesh);
+        prepared.push(std::move(mesh));
+    }
+}
+
+// Render thread, once per frame: uploads prepared meshes in order until the
+// stream's budget runs out. Appends the meshes that became resident to
+// finished and returns the bytes uploaded.
+size_t MeshLoader::update(UploadStream& stream, std::vector<const Mesh*>& finished) {
+    std::shared_ptr<Mesh> mesh;
+    while (prepared.pop(mesh)) {
+        uploads.push_back(std::move(mesh));
+    }
+    if (uploads.empty()) {
+        return 0;
+    }
+    
+    stream.beginFrame();
+    while (!uploads.empty() && stream.remaining() > 0) {
+        Mesh& front = *uploads.front();
+        if (!front.empty() && !front.streamUpload(stream)) {
+            break;
+        }
+        if (front.resident) {
+            finished.push_back(&front);
+        }
+        uploads.pop_front();
+        inFlight.fetch_sub(1, std::memory_order_relaxed);
+    }
+    size_t bytes = stream.frameBytes();
+    stream.endFrame();
+    return bytes;
+}
+
+// Drops meshes no instance refers to anymore
+void MeshCache::releaseUnused() {
+    for (auto it = meshes.begin(); it != meshes.end();) {
+        if (it->second.use_count() == 1) {
+            it = meshes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void JobSystem::start(unsigned int workerCount) {
+    stop();
+    stopping = false;
+    threads = workerCount + 1;
+    queues.reset(new Queue[threads]);
+    for (unsigned int i = 0; i < workerCount; i++) {
+        workers.emplace_back(&JobSystem::work, this, i);
+    }
+}
+
+void JobSystem::stop() {
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    threads = 1;
+    queues.reset();
+}
+
+// Deals the ranges out round-robin, wakes the workers, then runs and steals
+// jobs on the calling thread until the last one has finished. The function
+// lives on the caller's stack, which outlives every job.
+void JobSystem::run(size_t count, size_t minRange, void (*function)(void*, size_t, size_t, unsigned int),
+                    void* context) {
+    size_t jobCount = std::min((count + minRange - 1) / minRange, static_cast<size_t>(threads) * JOBS_PER_THREAD);
+    size_t rangeSize = (count + jobCount - 1) / jobCount;
+    jobCount = (count + rangeSize - 1) / rangeSize;
+    
+    remaining.store(jobCount, std::memory_order_relaxed);
+    for (size_t j = 0; j < jobCount; j++) {
+        Queue& queue = queues[j % threads];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back({ function, context, j * rangeSize, std::min(count, (j + 1) * rangeSize) });
+    }
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        generation++;
+    }
+    wake.notify_all();
+    
+    unsigned int caller = callerThread();
+    while (remaining.load(std::memory_order_acquire) > 0) {
+        if (!runOne(caller)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// Runs one job from the thread's own queue, or one stolen from another's.
+// Returns false when every queue was empty.
+bool JobSystem::runOne(unsigned int thread) {
+    Job job;
+    bool found = false;
+    for (unsigned int k = 0; k < threads && !found; k++) {
+        Queue& queue = queues[(thread + k) % threads];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty()) {
+            continue;
+        }
+        if (k == 0) {
+            job = queue.jobs.back();
+            queue.jobs.pop_back();
+        } else {
+            job = queue.jobs.front();
+            queue.jobs.pop_front();
+        }
+        found = true;
+    }
+    if (!found) {
+        return false;
+    }
+    job.function(job.context, job.begin, job.end, thread);
+    remaining.fetch_sub(1, std::memory_order_acq_rel);
+    return true;
+}
+
+void JobSystem::work(unsigned int thread) {
+    uint64_t seen = 0;
+    for (;;) {
+        while (runOne(thread)) {
+        }
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wake.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) {
+            return;
+        }
+        seen = generation;
+    }
+}
+
+void InstanceArray::reserve(size_t count) {
+    meshes.reserve(count);
+    positions.reserve(count);
+    rotations.reserve(count);
+    scales.reserve(count);
+    models.reserve(count);
+    normalMatrices.reserve(count);
+    sphereX.reserve(count);
+    sphereY.reserve(count);
+    sphereZ.reserve(count);
+    sphereRadius.reserve(count);
+    resident.reserve(count);
+    visible.reserve(count);
+    lodLevels.reserve(count);
+    meshIds.reserve(count);
+    localSpheres.reserve(count);
+    dirty.reserve(count);
+}
+
+// Shared by every InstanceArray, starting above the 0 a new array holds
+static uint64_t nextMembership() {
+    static std::atomic<uint64_t> counter{ 0 };
+    return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+void InstanceArray::clear() {
+    meshes.clear();
+    positions.clear();
+    rotations.clear();
+    scales.clear();
+    models.clear();
+    normalMatrices.clear();
+    sphereX.clear();
+    sphereY.clear();
+    sphereZ.clear();
+    sphereRadius.clear();
+    resident.clear();
+    visible.clear();
+    lodLevels.clear();
+    meshIds.clear();
+    meshIdOf.clear();
+    localSpheres.clear();
+    dirty.clear();
+    dirtyList.clear();
+    revision++;
+    membership = nextMembership();
+}
+
+size_t InstanceArray::add(std::shared_ptr<Mesh> mesh, const glm::vec3& position,
+                          const glm::vec3& rotation, const glm::vec3& scale) {
+    // Bounds of a mesh still loading are filled in by meshResident()
+    size_t index = meshes.size();
+    bool ready = mesh->resident;
+    localSpheres.push_back(ready ? glm::vec4(mesh->boundingCenter, mesh->boundingRadius) : glm::vec4(0.0f));
+    resident.push_back(ready ? 1 : 0);
+    meshIds.push_back(meshIdOf.emplace(mesh.get(), static_cast<uint32_t>(meshIdOf.size())).first->second);
+    meshes.push_back(std::move(mesh));
+    positions.push_back(position);
+    rotations.push_back(rotation);
+    scales.push_back(scale);
+    models.push_back(glm::mat4(1.0f));
+    normalMatrices.push_back(glm::mat3(1.0f));
+    sphereX.push_back(0.0f);
+    sphereY.push_back(0.0f);
+    sphereZ.push_back(0.0f);
+    sphereRadius.push_back(0.0f);
+    visible.push_back(1);
+    lodLevels.push_back(0);
+    dirty.push_back(0);
+    markDirty(index);
+    membership = nextMembership();
+    return index;
+}
+
+// Adds count instances at once from packed arrays, 3 floats per instance
+// each, as a scene file holds them. Every array is resized once and the
+// transforms are copied whole; meshIndices pick from meshTable, whose
+// bounds and mesh ids are looked up once per mesh. Only meshes some
+// instance uses get an id, so ids stay dense. Adds nothing and returns
+// false if an index is out of range.
+bool InstanceArray::append(const std::vector<std::shared_ptr<Mesh>>& meshTable, const uint32_t* meshIndices,
+                           const float* positionData, const float* rotationData, const float* scaleData, size_t count) {
+    std::vector<uint8_t> tableUsed(meshTable.size(), 0);
+    for (size_t i = 0; i < count; i++) {
+        if (meshIndices[i] >= meshTable.size()) {
+            return false;
+        }
+        tableUsed[meshIndices[i]] = 1;
+    }
+    if (count == 0) {
+        return true;
+    }
+    
+    std::vector<glm::vec4> tableSpheres(meshTable.size());
+    std::vector<uint8_t> tableResident(meshTable.size(), 0);
+    std::vector<uint32_t> tableIds(meshTable.size(), 0);
+    for (size_t entry = 0; entry < meshTable.size(); entry++) {
+        if (!tableUsed[entry]) {
+            continue;
+        }
+        const std::shared_ptr<Mesh>& mesh = meshTable[entry];
+        bool ready = mesh->resident;
+        tableSpheres[entry] = ready ? glm::vec4(mesh->boundingCenter, mesh->boundingRadius) : glm::vec4(0.0f);
+        tableResident[entry] = ready ? 1 : 0;
+        tableIds[entry] = meshIdOf.emplace(mesh.get(), static_cast<uint32_t>(meshIdOf.size())).first->second;
+    }
+    
+    size_t first = size();
+    size_t total = first + count;
+    meshes.resize(total);
+    localSpheres.resize(total);
+    resident.resize(total);
+    meshIds.resize(total);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t entry = meshIndices[i];
+        meshes[first + i] = meshTable[entry];
+        localSpheres[first + i] = tableSpheres[entry];
+        resident[first + i] = tableResident[entry];
+        meshIds[first + i] = tableIds[entry];
+    }
+    
+    positions.resize(total);
+    rotations.resize(total);
+    scales.resize(total);
+    memcpy(glm::value_ptr(positions[first]), positionData, count * sizeof(glm::vec3));
+    memcpy(glm::value_ptr(rotations[first]), rotationData, count * sizeof(glm::vec3));
+    memcpy(glm::value_ptr(scales[first]), scaleData, count * sizeof(glm::vec3));
+    models.resize(total, glm::mat4(1.0f));
+    normalMatrices.resize(total, glm::mat3(1.0f));
+    sphereX.resize(total, 0.0f);
+    sphereY.resize(total, 0.0f);
+    sphereZ.resize(total, 0.0f);
+    sphereRadius.resize(total, 0.0f);
+    visible.resize(total, 1);
+    lodLevels.resize(total, 0);
+    dirty.resize(total, 0);
+    dirtyList.reserve(dirtyList.size() + count);
+    for (size_t i = first; i < total; i++) {
+        markDirty(i);
+    }
+    membership = nextMembership();
+    return true;
+}
+
+// Picks up the bounds of a mesh that just finished loading and lets its
+// instances be drawn
+void InstanceArray::meshResident(const Mesh* mesh) {
+    glm::vec4 sphere(mesh->boundingCenter, mesh->boundingRadius);
+    for (size_t i = 0; i < size(); i++) {
+        if (meshes[i].get() == mesh) {
+            localSpheres[i] = sphere;
+            resident[i] = 1;
+            markDirty(i);
+        }
+    }
+}
+
+// Stops drawing the instances of a mesh whose buffers were released. Their
+// bounds stay, so they are still culled while the mesh reloads.
+void InstanceArray::meshEvicted(const Mesh* mesh) {
+    for (size_t i = 0; i < size(); i++) {
+        if (meshes[i].get() == mesh) {
+            resident[i] = 0;
+        }
+    }
+    revision++;
+}
+
+void InstanceArray::markDirty(size_t index) {
+    if (!dirty[index]) {
+        dirty[index] = 1;
+        dirtyList.push_back(static_cast<uint32_t>(index));
+    }
+}
+
+void InstanceArray::setPosition(size_t index, const glm::vec3& position) {
+    if (positions[index] != position) {
+        positions[index] = position;
+        markDirty(index);
+    }
+}
+
+void InstanceArray::setRotation(size_t index, const glm::vec3& rotation) {
+    if (rotations[index] != rotation) {
+        rotations[index] = rotation;
+        markDirty(index);
+    }
+}
+
+void InstanceArray::setScale(size_t index, const glm::vec3& scale) {
+    if (scales[index] != scale) {
+        scales[index] = scale;
+        markDirty(index);
+    }
+}
+
+// Returns how many instances were rebuilt. With a job system the dirty
+// instances are split across its threads; each touches only its own range.
+size_t InstanceArray::updateTransforms(JobSystem* jobs) {
+    size_t updated = dirtyList.size();
+    if (updated == 0) {
+        return 0;
+    }
+    revision++;
+    
+    // When everything changed, a dense pass avoids the index indirection
+    bool dense = updated == size();
+    BuildTransformsKernel buildTransforms = simdKernels().buildTransforms;
+    auto update = [&](size_t begin, size_t end, unsigned int) {
+        if (dense) {
+            buildTransforms(glm::value_ptr(positions[begin]), glm::value_ptr(rotations[begin]),
+                            glm::value_ptr(scales[begin]), glm::value_ptr(models[begin]),
+                            glm::value_ptr(normalMatrices[begin]), nullptr, end - begin);
+        } else {
+            buildTransforms(glm::value_ptr(positions[0]), glm::value_ptr(rotations[0]), glm::value_ptr(scales[0]),
+                            glm::value_ptr(models[0]), glm::value_ptr(normalMatrices[0]),
+                            dirtyList.data() + begin, end - begin);
+        }
+        
+        // Rotation preserves lengths, so the largest scale axis bounds the radius.
+        // The dirty list is in marking order, so a dense job must stay on the
+        // indices whose matrices it just built.
+        for (size_t n = begin; n < end; n++) {
+            size_t index = dense ? n : dirtyList[n];
+            const glm::vec4& local = localSpheres[index];
+            glm::vec3 center = glm::vec3(models[index] * glm::vec4(glm::vec3(local), 1.0f));
+            glm::vec3 scale = glm::abs(scales[index]);
+            sphereX[index] = center.x;
+            sphereY[index] = center.y;
+            sphereZ[index] = center.z;
+            sphereRadius[index] = local.w * std::max(scale.x, std::max(scale.y, scale.z));
+            dirty[index] = 0;
+        }
+    };
+    if (jobs) {
+        jobs->parallelFor(updated, TRANSFORM_JOB_INSTANCES, update);
+    } else {
+        update(0, updated, 0);
+    }
+    dirtyList.clear();
+    return updated;
+}
+
+// Gribb/Hartmann plane extraction from a combined view-projection matrix
+Frustum Frustum::fromMatrix(const glm::mat4& m) {
+    glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+    glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+    glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+    glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+    
+    Frustum frustum;
+    frustum.planes[0] = row3 + row0; // Left
+    frustum.planes[1] = row3 - row0; // Right
+    frustum.planes[2] = row3 + row1; // Bottom
+    frustum.planes[3] = row3 - row1; // Top
+    frustum.planes[4] = row3 + row2; // Near
+    frustum.planes[5] = row3 - row2; // Far
+    for (glm::vec4& plane : frustum.planes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+    return frustum;
+}
+
+// Sphere-vs-frustum test over the whole instance array. Returns the number
+// of visible instances.
+size_t InstanceArray::cull(const Frustum& frustum) {
+    return cull(frustum, 0, size());
+}
+
+// Same over instances [begin, end), so jobs can cull disjoint ranges, with
+// the widest SIMD kernel the CPU supports
+size_t InstanceArray::cull(const Frustum& frustum, size_t begin, size_t end) {
+    return simdKernels().cullSpheres(sphereX.data() + begin, sphereY.data() + begin, sphereZ.data() + begin,
+                                     sphereRadius.data() + begin, resident.data() + begin,
+                                     glm::value_ptr(frustum.planes[0]), visible.data() + begin, end - begin);
+}
+
+// Picks the coarsest LOD of each visible instance whose simplification error
+// still projects to at most LOD_PIXEL_ERROR pixels. pixelsPerUnit is the
+// viewport height over 2 * tan(fovy / 2): pixels per unit at distance one.
+void InstanceArray::selectLods(const glm::vec3& eye, float pixelsPerUnit) {
+    selectLods(eye, pixelsPerUnit, 0, size());
+}
+
+void InstanceArray::selectLods(const glm::vec3& eye, float pixelsPerUnit, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+        if (!visible[i]) {
+            continue;
+        }
+        glm::vec3 center(sphereX[i], sphereY[i], sphereZ[i]);
+        float distance = std::max(glm::length(center - eye) - sphereRadius[i], 0.001f);
+        float pixelsPerError = sphereRadius[i] / distance * pixelsPerUnit;
+        
+        const std::vector<MeshLod>& meshLods = meshes[i]->lods;
+        uint8_t level = 0;
+        for (size_t l = 1; l < meshLods.size(); l++) {
+            if (meshLods[l].error * pixelsPerError <= LOD_PIXEL_ERROR) {
+                level = static_cast<uint8_t>(l);
+            }
+        }
+        lodLevels[i] = level;
+    }
+}
+
+// Picks up the meshes of instances added or removed since the last call,
+// keeping what is known about the meshes still there
+void MeshResidency::track(const InstanceArray& instances) {
+    if (instances.membership == trackedMembership) {
+        return;
+    }
+    trackedMembership = instances.membership;
+    std::vector<Entry> previous;
+    previous.swap(entries);
+    for (size_t i = 0; i < instances.size(); i++) {
+        uint32_t id = instances.meshIds[i];
+        if (id >= entries.size()) {
+            entries.resize(id + 1);
+        }
+        if (!entries[id].mesh) {
+            entries[id].mesh = instances.meshes[i];
+        }
+    }
+    for (const Entry& old : previous) {
+        for (Entry& entry : entries) {
+            if (entry.mesh == old.mesh) {
+                entry = old;
+            }
+        }
+    }
+    everyInstance.assign(instances.size(), 1);
+    inView.resize(instances.size());
+}
+
+size_t MeshResidency::update(InstanceArray& instances, const Frustum& frustum, MeshLoader& loader) {
+    track(instances);
+    frame++;
+    
+    bool anyEvicted = false;
+    for (Entry& entry : entries) {
+        if (entry.evicted && entry.mesh->resident) {
+            entry.evicted = false;
+            entry.reloading = false;
+        }
+        anyEvicted = anyEvicted || entry.evicted;
+    }
+    
+    // Without a budget nothing is evicted, so use only matters while there is one
+    if (budgetBytes > 0 || anyEvicted) {
+        simdKernels().cullSpheres(instances.sphereX.data(), instances.sphereY.data(), instances.sphereZ.data(),
+                                  instances.sphereRadius.data(), everyInstance.data(),
+                                  glm::value_ptr(frustum.planes[0]), inView.data(), instances.size());
+        for (size_t i = 0; i < instances.size(); i++) {
+            if (inView[i]) {
+                entries[instances.meshIds[i]].lastUsed = frame;
+            }
+        }
+    }
+    
+    residentBytes = 0;
+    residentMeshes = 0;
+    for (Entry& entry : entries) {
+        if (!entry.mesh) {
+            continue;
+        }
+        if (entry.evicted && !entry.reloading && entry.lastUsed == frame) {
+            entry.reloading = true;
+            reloads++;
+            loader.enqueue(entry.mesh);
+        }
+        if (entry.mesh->resident) {
+            residentBytes += entry.mesh->gpuBytes;
+            residentMeshes++;
+        }
+    }
+    peakBytes = std::max(peakBytes, residentBytes);
+    if (budgetBytes == 0 || residentBytes <= budgetBytes) {
+        return 0;
+    }
+    
+    candidates.clear();
+    for (size_t id = 0; id < entries.size(); id++) {
+        const Entry& entry = entries[id];
+        if (entry.mesh && entry.mesh->resident && entry.mesh->options.useMeshCache
+            && frame - entry.lastUsed >= RESIDENCY_IDLE_FRAMES) {
+            candidates.push_back(id);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [&](size_t a, size_t b) { return entries[a].lastUsed < entries[b].lastUsed; });
+    
+    size_t evicted = 0;
+    for (size_t id : candidates) {
+        if (residentBytes <= budgetBytes) {
+            break;
+        }
+        Entry& entry = entries[id];
+        std::cout << "Evicted " << entry.mesh->name << ": " << entry.mesh->gpuBytes / 1024 << " KB, unused for "
+                  << frame - entry.lastUsed << " frames" << std::endl;
+        residentBytes -= entry.mesh->gpuBytes;
+        residentMeshes--;
+        entry.mesh->releaseBuffers();
+        instances.meshEvicted(entry.mesh.get());
+        entry.evicted = true;
+        entry.reloading = false;
+        evicted++;
+    }
+    evictions += evicted;
+    return evicted;
+}
+
+const char SCENE_FILE_MAGIC[4] = { 'M', '1', 'S', 'C' };
+const uint32_t SCENE_FILE_VERSION = 1;
+
+// Start of a binary scene file. meshCount NUL-terminated paths follow it,
+// pathBytes in all; the offsets are from the start of the file.
+struct SceneFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t meshCount;
+    uint32_t pathBytes;
+    uint64_t instanceCount;
+    uint64_t meshIndexOffset;
+    uint64_t positionOffset;
+    uint64_t rotationOffset;
+    uint64_t scaleOffset;
+};
+
+static bool loadBinaryScene(const std::string& path, const MappedFile& file, InstanceArray& instances,
+                            MeshCache& cache, MeshLoader& loader) {
+    SceneFileHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    uint64_t count = header.instanceCount;
+    auto fits = [&](uint64_t offset, uint64_t elementBytes) {
+        return offset % 4 == 0 && offset <= file.size && count <= (file.size - offset) / elementBytes;
+    };
+    bool valid = header.version == SCENE_FILE_VERSION
+        && sizeof(header) + uint64_t(header.pathBytes) <= file.size
+        && fits(header.meshIndexOffset, sizeof(uint32_t))
+        && fits(header.positionOffset, sizeof(glm::vec3))
+        && fits(header.rotationOffset, sizeof(glm::vec3))
+        && fits(header.scaleOffset, sizeof(glm::vec3));
+    if (!valid) {
+        std::cerr << "Invalid scene file: " << path << std::endl;
+        return false;
+    }
+    
+    // Paths are resolved once per mesh, relative to the scene file
+    std::filesystem::path directory = std::filesystem::path(path).parent_path();
+    std::vector<std::string> meshPaths;
+    const char* paths = reinterpret_cast<const char*>(file.data + sizeof(header));
+    const char* pathsEnd = paths + header.pathBytes;
+    for (uint32_t m = 0; m < header.meshCount; m++) {
+        const char* end = std::find(paths, pathsEnd, '\0');
+        if (end == pathsEnd) {
+            std::cerr << "Invalid scene file: " << path << std::endl;
+            return false;
+        }
+        meshPaths.push_back((directory / std::string(paths, end)).lexically_normal().string());
+        paths = end + 1;
+    }
+    
+    const uint32_t* meshIndices = reinterpret_cast<const uint32_t*>(file.data + header.meshIndexOffset);
+    for (uint64_t i = 0; i < count; i++) {
+        if (meshIndices[i] >= header.meshCount) {
+            std::cerr << "Scene file has instances of unknown meshes: " << path << std::endl;
+            return false;
+        }
+    }
+    
+    // Only a file that checked out starts loading meshes
+    std::vector<std::shared_ptr<Mesh>> meshTable;
+    for (const std::string& meshPath : meshPaths) {
+        meshTable.push_back(cache.loadAsync(meshPath, loader));
+    }
+    instances.reserve(instances.size() + count);
+    return instances.append(meshTable, meshIndices, reinterpret_cast<const float*>(file.data + header.positionOffset),
+                            reinterpret_cast<const float*>(file.data + header.rotationOffset),
+                            reinterpret_cast<const float*>(file.data + header.scaleOffset), count);
+}
+
+static bool loadTextScene(const std::string& path, const MappedFile& file, InstanceArray& instances,
+                          MeshCache& cache, MeshLoader& loader) {
+    std::filesystem::path directory = std::filesystem::path(path).parent_path();
+    std::unordered_map<std::string, uint32_t> meshOfName;
+    std::vector<std::string> meshPaths;
+    std::vector<uint32_t> meshIndices;
+    std::vector<glm::vec3> positions, rotations, scales;
+    
+    std::istringstream text(std::string(reinterpret_cast<const char*>(file.data), file.size));
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(text, line)) {
+        lineNumber++;
+        std::istringstream words(line);
+        std::string keyword;
+        if (!(words >> keyword) || keyword[0] == '#') {
+            continue;
+        }
+        
+        bool valid = false;
+        std::string name;
+        if (keyword == "mesh") {
+            std::string meshPath;
+            valid = words >> name >> meshPath && meshOfName.count(name) == 0;
+            if (valid) {
+                meshOfName[name] = static_cast<uint32_t>(meshPaths.size());
+                meshPaths.push_back((directory / meshPath).lexically_normal().string());
+            }
+        } else if (keyword == "instance") {
+            glm::vec3 position, rotation(0.0f), scale(1.0f);
+            valid = words >> name >> position.x >> position.y >> position.z && meshOfName.count(name) != 0;
+            
+            // Rotation and scale are optional, but each comes whole
+            if (valid && words >> rotation.x) {
+                valid = static_cast<bool>(words >> rotation.y >> rotation.z);
+                if (valid && words >> scale.x) {
+                    valid = static_cast<bool>(words >> scale.y >> scale.z);
+                }
+            }
+            if (valid) {
+                meshIndices.push_back(meshOfName[name]);
+                positions.push_back(position);
+                rotations.push_back(rotation);
+                scales.push_back(scale);
+            }
+        }
+        if (!valid) {
+            std::cerr << path << ":" << lineNumber << ": invalid line: " << line << std::endl;
+            return false;
+        }
+    }
+    
+    // Only a file that parsed starts loading meshes
+    std::vector<std::shared_ptr<Mesh>> meshTable;
+    for (const std::string& meshPath : meshPaths) {
+        meshTable.push_back(cache.loadAsync(meshPath, loader));
+    }
+    instances.reserve(instances.size() + meshIndices.size());
+    return instances.append(meshTable, meshIndices.data(), reinterpret_cast<const float*>(positions.data()),
+                            reinterpret_cast<const float*>(rotations.data()), reinterpret_cast<const float*>(scales.data()),
+                            meshIndices.size());
+}
+
+bool loadSceneFile(const std::string& path, InstanceArray& instances, MeshCache& cache, MeshLoader& loader) {
+    MappedFile file;
+    if (!file.open(path)) {
+        std::cerr << "Failed to open scene file: " << path << std::endl;
+        return false;
+    }
+    if (file.size >= sizeof(SceneFileHeader) && memcmp(file.data, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC)) == 0) {
+        return loadBinaryScene(path, file, instances, cache, loader);
+    }
+    return loadTextScene(path, file, instances, cache, loader);
+}
+
+bool saveSceneFile(const std::string& path, const InstanceArray& instances) {
+    // Mesh ids are dense, so they index the mesh table directly
+    std::vector<std::string> meshPaths;
+    std::filesystem::path directory = std::filesystem::absolute(path).parent_path();
+    for (size_t i = 0; i < instances.size(); i++) {
+        uint32_t id = instances.meshIds[i];
+        if (id >= meshPaths.size()) {
+            meshPaths.resize(id + 1);
+        }
+        if (meshPaths[id].empty()) {
+            std::filesystem::path meshPath = std::filesystem::absolute(instances.meshes[i]->name);
+            meshPaths[id] = std::filesystem::proximate(meshPath, directory).generic_string();
+        }
+    }
+    
+    SceneFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_FILE_VERSION;
+    header.meshCount = static_cast<uint32_t>(meshPaths.size());
+    for (const std::string& meshPath : meshPaths) {
+        header.pathBytes += static_cast<uint32_t>(meshPath.size() + 1);
+    }
+    uint64_t count = instances.size();
+    header.instanceCount = count;
+    header.meshIndexOffset = (sizeof(header) + header.pathBytes + 15) & ~uint64_t(15);
+    header.positionOffset = (header.meshIndexOffset + count * sizeof(uint32_t) + 15) & ~uint64_t(15);
+    header.rotationOffset = (header.positionOffset + count * sizeof(glm::vec3) + 15) & ~uint64_t(15);
+    header.scaleOffset = (header.rotationOffset + count * sizeof(glm::vec3) + 15) & ~uint64_t(15);
+    
+    // Written to a temporary file first, as the mesh cache is
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            std::cerr << "Failed to write scene file: " << path << std::endl;
+            return false;
+        }
+        const char padding[16] = {};
+        uint64_t written = sizeof(header) + header.pathBytes;
+        auto writeArray = [&](uint64_t offset, const void* data, uint64_t bytes) {
+            file.write(padding, offset - written);
+            file.write(static_cast<const char*>(data), bytes);
+            written = offset + bytes;
+        };
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const std::string& meshPath : meshPaths) {
+            file.write(meshPath.c_str(), meshPath.size() + 1);
+        }
+        if (count > 0) {
+            writeArray(header.meshIndexOffset, instances.meshIds.data(), count * sizeof(uint32_t));
+            writeArray(header.positionOffset, glm::value_ptr(instances.positions[0]), count * sizeof(glm::vec3));
+            writeArray(header.rotationOffset, glm::value_ptr(instances.rotations[0]), count * sizeof(glm::vec3));
+            writeArray(header.scaleOffset, glm::value_ptr(instances.scales[0]), count * sizeof(glm::vec3));
+        }
+        if (!file) {
+            std::cerr << "Failed to write scene file: " << path << std::endl;
+            return false;
+        }
+    }
+    
+    std::error_code error;
+    std::filesystem::rename(tempPath, path, error);
+    if (error) {
+        std::cerr << "Failed to write scene file: " << path << " (" << error.message() << ")" << std::endl;
+        std::filesystem::remove(tempPath, error);
+        return false;
+    }
+    return true;
+}
+
+// Takes ownership of a program that was linked elsewhere
+bool ShaderProgram::adopt(GLuint linkedProgram) {
+    id = linkedProgram;
+    return collectUniforms();
+}
+
+bool ShaderProgram::collectUniforms() {
+    GLint linked = GL_FALSE;
+    glGetProgramiv(id, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        return false;
+    }
+    
+    GLint count = 0, maxLength = 0;
+    glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    std::vector<GLchar> nameBuffer(std::max(maxLength, 1));
+    
+    uniforms.clear();
+    for (GLint i = 0; i < count; i++) {
+        GLint size;
+        GLenum type;
+        GLsizei length = 0;
+        glGetActiveUniform(id, i, static_cast<GLsizei>(nameBuffer.size()), &length, &size, &type, nameBuffer.data());
+        std::string uniformName(nameBuffer.data(), length);
+        
+        // Arrays are reported as "name[0]"; also register them as "name"
+        GLint uniformLocation = glGetUniformLocation(id, uniformName.c_str());
+        uniforms[uniformName] = uniformLocation;
+        size_t bracket = uniformName.find('[');
+        if (bracket != std::string::npos) {
+            uniforms[uniformName.substr(0, bracket)] = uniformLocation;
+        }
+    }
+    return true;
+}
+
+void ShaderProgram::destroy() {
+    glDeleteProgram(id);
+    id = 0;
+    uniforms.clear();
+}
+
+// -1 for uniforms the compiler removed or that do not exist, which GL ignores
+GLint ShaderProgram::location(const std::string& name) const {
+    auto it = uniforms.find(name);
+    return it != uniforms.end() ? it->second : -1;
+}
+
+// Points a uniform block at a buffer binding point; blocks the compiler
+// removed are skipped
+void ShaderProgram::bindUniformBlock(const char* name, GLuint binding) const {
+    GLuint block = glGetUniformBlockIndex(id, name);
+    if (block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(id, block, binding);
+    }
+}
+
+// 64-bit FNV-1a; only names cache files, so it needn't resist collisions
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+const char SHADER_BINARY_MAGIC[4] = { 'M', '1', 'S', 'B' };
+const uint32_t SHADER_BINARY_VERSION = 1;
+
+// Start of "<cache directory>/<hash>.bin", followed by the driver's binary
+struct ShaderBinaryHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t hash;
+    uint32_t format;
+    uint32_t length;
+};
+
+void ShaderManager::init() {
+    binaries = glProgramBinaries.load();
+    parallel = glParallelCompile.load();
+    if (parallel) {
+        // As many compiler threads as the driver likes
+        glParallelCompile.maxShaderCompilerThreads(0xFFFFFFFFu);
+    }
+    
+    // Part of every hash, so a driver update never loads the old driver's binaries
+    driver.clear();
+    for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+        const GLubyte* value = glGetString(name);
+        driver += value ? reinterpret_cast<const char*>(value) : "";
+        driver += '\n';
+    }
+    programsBuilt = 0;
+    cacheHits = 0;
+    buildSeconds = 0.0;
+    lastScan = std::chrono::steady_clock::now();
+}
+
+void ShaderManager::destroy() {
+    for (Build& build : builds) {
+        abandon(build);
+    }
+    builds.clear();
+    sources.clear();
+}
+
+void ShaderManager::addSource(const std::string& name, const char* embedded) {
+    Source& source = sources[name];
+    source.embedded = embedded;
+    readSource(name, source);
+}
+
+// The embedded text, unless the source directory has a file of that name
+void ShaderManager::readSource(const std::string& name, Source& source) {
+    source.text = source.embedded;
+    if (sourceDirectory.empty()) {
+        return;
+    }
+    
+    std::filesystem::path path = std::filesystem::path(sourceDirectory) / name;
+    std::error_code error;
+    if (!std::filesystem::exists(path, error)) {
+        std::filesystem::create_directories(sourceDirectory, error);
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file << source.embedded;
+    }
+    std::ifstream file(path, std::ios::binary);
+    if (file) {
+        std::ostringstream text;
+        text << file.rdbuf();
+        source.text = text.str();
+    } else {
+        std::cerr << "Failed to read shader " << path.string() << ", using the built-in one" << std::endl;
+    }
+    source.stamp = std::filesystem::last_write_time(path, error);
+}
+
+void ShaderManager::request(ShaderProgram& target, const std::vector<ShaderStage>& stages,
+                            const std::vector<std::string>& defines) {
+    if (!batching) {
+        batching = true;
+        batchStart = std::chrono::steady_clock::now();
+    }
+    builds.push_back({ &target, stages, defines });
+    start(builds.back());
+}
+
+// Loads the build's binary from the cache, or compiles and links it without
+// waiting for the result
+void ShaderManager::start(Build& build) {
+    std::string defineLines;
+    for (const std::string& define : build.defines) {
+        defineLines += "#define " + define + "\n";
+    }
+    
+    std::vector<std::string> texts;
+    uint64_t hash = hashBytes(14695981039346656037ull, driver.data(), driver.size());
+    for (const ShaderStage& stage : build.stages) {
+        auto source = sources.find(stage.source);
+        std::string text = source != sources.end() ? source->second.text : std::string();
+        
+        // #version has to stay the first directive
+        size_t version = text.find("#version");
+        size_t lineEnd = version != std::string::npos ? text.find('\n', version) : std::string::npos;
+        if (version == std::string::npos) {
+            text.insert(0, defineLines);
+        } else if (lineEnd == std::string::npos) {
+            text += "\n" + defineLines;
+        } else {
+            text.insert(lineEnd + 1, defineLines);
+        }
+        hash = hashBytes(hash, &stage.type, sizeof(stage.type));
+        hash = hashBytes(hash, text.data(), text.size());
+        texts.push_back(std::move(text));
+    }
+    build.hash = hash;
+    
+    build.program = binaryCache() ? loadBinary(hash) : 0;
+    build.fromCache = build.program != 0;
+    if (build.fromCache) {
+        return;
+    }
+    
+    build.program = glCreateProgram();
+    for (size_t i = 0; i < build.stages.size(); i++) {
+        GLuint shader = glCreateShader(build.stages[i].type);
+        const char* text = texts[i].c_str();
+        glShaderSource(shader, 1, &text, NULL);
+        glCompileShader(shader);
+        glAttachShader(build.program, shader);
+        build.shaders.push_back(shader);
+    }
+    if (binaries) {
+        glProgramBinaries.programParameteri(build.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glLinkProgram(build.program);
+}
+
+// Without wait, a build the driver is still compiling in parallel stays
+// pending; otherwise this blocks until it's done
+ShaderManager::BuildStatus ShaderManager::complete(Build& build, bool wait) {
+    if (!wait && parallel && !build.fromCache) {
+        GLint done = GL_FALSE;
+        glGetProgramiv(build.program, GL_COMPLETION_STATUS_KHR, &done);
+        if (!done) {
+            return BuildStatus::Pending;
+        }
+    }
+    
+    GLint linked = GL_FALSE;
+    glGetProgramiv(build.program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        std::cout << "ERROR::SHADER::BUILD_FAILED " << describe(build) << std::endl;
+        std::vector<GLchar> log;
+        for (GLuint shader : build.shaders) {
+            GLint compiled = GL_FALSE, length = 0;
+            glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+            if (!compiled && length > 0) {
+                log.resize(length);
+                glGetShaderInfoLog(shader, length, NULL, log.data());
+                std::cout << log.data() << std::endl;
+            }
+        }
+        GLint length = 0;
+        glGetProgramiv(build.program, GL_INFO_LOG_LENGTH, &length);
+        if (length > 0) {
+            log.resize(length);
+            glGetProgramInfoLog(build.program, length, NULL, log.data());
+            std::cout << log.data() << std::endl;
+        }
+        abandon(build);
+        return BuildStatus::Failed;
+    }
+    
+    if (build.fromCache) {
+        cacheHits++;
+    } else if (binaryCache()) {
+        saveBinary(build.program, build.hash);
+    }
+    for (GLuint shader : build.shaders) {
+        glDetachShader(build.program, shader);
+        glDeleteShader(shader);
+    }
+    build.shaders.clear();
+    
+    build.target->destroy();
+    build.target->adopt(build.program);
+    build.program = 0;
+    programsBuilt++;
+    return BuildStatus::Linked;
+}
+
+void ShaderManager::abandon(Build& build) {
+    for (GLuint shader : build.shaders) {
+        glDeleteShader(shader);
+    }
+    build.shaders.clear();
+    glDeleteProgram(build.program);
+    build.program = 0;
+}
+
+bool ShaderManager::finish() {
+    bool succeeded = true;
+    for (auto it = builds.begin(); it != builds.end();) {
+        if (it->program != 0 && complete(*it, true) == BuildStatus::Failed) {
+            succeeded = false;
+        }
+        
+        // With no program to keep, there is nothing to reload into either
+        if (it->target->id == 0) {
+            it = builds.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (batching) {
+        batching = false;
+        buildSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - batchStart).count();
+    }
+    return succeeded;
+}
+
+bool ShaderManager::poll() {
+    auto now = std::chrono::steady_clock::now();
+    if (!sourceDirectory.empty() && std::chrono::duration<double>(now - lastScan).count() >= SOURCE_POLL_SECONDS) {
+        lastScan = now;
+        for (auto it = sources.begin(); it != sources.end(); ++it) {
+            std::error_code error;
+            auto stamp = std::filesystem::last_write_time(std::filesystem::path(sourceDirectory) / it->first, error);
+            if (error || stamp == it->second.stamp) {
+                continue;
+            }
+            
+            // Restarts builds still compiling an older version too
+            std::cout << "Reloading shader " << it->first << std::endl;
+            readSource(it->first, it->second);
+            for (Build& build : builds) {
+                bool uses = std::any_of(build.stages.begin(), build.stages.end(),
+                                        [&](const ShaderStage& stage) { return stage.source == it->first; });
+                if (uses) {
+                    abandon(build);
+                    start(build);
+                }
+            }
+        }
+    }
+    
+    bool replaced = false;
+    for (Build& build : builds) {
+        if (build.program != 0 && complete(build, false) == BuildStatus::Linked) {
+            replaced = true;
+        }
+    }
+    return replaced;
+}
+
+std::string ShaderManager::describe(const Build& build) const {
+    std::string text;
+    for (const ShaderStage& stage : build.stages) {
+        text += (text.empty() ? "" : " + ") + stage.source;
+    }
+    for (const std::string& define : build.defines) {
+        text += " " + define;
+    }
+    return text;
+}
+
+std::string ShaderManager::binaryPath(uint64_t hash) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(hash));
+    return (std::filesystem::path(cacheDirectory) / name).string();
+}
+
+// A linked program from the cache, or 0 when there is none or the driver
+// turns it down
+GLuint ShaderManager::loadBinary(uint64_t hash) {
+    MappedFile file;
+    if (!file.open(binaryPath(hash)) || file.size < sizeof(ShaderBinaryHeader)) {
+        return 0;
+    }
+    ShaderBinaryHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, SHADER_BINARY_MAGIC, sizeof(header.magic)) != 0
+        || header.version != SHADER_BINARY_VERSION || header.hash != hash
+        || sizeof(header) + header.length > file.size) {
+        return 0;
+    }
+    
+    GLuint program = glCreateProgram();
+    glProgramBinaries.programBinary(program, header.format, file.data + sizeof(header), header.length);
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+void ShaderManager::saveBinary(GLuint program, uint64_t hash) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+    std::vector<char> binary(length);
+    GLsizei written = 0;
+    GLenum format = 0;
+    glProgramBinaries.getProgramBinary(program, length, &written, &format, binary.data());
+    if (written <= 0) {
+        return;
+    }
+    
+    ShaderBinaryHeader header;
+    memcpy(header.magic, SHADER_BINARY_MAGIC, sizeof(header.magic));
+    header.version = SHADER_BINARY_VERSION;
+    header.hash = hash;
+    header.format = format;
+    header.length = static_cast<uint32_t>(written);
+    
+    // Written to a temporary file first, as the mesh cache is
+    std::error_code error;
+    std::filesystem::create_directories(cacheDirectory, error);
+    std::string path = binaryPath(hash);
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(binary.data(), written);
+        if (!file) {
+            std::cerr << "Failed to write shader binary: " << path << std::endl;
+            return;
+        }
+    }
+    std::filesystem::rename(tempPath, path, error);
+    if (error) {
+        std::cerr << "Failed to write shader binary: " << path << " (" << error.message() << ")" << std::endl;
+        std::filesystem::remove(tempPath, error);
+    }
+}
+
+void RenderState::invalidate() {
+    currentProgram = GL_NONE;
+    currentVertexArray = GL_NONE;
+    currentArrayBuffer = GL_NONE;
+    currentPolygonMode = GL_NONE;
+    currentDepthFunc = GL_NONE;
+    currentDepthMask = -1;
+    currentColorMask = -1;
+}
+
+void RenderState::useProgram(GLuint program) {
+    if (currentProgram == program && program != GL_NONE) {
+        stats.skippedCalls++;
+        return;
+    }
+    glUseProgram(program);
+    currentProgram = program;
+    stats.glCalls++;
+}
+
+void RenderState::bindVertexArray(GLuint vertexArray) {
+    if (currentVertexArray == vertexArray && vertexArray != GL_NONE) {
+        stats.skippedCalls++;
+        return;
+    }
+    glBindVertexArray(vertexArray);
+    currentVertexArray = vertexArray;
+    stats.glCalls++;
+}
+
+void RenderState::bindArrayBuffer(GLuint buffer) {
+    if (currentArrayBuffer == buffer && buffer != GL_NONE) {
+        stats.skippedCalls++;
+        return;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    currentArrayBuffer = buffer;
+    stats.glCalls++;
+}
+
+void RenderState::polygonMode(GLenum mode) {
+    if (currentPolygonMode == mode) {
+        stats.skippedCalls++;
+        return;
+    }
+    glPolygonMode(GL_FRONT_AND_BACK, mode);
+    currentPolygonMode = mode;
+    stats.glCalls++;
+}
+
+void RenderState::depthFunc(GLenum func) {
+    if (currentDepthFunc == func) {
+        stats.skippedCalls++;
+        return;
+    }
+    glDepthFunc(func);
+    currentDepthFunc = func;
+    stats.glCalls++;
+}
+
+void RenderState::depthMask(bool write) {
+    if (currentDepthMask == (write ? 1 : 0)) {
+        stats.skippedCalls++;
+        return;
+    }
+    glDepthMask(write ? GL_TRUE : GL_FALSE);
+    currentDepthMask = write ? 1 : 0;
+    stats.glCalls++;
+}
+
+void RenderState::colorMask(bool write) {
+    if (currentColorMask == (write ? 1 : 0)) {
+        stats.skippedCalls++;
+        return;
+    }
+    GLboolean mask = write ? GL_TRUE : GL_FALSE;
+    glColorMask(mask, mask, mask, mask);
+    currentColorMask = write ? 1 : 0;
+    stats.glCalls++;
+}
+
+void RenderState::drawElementsInstanced(GLsizei indexCount, GLenum indexType, GLsizei instanceCount, GLuint firstIndex) {
+    size_t indexSize = indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+    glDrawElementsInstanced(GL_TRIANGLES, indexCount, indexType, (void*)(firstIndex * indexSize), instanceCount);
+    stats.glCalls++;
+    stats.drawCalls++;
+    stats.triangles += static_cast<size_t>(indexCount / 3) * instanceCount;
+}
+
+// Command layout and stride match DrawElementsIndirectCommand
+void RenderState::drawElementsIndirect(GLenum indexType, size_t commandOffset, GLsizei drawCount) {
+    if (drawCount == 1) {
+        glDrawElementsIndirect(GL_TRIANGLES, indexType, (void*)commandOffset);
+    } else {
+        glCompute.multiDrawElementsIndirect(GL_TRIANGLES, indexType, (void*)commandOffset, drawCount, 0);
+    }
+    stats.glCalls++;
+    stats.drawCalls++;
+}
+
+void FrameProfiler::History::push(double milliseconds) {
+    if (count == PROFILER_HISTORY) {
+        sum -= samples[head];
+    } else {
+        count++;
+    }
+    samples[head] = milliseconds;
+    sum += milliseconds;
+    head = (head + 1) % PROFILER_HISTORY;
+}
+
+void FrameProfiler::init(bool recordTrace) {
+    epoch = std::chrono::steady_clock::now();
+    tracing = recordTrace;
+    if (tracing) {
+        trace.reserve(PROFILER_TRACE_EVENTS);
+    }
+    cpuScopes.reserve(16);
+}
+
+void FrameProfiler::destroy() {
+    for (GpuFrame& frame : gpuFrames) {
+        if (!frame.queries.empty()) {
+            glDeleteQueries(static_cast<GLsizei>(frame.queries.size()), frame.queries.data());
+        }
+        frame = GpuFrame();
+    }
+}
+
+// Closes the previous frame: its CPU totals and the frame time go into the
+// history, and the GPU results of the frame that last used this query set
+// are read back if they are ready, or dropped if not
+void FrameProfiler::beginFrame() {
+    // Make sure the ending frame's queries reach the GPU even where nothing
+    // else flushes, as with offscreen surfaces
+    if (gpuFrames[frameCount % PROFILER_FRAMES_IN_FLIGHT].used > 0) {
+        glFlush();
+    }
+    
+    double time = now();
+    if (frameCount > 0) {
+        frameTimes.push((time - frameStart) / 1000.0);
+        for (Stage& stage : stages) {
+            if (!stage.gpu) {
+                stage.history.push(stage.frameMilliseconds);
+                stage.frameMilliseconds = 0.0;
+            }
+        }
+    }
+    frameCount++;
+    collectGpuFrame(gpuFrames[frameCount % PROFILER_FRAMES_IN_FLIGHT]);
+    frameStart = time;
+}
+
+void FrameProfiler::beginCpu(const char* name) {
+    cpuScopes.emplace_back(stageIndex(name, false), now());
+}
+
+void FrameProfiler::endCpu() {
+    if (cpuScopes.empty()) {
+        return;
+    }
+    std::pair<size_t, double> scope = cpuScopes.back();
+    cpuScopes.pop_back();
+    double duration = now() - scope.second;
+    stages[scope.first].frameMilliseconds += duration / 1000.0;
+    record(stages[scope.first].name, false, scope.second, duration);
+}
+
+void FrameProfiler::beginGpu(const char* name) {
+    if (gpuScopeOpen) {
+        return;
+    }
+    GpuFrame& frame = gpuFrames[frameCount % PROFILER_FRAMES_IN_FLIGHT];
+    if (frame.used == frame.queries.size()) {
+        GLuint query = 0;
+        glGenQueries(1, &query);
+        frame.queries.push_back(query);
+        frame.stages.push_back(0);
+        frame.submitted.push_back(0.0);
+    }
+    frame.stages[frame.used] = stageIndex(name, true);
+    frame.submitted[frame.used] = now();
+    glBeginQuery(GL_TIME_ELAPSED, frame.queries[frame.used]);
+    frame.used++;
+    gpuScopeOpen = true;
+}
+
+void FrameProfiler::endGpu() {
+    if (gpuScopeOpen) {
+        glEndQuery(GL_TIME_ELAPSED);
+        gpuScopeOpen = false;
+    }
+}
+
+void FrameProfiler::collectGpuFrame(GpuFrame& frame) {
+    if (frame.used == 0) {
+        return;
+    }
+    
+    // Queries finish in order, so the last one being ready means all are
+    GLint available = 0;
+    glGetQueryObjectiv(frame.queries[frame.used - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+        droppedGpuFrames++;
+        frame.used = 0;
+        return;
+    }
+    
+    for (size_t i = 0; i < frame.used; i++) {
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(frame.queries[i], GL_QUERY_RESULT, &nanoseconds);
+        Stage& stage = stages[frame.stages[i]];
+        stage.frameMilliseconds += nanoseconds / 1e6;
+        record(stage.name, true, frame.submitted[i], nanoseconds / 1e3);
+    }
+    for (Stage& stage : stages) {
+        if (stage.gpu) {
+            stage.history.push(stage.frameMilliseconds);
+            stage.frameMilliseconds = 0.0;
+        }
+    }
+    frame.used = 0;
+}
+
+// Frame time with percentiles, then each stage's rolling average in ms
+std::string FrameProfiler::summary() const {
+    std::vector<double> sorted(frameTimes.samples, frameTimes.samples + frameTimes.count);
+    std::sort(sorted.begin(), sorted.end());
+    auto percentile = [&](double fraction) {
+        return sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()))];
+    };
+    
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(2) << frameTimes.average() << " ms/frame (p50 " << percentile(0.5)
+         << ", p95 " << percentile(0.95) << ", p99 " << percentile(0.99) << ")";
+    for (int gpu = 0; gpu < 2; gpu++) {
+        bool first = true;
+        for (const Stage& stage : stages) {
+            if (stage.gpu != (gpu == 1)) {
+                continue;
+            }
+            text << (first ? (gpu ? " | GPU " : " | CPU ") : ", ") << stage.name << " " << stage.history.average();
+            first = false;
+        }
+    }
+    if (droppedGpuFrames > 0) {
+        text << " (" << droppedGpuFrames << " GPU frames late)";
+    }
+    return text.str();
+}
+
+// Chrome trace event format, for chrome://tracing or Perfetto. GPU events
+// sit at the CPU time their commands were submitted; only their durations
+// come from the GPU.
+bool FrameProfiler::writeTrace(const std::string& path) const {
+    std::ofstream file(path, std::ios::trunc);
+    if (!file) {
+        return false;
+    }
+    
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+         << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n"
+         << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}";
+    file << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < trace.size(); i++) {
+        const TraceEvent& event = trace[(traceHead + i) % trace.size()];
+        file << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"" << (event.gpu ? "gpu" : "cpu")
+             << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << (event.gpu ? 2 : 1)
+             << ",\"ts\":" << event.start << ",\"dur\":" << event.duration << "}";
+    }
+    file << "\n]}\n";
+    return static_cast<bool>(file);
+}
+
+double FrameProfiler::now() const {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+size_t FrameProfiler::stageIndex(const char* name, bool gpu) {
+    for (size_t i = 0; i < stages.size(); i++) {
+        if (stages[i].gpu == gpu && (stages[i].name == name || std::strcmp(stages[i].name, name) == 0)) {
+            return i;
+        }
+    }
+    Stage stage;
+    stage.name = name;
+    stage.gpu = gpu;
+    stages.push_back(stage);
+    return stages.size() - 1;
+}
+
+// Once the trace is full each new event overwrites the oldest
+void FrameProfiler::record(const char* name, bool gpu, double start, double duration) {
+    if (!tracing) {
+        return;
+    }
+    TraceEvent event = { name, gpu, start, duration };
+    if (trace.size() < PROFILER_TRACE_EVENTS) {
+        trace.push_back(event);
+    } else {
+        trace[traceHead] = event;
+        traceHead = (traceHead + 1) % PROFILER_TRACE_EVENTS;
+    }
+}
+
+void OverdrawCounter::init() {
+    glGenQueries(PROFILER_FRAMES_IN_FLIGHT, queries);
+}
+
+void OverdrawCounter::destroy() {
+    if (queries[0] != 0) {
+        glDeleteQueries(PROFILER_FRAMES_IN_FLIGHT, queries);
+    }
+    *this = OverdrawCounter();
+}
+
+// Reads back the query that last used this slot before reusing it
+void OverdrawCounter::begin() {
+    if (pending[slot]) {
+        collect(slot);
+    }
+    GLint viewport[4] = {};
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    pixels[slot] = static_cast<double>(viewport[2]) * viewport[3];
+    glBeginQuery(GL_SAMPLES_PASSED, queries[slot]);
+}
+
+void OverdrawCounter::end() {
+    glEndQuery(GL_SAMPLES_PASSED);
+    pending[slot] = true;
+    slot = (slot + 1) % PROFILER_FRAMES_IN_FLIGHT;
+}
+
+// Restarts the average, e.g. once a benchmark's warmup is over
+void OverdrawCounter::reset() {
+    sum = 0.0;
+    count = 0;
+}
+
+void OverdrawCounter::collect(unsigned int querySlot) {
+    pending[querySlot] = false;
+    GLint available = 0;
+    glGetQueryObjectiv(queries[querySlot], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available || pixels[querySlot] <= 0.0) {
+        return;
+    }
+    GLuint64 samples = 0;
+    glGetQueryObjectui64v(queries[querySlot], GL_QUERY_RESULT, &samples);
+    latestRatio = samples / pixels[querySlot];
+    sum += latestRatio;
+    count++;
+}
+
+bool hasGLVersion(GLint wantedMajor, GLint wantedMinor) {
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    return major > wantedMajor || (major == wantedMajor && minor >= wantedMinor);
+}
+
+bool hasGLExtension(const char* extension) {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++) {
+        const char* name = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+        if (name && std::strcmp(name, extension) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+long long driverFreeVideoMemory() {
+    GLint kilobytes[4] = { -1, 0, 0, 0 };
+    if (hasGLExtension("GL_NVX_gpu_memory_info")) {
+        glGetIntegerv(GL_GPU_MEMORY_CURRENT_AVAILABLE_VIDMEM_NVX, kilobytes);
+    } else if (hasGLExtension("GL_ATI_meminfo")) {
+        glGetIntegerv(GL_VBO_FREE_MEMORY_ATI, kilobytes);
+    }
+    return kilobytes[0] < 0 ? -1 : kilobytes[0] * 1024LL;
+}
+
+bool GLComputeFunctions::load() {
+    if (!hasGLVersion(4, 3)) {
+        return false;
+    }
+    
+    dispatchCompute = (decltype(dispatchCompute))glfwGetProcAddress("glDispatchCompute");
+    memoryBarrier = (decltype(memoryBarrier))glfwGetProcAddress("glMemoryBarrier");
+    multiDrawElementsIndirect = (decltype(multiDrawElementsIndirect))glfwGetProcAddress("glMultiDrawElementsIndirect");
+    return dispatchCompute && memoryBarrier && multiDrawElementsIndirect;
+}
+
+bool GLProgramBinaryFunctions::load() {
+    if (!hasGLVersion(4, 1) && !hasGLExtension("GL_ARB_get_program_binary")) {
+        return false;
+    }
+    
+    // Drivers may support the entry points without any format to save in
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats <= 0) {
+        return false;
+    }
+    getProgramBinary = (decltype(getProgramBinary))glfwGetProcAddress("glGetProgramBinary");
+    programBinary = (decltype(programBinary))glfwGetProcAddress("glProgramBinary");
+    programParameteri = (decltype(programParameteri))glfwGetProcAddress("glProgramParameteri");
+    return getProgramBinary && programBinary && programParameteri;
+}
+
+bool GLParallelCompileFunctions::load() {
+    if (hasGLExtension("GL_KHR_parallel_shader_compile")) {
+        maxShaderCompilerThreads = (decltype(maxShaderCompilerThreads))glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+    } else if (hasGLExtension("GL_ARB_parallel_shader_compile")) {
+        maxShaderCompilerThreads = (decltype(maxShaderCompilerThreads))glfwGetProcAddress("glMaxShaderCompilerThreadsARB");
+    }
+    return maxShaderCompilerThreads != nullptr;
+}
+
+bool GLBufferStorageFunctions::load() {
+    if (!hasGLVersion(4, 4) && !hasGLExtension("GL_ARB_buffer_storage")) {
+        return false;
+    }
+    bufferStorage = (decltype(bufferStorage))glfwGetProcAddress("glBufferStorage");
+    return bufferStorage != nullptr;
+}
+
+// Words per RGBA32UI texel
+const size_t LIGHT_TEXEL_WORDS = 4;
+
+static_assert(sizeof(PointLight) == 2 * LIGHT_TEXEL_WORDS * sizeof(uint32_t), "a light is two texels of the light table");
+
+// The cluster grid and sampler unit never change, so they're set once per
+// program; a reloaded program calls this again
+void LightClusters::init(const ShaderProgram& clusteredProgram) {
+    program = clusteredProgram.id;
+    lightTablesLocation = clusteredProgram.location("lightTables");
+    sliceScaleBiasLocation = clusteredProgram.location("sliceScaleBias");
+    ambientColorLocation = clusteredProgram.location("ambientColor");
+    glUseProgram(program);
+    glUniform1i(clusteredProgram.location("lightData"), LIGHT_TEXTURE_UNIT);
+    glUniform3i(clusteredProgram.location("clusterCounts"), CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES);
+    
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    if (texture == 0) {
+        glGenTextures(1, &texture);
+    }
+}
+
+void LightClusters::destroy() {
+    glDeleteTextures(1, &texture);
+    texture = 0;
+    attachedBuffer = 0;
+}
+
+// Finds the clusters each light's sphere touches, then lays out the tables
+// with each cluster's light indices contiguous in light order. Returns the
+// bytes write() will need.
+size_t LightClusters::build(const std::vector<PointLight>& lights, const glm::mat4& view, const glm::mat4& projection) {
+    // Near and far planes back out of a glm::perspective matrix
+    float nearPlane = projection[3][2] / (projection[2][2] - 1.0f);
+    float farPlane = projection[3][2] / (projection[2][2] + 1.0f);
+    float sliceScale = CLUSTER_SLICES / std::log(farPlane / nearPlane);
+    sliceScaleBias = glm::vec2(sliceScale, -std::log(nearPlane) * sliceScale);
+    ambientColor = lights.empty() ? glm::vec3(0.0f) : lights[0].color;
+    lightCount = lights.size();
+    
+    auto sliceOf = [&](float depth) {
+        int slice = static_cast<int>(std::floor(std::log(depth) * sliceScaleBias.x + sliceScaleBias.y));
+        return static_cast<unsigned int>(glm::clamp(slice, 0, static_cast<int>(CLUSTER_SLICES) - 1));
+    };
+    auto tileOf = [](float ndc, unsigned int tiles) {
+        int tile = static_cast<int>(std::floor((ndc * 0.5f + 0.5f) * tiles));
+        return static_cast<unsigned int>(glm::clamp(tile, 0, static_cast<int>(tiles) - 1));
+    };
+    
+    clusterCounts.assign(CLUSTER_COUNT, 0);
+    lightRanges.resize(lights.size());
+    for (size_t l = 0; l < lights.size(); l++) {
+        const PointLight& light = lights[l];
+        LightRange& range = lightRanges[l];
+        range = { { 0, CLUSTER_TILES_X - 1 }, { 0, CLUSTER_TILES_Y - 1 }, { 0, CLUSTER_SLICES - 1 }, true };
+        if (light.radius > 0.0f) {
+            glm::vec3 center = glm::vec3(view * glm::vec4(light.position, 1.0f));
+            float radius = light.radius;
+            float closest = -center.z - radius, farthest = -center.z + radius;
+            range.visible = farthest >= nearPlane && closest <= farPlane;
+            range.slice[0] = sliceOf(std::max(closest, nearPlane));
+            range.slice[1] = sliceOf(std::min(farthest, farPlane));
+            
+            // The corners of the sphere's view-space box bound its projection,
+            // unless the box reaches past the near plane; then it may cover
+            // any tile
+            if (range.visible && closest > nearPlane) {
+                glm::vec2 low(std::numeric_limits<float>::max()), high(-std::numeric_limits<float>::max());
+                for (int corner = 0; corner < 8; corner++) {
+                    glm::vec3 offset((corner & 1) ? radius : -radius, (corner & 2) ? radius : -radius,
+                                     (corner & 4) ? radius : -radius);
+                    glm::vec4 clip = projection * glm::vec4(center + offset, 1.0f);
+                    glm::vec2 ndc(clip.x / clip.w, clip.y / clip.w);
+                    low = glm::min(low, ndc);
+                    high = glm::max(high, ndc);
+                }
+                range.visible = high.x >= -1.0f && low.x <= 1.0f && high.y >= -1.0f && low.y <= 1.0f;
+                range.tileX[0] = tileOf(low.x, CLUSTER_TILES_X);
+                range.tileX[1] = tileOf(high.x, CLUSTER_TILES_X);
+                range.tileY[0] = tileOf(low.y, CLUSTER_TILES_Y);
+                range.tileY[1] = tileOf(high.y, CLUSTER_TILES_Y);
+            }
+        }
+        if (!range.visible) {
+            continue;
+        }
+        for (unsigned int slice = range.slice[0]; slice <= range.slice[1]; slice++) {
+            for (unsigned int y = range.tileY[0]; y <= range.tileY[1]; y++) {
+                for (unsigned int x = range.tileX[0]; x <= range.tileX[1]; x++) {
+                    clusterCounts[(slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x]++;
+                }
+            }
+        }
+    }
+    
+    // Prefix sums give each cluster its first entry; the counts are then
+    // reused as fill cursors
+    clusterFirst.resize(CLUSTER_COUNT);
+    uint32_t total = 0;
+    for (unsigned int c = 0; c < CLUSTER_COUNT; c++) {
+        clusterFirst[c] = total;
+        total += clusterCounts[c];
+        clusterCounts[c] = 0;
+    }
+    indices.resize(total);
+    for (size_t l = 0; l < lights.size(); l++) {
+        const LightRange& range = lightRanges[l];
+        if (!range.visible) {
+            continue;
+        }
+        for (unsigned int slice = range.slice[0]; slice <= range.slice[1]; slice++) {
+            for (unsigned int y = range.tileY[0]; y <= range.tileY[1]; y++) {
+                for (unsigned int x = range.tileX[0]; x <= range.tileX[1]; x++) {
+                    unsigned int cluster = (slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x;
+                    indices[clusterFirst[cluster] + clusterCounts[cluster]++] = static_cast<uint32_t>(l);
+                }
+            }
+        }
+    }
+    
+    size_t clusterWord = lights.size() * 2 * LIGHT_TEXEL_WORDS;
+    size_t indexWord = clusterWord + CLUSTER_COUNT * LIGHT_TEXEL_WORDS;
+    texels.assign(indexWord + (indices.size() + 3) / 4 * LIGHT_TEXEL_WORDS, 0u);
+    if (!lights.empty()) {
+        std::memcpy(texels.data(), lights.data(), lights.size() * sizeof(PointLight));
+    }
+    for (unsigned int c = 0; c < CLUSTER_COUNT; c++) {
+        texels[clusterWord + c * LIGHT_TEXEL_WORDS] = clusterFirst[c];
+        texels[clusterWord + c * LIGHT_TEXEL_WORDS + 1] = clusterCounts[c];
+    }
+    std::copy(indices.begin(), indices.end(), texels.begin() + indexWord);
+    return texels.size() * sizeof(uint32_t);
+}
+
+// Copies the tables into the ring and points the clustered program at them.
+// Returns false when they didn't fit or lie beyond what a buffer texture
+// can address.
+bool LightClusters::write(RingBuffer& ring, RenderState& state) {
+    size_t texelBytes = LIGHT_TEXEL_WORDS * sizeof(uint32_t);
+    size_t bytes = texels.size() * sizeof(uint32_t);
+    size_t offset = 0;
+    void* data = ring.allocate(bytes, texelBytes, offset);
+    if (!data) {
+        return false;
+    }
+    GLint base = static_cast<GLint>(offset / texelBytes);
+    if (static_cast<size_t>(base) + texels.size() / LIGHT_TEXEL_WORDS > static_cast<size_t>(maxTexels)) {
+        return false;
+    }
+    std::memcpy(data, texels.data(), bytes);
+    
+    glActiveTexture(GL_TEXTURE0 + LIGHT_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, texture);
+    state.issued(2);
+    if (attachedBuffer != ring.buffer) {
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, ring.buffer);
+        attachedBuffer = ring.buffer;
+        state.issued(1);
+    }
+    
+    GLint clusterBase = base + static_cast<GLint>(lightCount * 2);
+    state.useProgram(program);
+    glUniform3i(lightTablesLocation, base, clusterBase, clusterBase + static_cast<GLint>(CLUSTER_COUNT));
+    glUniform2fv(sliceScaleBiasLocation, 1, glm::value_ptr(sliceScaleBias));
+    glUniform3fv(ambientColorLocation, 1, glm::value_ptr(ambientColor));
+    state.issued(3);
+    return true;
+}
+
+void InstanceRenderer::init(const ShaderProgram& colorProgram, const ShaderProgram& depthProgram,
+                            const ShaderProgram& overdrawProgram, const ShaderProgram& clusteredProgram) {
+    const ShaderProgram* programs[DRAW_PASS_COUNT] = { &colorProgram, &depthProgram, &overdrawProgram,
+                                                       &clusteredProgram };
+    for (unsigned int pass = 0; pass < DRAW_PASS_COUNT; pass++) {
+        passPrograms[pass].id = programs[pass]->id;
+        passPrograms[pass].positionScaleLocation = programs[pass]->location("positionScale");
+        passPrograms[pass].positionOffsetLocation = programs[pass]->location("positionOffset");
+    }
+    if (cullProgram.id != 0) {
+        findCullUniforms();
+    }
+}
+
+// Requires glCompute.load() to have succeeded and shaders to hold "cull.comp"
+bool InstanceRenderer::initGpuCulling(ShaderManager& shaders) {
+    shaders.request(cullProgram, { { GL_COMPUTE_SHADER, "cull.comp" } }, {});
+    if (!shaders.finish() || cullProgram.id == 0) {
+        cullProgram.destroy();
+        return false;
+    }
+    findCullUniforms();
+    
+    glGenBuffers(1, &cullInstanceBuffer);
+    glGenBuffers(1, &commandBuffer);
+    glGenBuffers(1, &visibleBuffer);
+    glGenBuffers(1, &lodErrorBuffer);
+    return true;
+}
+
+void InstanceRenderer::findCullUniforms() {
+    planesLocation = cullProgram.location("planes");
+    instanceCountLocation = cullProgram.location("instanceCount");
+    selectedIndexLocation = cullProgram.location("selectedIndex");
+    eyeLocation = cullProgram.location("eye");
+    pixelsPerUnitLocation = cullProgram.location("pixelsPerUnit");
+    lodPixelErrorLocation = cullProgram.location("lodPixelError");
+}
+
+void InstanceRenderer::destroy() {
+    boundRange.clear();
+    
+    if (cullProgram.id != 0) {
+        cullProgram.destroy();
+        glDeleteBuffers(1, &cullInstanceBuffer);
+        glDeleteBuffers(1, &commandBuffer);
+        glDeleteBuffers(1, &visibleBuffer);
+        glDeleteBuffers(1, &lodErrorBuffer);
+        cullInstanceBuffer = commandBuffer = visibleBuffer = lodErrorBuffer = 0;
+        uploadedCount = 0;
+    }
+}
+
+void InstanceRenderer::bindInstances(const Mesh& mesh, GLuint buffer, GLsizei first, RenderState& state) {
+    state.bindVertexArray(mesh.VAO);
+    
+    // Divisors and enables are VAO state and only need setting once
+    auto bound = boundRange.find(mesh.VAO);
+    if (bound != boundRange.end() && bound->second == std::make_pair(buffer, first)) {
+        return;
+    }
+    bool prepared = bound != boundRange.end();
+    boundRange[mesh.VAO] = std::make_pair(buffer, first);
+    
+    state.bindArrayBuffer(buffer);
+    size_t base = first * sizeof(InstanceData);
+    for (GLuint column = 0; column < 4; column++) {
+        GLuint location = ATTRIB_INSTANCE_MODEL + column;
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                              (void*)(base + offsetof(InstanceData, model) + column * sizeof(glm::vec4)));
+        if (!prepared) {
+            glVertexAttribDivisor(location, 1);
+            glEnableVertexAttribArray(location);
+            state.issued(2);
+        }
+    }
+    for (GLuint column = 0; column < 3; column++) {
+        GLuint location = ATTRIB_INSTANCE_NORMAL_MATRIX + column;
+        glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                              (void*)(base + offsetof(InstanceData, normalMatrix) + column * sizeof(glm::vec3)));
+        if (!prepared) {
+            glVertexAttribDivisor(location, 1);
+            glEnableVertexAttribArray(location);
+            state.issued(2);
+        }
+    }
+    glVertexAttribPointer(ATTRIB_INSTANCE_SELECTED, 1, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                          (void*)(base + offsetof(InstanceData, selected)));
+    state.issued(8);
+    if (!prepared) {
+        glVertexAttribDivisor(ATTRIB_INSTANCE_SELECTED, 1);
+        glEnableVertexAttribArray(ATTRIB_INSTANCE_SELECTED);
+        state.issued(2);
+    }
+}
+
+// Assigns each resident instance to its mesh's batch and lays the batches
+// out back to back for the GPU path, returning the number of instance slots.
+// A batch has one range of slots per LOD, since the compute shader picks
+// visibility and LOD. Counts are reset so callers can fill the batches in order.
+GLsizei InstanceRenderer::groupBatches(const InstanceArray& instances) {
+    batches.clear();
+    batchOfMesh.clear();
+    instanceBatch.resize(instances.size());
+    for (size_t i = 0; i < instances.size(); i++) {
+        if (!instances.resident[i]) {
+            continue;
+        }
+        const Mesh* mesh = instances.meshes[i].get();
+        auto found = batchOfMesh.find(mesh);
+        if (found == batchOfMesh.end()) {
+            found = batchOfMesh.emplace(mesh, batches.size()).first;
+            batches.push_back({ mesh, 0, 0 });
+        }
+        instanceBatch[i] = found->second;
+        batches[found->second].count++;
+    }
+    
+    GLsizei offset = 0;
+    for (Batch& batch : batches) {
+        batch.first = offset;
+        offset += batch.count * static_cast<GLsizei>(batch.mesh->lods.size());
+        batch.count = 0;
+    }
+    return offset;
+}
+
+// Culls, picks LODs and records a packet for every visible instance, with
+// the instances split into ranges across the job threads. Each thread only
+// writes its own range of the instance array and its own packet buffer.
+// A packet's depth is the distance from the eye to its bounding sphere.
+// Returns the number of visible instances.
+size_t InstanceRenderer::recordPackets(InstanceArray& instances, const Frustum& frustum, const glm::vec3& eye,
+                                       float pixelsPerUnit, int selectedIndex, bool wireframeMode, JobSystem& jobs) {
+    threadPackets.resize(jobs.threadCount());
+    for (std::vector<DrawPacket>& buffer : threadPackets) {
+        buffer.clear();
+    }
+    
+    jobs.parallelFor(instances.size(), RECORD_JOB_INSTANCES, [&](size_t begin, size_t end, unsigned int thread) {
+        instances.cull(frustum, begin, end);
+        instances.selectLods(eye, pixelsPerUnit, begin, end);
+        std::vector<DrawPacket>& buffer = threadPackets[thread];
+        for (size_t i = begin; i < end; i++) {
+            if (!instances.visible[i]) {
+                continue;
+            }
+            // The selected object is drawn in wireframe when that mode is on
+            bool wireframe = wireframeMode && static_cast<int>(i) == selectedIndex;
+            uint64_t key = drawPacketKey(instances.meshIds[i], instances.lodLevels[i], wireframe);
+            glm::vec3 center(instances.sphereX[i], instances.sphereY[i], instances.sphereZ[i]);
+            float distance = glm::length(center - eye) - instances.sphereRadius[i];
+            buffer.push_back({ key, static_cast<uint32_t>(i), drawPacketDepth(distance) });
+        }
+    });
+    
+    size_t visibleCount = 0;
+    for (const std::vector<DrawPacket>& buffer : threadPackets) {
+        visibleCount += buffer.size();
+    }
+    return visibleCount;
+}
+
+void InstanceRenderer::sortPackets() {
+    packets.clear();
+    for (const std::vector<DrawPacket>& buffer : threadPackets) {
+        packets.insert(packets.end(), buffer.begin(), buffer.end());
+    }
+    std::sort(packets.begin(), packets.end());
+    
+    // Each run stays one instanced draw, with its instances front to back;
+    // the runs themselves go front to back by their nearest instance, so
+    // near objects fill the depth buffer before far ones are shaded
+    runs.clear();
+    for (size_t first = 0; first < packets.size();) {
+        size_t last = first + 1;
+        while (last < packets.size() && packets[last].key == packets[first].key) {
+            last++;
+        }
+        runs.push_back({ first, last - first, packets[first].depth });
+        first = last;
+    }
+    std::sort(runs.begin(), runs.end(), [](const DrawRun& a, const DrawRun& b) {
+        return a.depth != b.depth ? a.depth < b.depth : a.first < b.first;
+    });
+}
+
+// Writes each packet's instance data into the ring buffer in packet order,
+// split across the jobs. The ring memory is write-only, so it is filled
+// front to back and never read. Returns false when it didn't fit.
+bool InstanceRenderer::writeInstances(const InstanceArray& instances, int selectedIndex, RingBuffer& ring,
+                                      JobSystem& jobs) {
+    // Starting on a whole slot lets the draws address it by instance
+    size_t offset = 0;
+    InstanceData* data = static_cast<InstanceData*>(ring.allocate(packets.size() * sizeof(InstanceData),
+                                                                  sizeof(InstanceData), offset));
+    if (!data) {
+        return false;
+    }
+    packetBuffer = ring.buffer;
+    packetSlot = static_cast<GLsizei>(offset / sizeof(InstanceData));
+    
+    jobs.parallelFor(packets.size(), RECORD_JOB_INSTANCES, [&](size_t begin, size_t end, unsigned int) {
+        for (size_t p = begin; p < end; p++) {
+            uint32_t i = packets[p].instance;
+            data[p].model = instances.models[i];
+            data[p].normalMatrix = instances.normalMatrices[i];
+            data[p].selected = static_cast<int>(i) == selectedIndex ? 1.0f : 0.0f;
+        }
+    });
+    return true;
+}
+
+const InstanceRenderer::PassProgram& InstanceRenderer::usePass(DrawPass pass, RenderState& state) {
+    const PassProgram& program = passPrograms[static_cast<unsigned int>(pass)];
+    state.useProgram(program.id);
+    return program;
+}
+
+// The pre-pass writes depth without color. After it, filled draws only
+// shade fragments at exactly the depth it left and write none, while the
+// wireframe, which it skipped, is depth tested and written as usual.
+void InstanceRenderer::setPassState(DrawPass pass, bool depthPrepassed, bool wireframe, RenderState& state) {
+    state.polygonMode(wireframe ? GL_LINE : GL_FILL);
+    state.colorMask(pass != DrawPass::Depth);
+    bool equalDepth = depthPrepassed && pass != DrawPass::Depth && !wireframe;
+    state.depthFunc(equalDepth ? GL_EQUAL : GL_LESS);
+    state.depthMask(!equalDepth);
+}
+
+// Issues one instanced draw per run of packets with the same key, front to
+// back, reading the instance data writeInstances() left in the ring buffer
+void InstanceRenderer::drawPackets(const InstanceArray& instances, DrawPass pass, bool depthPrepassed,
+                                   RenderState& state) {
+    const PassProgram& program = usePass(pass, state);
+    const Mesh* currentMesh = nullptr;
+    for (const DrawRun& run : runs) {
+        uint64_t key = packets[run.first].key;
+        bool wireframe = drawPacketWireframe(key);
+        if (wireframe && pass == DrawPass::Depth) {
+            continue;
+        }
+        
+        // Uniforms only change with the mesh
+        const Mesh& mesh = *instances.meshes[packets[run.first].instance];
+        if (&mesh != currentMesh) {
+            glUniform3fv(program.positionScaleLocation, 1, glm::value_ptr(mesh.format.positionScale));
+            glUniform3fv(program.positionOffsetLocation, 1, glm::value_ptr(mesh.format.positionOffset));
+            state.issued(2);
+            currentMesh = &mesh;
+        }
+        
+        const MeshLod& lod = mesh.lods[drawPacketLod(key)];
+        bindInstances(mesh, packetBuffer, packetSlot + static_cast<GLsizei>(run.first), state);
+        setPassState(pass, depthPrepassed, wireframe, state);
+        state.drawElementsInstanced(lod.indexCount, mesh.indexType, static_cast<GLsizei>(run.count), lod.firstIndex);
+    }
+}
+
+// Instance data only crosses the bus when transforms or membership changed
+void InstanceRenderer::uploadCullInstances(const InstanceArray& instances) {
+    if (instances.revision == uploadedRevision && instances.size() == uploadedCount) {
+        return;
+    }
+    uploadedRevision = instances.revision;
+    uploadedCount = instances.size();
+    
+    // Instances of meshes still loading are left out altogether
+    GLsizei slots = groupBatches(instances);
+    cullStaging.clear();
+    for (size_t i = 0; i < instances.size(); i++) {
+        if (!instances.resident[i]) {
+            continue;
+        }
+        cullStaging.emplace_back();
+        CullInstance& data = cullStaging.back();
+        const glm::mat3& normalMatrix = instances.normalMatrices[i];
+        data.model = instances.models[i];
+        for (int column = 0; column < 3; column++) {
+            data.normalMatrix[column] = glm::vec4(normalMatrix[column], 0.0f);
+        }
+        data.sphere = glm::vec4(instances.sphereX[i], instances.sphereY[i], instances.sphereZ[i],
+                                instances.sphereRadius[i]);
+        data.batch = static_cast<GLuint>(instanceBatch[i]);
+        data.index = static_cast<GLuint>(i);
+        batches[instanceBatch[i]].count++;
+    }
+    
+    // Unused levels get an error no instance can ever accept
+    lodErrorStaging.assign(batches.size(), glm::vec4(std::numeric_limits<float>::max()));
+    for (size_t b = 0; b < batches.size(); b++) {
+        const std::vector<MeshLod>& meshLods = batches[b].mesh->lods;
+        for (size_t l = 0; l < meshLods.size(); l++) {
+            lodErrorStaging[b][static_cast<int>(l)] = meshLods[l].error;
+        }
+    }
+    
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cullInstanceBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, cullStaging.size() * sizeof(CullInstance), cullStaging.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lodErrorBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, lodErrorStaging.size() * sizeof(glm::vec4), lodErrorStaging.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibleBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<GLsizei>(slots, 1) * sizeof(InstanceData), NULL, GL_DYNAMIC_COPY);
+}
+
+// Runs the culling shader, leaving each mesh's commands and visible
+// instances for drawIndirect(). Returns false when there's nothing to draw.
+bool InstanceRenderer::cullIndirect(const InstanceArray& instances, int selectedIndex, const Frustum& frustum,
+                                    const glm::vec3& eye, float pixelsPerUnit, RenderState& state,
+                                    FrameProfiler& profiler) {
+    profiler.beginCpu("cull");
+    uploadCullInstances(instances);
+    if (batches.empty()) {
+        profiler.endCpu();
+        return false;
+    }
+    
+    // Reset the commands. Each LOD gets a range of the mesh's instance count.
+    // The selected instance, if any, takes the last slot of the LOD 0 range,
+    // which regular instances can never fill; the shader fills in its LOD.
+    commands.assign(batches.size() * COMMANDS_PER_MESH, DrawElementsIndirectCommand());
+    for (size_t b = 0; b < batches.size(); b++) {
+        const Batch& batch = batches[b];
+        const std::vector<MeshLod>& meshLods = batch.mesh->lods;
+        DrawElementsIndirectCommand* meshCommands = &commands[b * COMMANDS_PER_MESH];
+        for (size_t l = 0; l < meshLods.size(); l++) {
+            GLuint first = static_cast<GLuint>(batch.first + l * batch.count);
+            meshCommands[l] = { static_cast<GLuint>(meshLods[l].indexCount), 0, meshLods[l].firstIndex, 0, first };
+        }
+        meshCommands[MAX_LODS].baseInstance = static_cast<GLuint>(batch.first + batch.count - 1);
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data(), GL_STREAM_DRAW);
+    
+    state.useProgram(cullProgram.id);
+    glUniform4fv(planesLocation, 6, glm::value_ptr(frustum.planes[0]));
+    glUniform1ui(instanceCountLocation, static_cast<GLuint>(cullStaging.size()));
+    glUniform1i(selectedIndexLocation, selectedIndex);
+    glUniform3fv(eyeLocation, 1, glm::value_ptr(eye));
+    glUniform1f(pixelsPerUnitLocation, pixelsPerUnit);
+    glUniform1f(lodPixelErrorLocation, LOD_PIXEL_ERROR);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, cullInstanceBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commandBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, visibleBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, lodErrorBuffer);
+    profiler.beginGpu("cull");
+    glCompute.dispatchCompute(static_cast<GLuint>((cullStaging.size() + 63) / 64), 1, 1);
+    glCompute.memoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    profiler.endGpu();
+    state.issued(16);
+    profiler.endCpu();
+    state.stats.gpuCulled = true;
+    return true;
+}
+
+// Submits the commands the last cullIndirect() filled in, one multi-draw
+// per mesh. The GPU appends instances in no particular order, so these
+// draws aren't sorted by depth.
+void InstanceRenderer::drawIndirect(const InstanceArray& instances, int selectedIndex, bool wireframeMode,
+                                    DrawPass pass, bool depthPrepassed, RenderState& state) {
+    bool hasSelected = selectedIndex >= 0 && selectedIndex < static_cast<int>(instances.size());
+    const Mesh* selectedMesh = hasSelected ? instances.meshes[selectedIndex].get() : nullptr;
+    const PassProgram& program = usePass(pass, state);
+    for (size_t b = 0; b < batches.size(); b++) {
+        const Mesh& mesh = *batches[b].mesh;
+        glUniform3fv(program.positionScaleLocation, 1, glm::value_ptr(mesh.format.positionScale));
+        glUniform3fv(program.positionOffsetLocation, 1, glm::value_ptr(mesh.format.positionOffset));
+        state.issued(2);
+        
+        // Base instance selects each command's range, so the VAO always
+        // points at the start of the visible buffer
+        bindInstances(mesh, visibleBuffer, 0, state);
+        setPassState(pass, depthPrepassed, false, state);
+        size_t commandOffset = b * COMMANDS_PER_MESH * sizeof(DrawElementsIndirectCommand);
+        if (wireframeMode && &mesh == selectedMesh) {
+            state.drawElementsIndirect(mesh.indexType, commandOffset, MAX_LODS);
+            if (pass != DrawPass::Depth) {
+                setPassState(pass, depthPrepassed, true, state);
+                state.drawElementsIndirect(mesh.indexType, commandOffset + MAX_LODS * sizeof(DrawElementsIndirectCommand), 1);
+            }
+        } else {
+            state.drawElementsIndirect(mesh.indexType, commandOffset, COMMANDS_PER_MESH);
+        }
+    }
+}
+
+std::vector<PointLight> scatterLights(size_t count, float halfWidth, float radius) {
+    std::vector<PointLight> lights;
+    lights.push_back({ glm::vec3(5.0f, 5.0f, 5.0f), 0.0f, glm::vec3(1.0f), 0.0f });
+    
+    uint32_t seed = 12345;
+    auto random = [&seed](float low, float high) {
+        seed = seed * 1664525u + 1013904223u;
+        return low + (high - low) * static_cast<float>(seed >> 8) / 16777216.0f;
+    };
+    float extent = halfWidth + radius * 0.5f;
+    for (size_t i = 1; i < count; i++) {
+        glm::vec3 position(random(-extent, extent), random(-extent, extent), random(0.5f, 2.0f));
+        
+        // One full channel keeps the colors saturated
+        glm::vec3 color(random(0.0f, 1.0f), random(0.0f, 1.0f), random(0.0f, 1.0f));
+        color[static_cast<int>(i % 3)] = 1.0f;
+        lights.push_back({ position, radius, color, 0.0f });
+    }
+    return lights;
+}
+
+bool SceneRenderer::init(bool allowGpuCulling, bool recordTrace, unsigned int jobThreads) {
+    // Every permutation of the scene shaders builds at once
+    shaders.init();
+    shaders.addSource("scene.vert", sceneVertexShaderSource);
+    shaders.addSource("scene.frag", sceneFragmentShaderSource);
+    shaders.addSource("cull.comp", cullComputeSource);
+    std::vector<ShaderStage> stages = { { GL_VERTEX_SHADER, "scene.vert" }, { GL_FRAGMENT_SHADER, "scene.frag" } };
+    shaders.request(shaderProgram, stages, {});
+    shaders.request(depthProgram, stages, { "DEPTH_ONLY" });
+    shaders.request(overdrawProgram, stages, { "OVERDRAW" });
+    shaders.request(clusteredProgram, stages, { "CLUSTERED_LIGHTS" });
+    if (!shaders.finish()) {
+        return false;
+    }
+    
+    GLint alignment = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    uniformAlignment = alignment > 0 ? static_cast<size_t>(alignment) : 256;
+    frameRing.init(RING_FRAME_BYTES, glStorage.load());
+    
+    glEnable(GL_DEPTH_TEST);
+    profiler.init(recordTrace);
+    overdraw.init();
+    jobs.start(jobThreads);
+    gpuCulling = allowGpuCulling && glCompute.load() && instanceRenderer.initGpuCulling(shaders);
+    bindPrograms();
+    
+    // A single white light until the caller sets others
+    lights = scatterLights(1, 0.0f, 0.0f);
+    return true;
+}
+
+// Hands the current programs to everything that keeps their ids or uniform
+// locations, after init() and whenever hot reload replaced one
+void SceneRenderer::bindPrograms() {
+    for (ShaderProgram* program : { &shaderProgram, &depthProgram, &overdrawProgram, &clusteredProgram }) {
+        program->bindUniformBlock("Camera", CAMERA_BLOCK_BINDING);
+    }
+    instanceRenderer.init(shaderProgram, depthProgram, overdrawProgram, clusteredProgram);
+    lightClusters.init(clusteredProgram);
+    
+    // A new single-light program has none of the light's uniforms yet
+    appliedLight = PointLight();
+    
+    // The cluster setup changed the program behind the tracker's back
+    state.invalidate();
+}
+
+void SceneRenderer::destroy() {
+    jobs.stop();
+    frameRing.destroy();
+    instanceRenderer.destroy();
+    profiler.destroy();
+    overdraw.destroy();
+    lightClusters.destroy();
+    shaderProgram.destroy();
+    depthProgram.destroy();
+    overdrawProgram.destroy();
+    clusteredProgram.destroy();
+    shaders.destroy();
+}
+
+void SceneRenderer::draw(InstanceArray& instances, int selectedIndex, bool wireframeMode, const glm::mat4& view,
+                         const glm::mat4& projection, const glm::vec3& eye, float pixelsPerUnit) {
+    if (shaders.poll()) {
+        bindPrograms();
+    }
+    
+    // Clearing needs the writes the last pass may have masked off, and the
+    // overdraw view counts layers up from black
+    state.depthMask(true);
+    state.colorMask(true);
+    if (overdrawView) {
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    } else {
+        glClearColor(0.1f, 0.1f, 0.2f, 1.0f);
+    }
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    state.issued(2);
+    
+    Frustum frustum = Frustum::fromMatrix(projection * view);
+    size_t instanceBytes = 0;
+    if (!gpuCulling) {
+        {
+            ProfileScope scope(profiler, "cull");
+            size_t visibleCount = instanceRenderer.recordPackets(instances, frustum, eye, pixelsPerUnit,
+                                                                 selectedIndex, wireframeMode, jobs);
+            state.stats.visibleInstances = visibleCount;
+            state.stats.culledInstances = instances.size() - visibleCount;
+        }
+        {
+            ProfileScope scope(profiler, "sort");
+            instanceRenderer.sortPackets();
+        }
+        instanceBytes = (instanceRenderer.packetCount() + 1) * sizeof(InstanceData);
+    }
+    
+    bool clustered = lights.size() != 1;
+    size_t lightBytes = 0;
+    if (clustered) {
+        ProfileScope scope(profiler, "lights");
+        lightBytes = lightClusters.build(lights, view, projection) + LIGHT_TEXEL_WORDS * sizeof(uint32_t);
+        state.stats.lights = lights.size();
+        state.stats.lightReferences = lightClusters.references();
+    }
+    
+    // The camera, instance and light data go through this frame's ring
+    // segment; a replaced buffer invalidates every binding that pointed at
+    // the old one
+    if (frameRing.beginFrame(sizeof(CameraBlock) + uniformAlignment + instanceBytes + lightBytes)) {
+        instanceRenderer.invalidateBindings();
+        lightClusters.invalidateBuffer();
+        state.invalidate();
+    }
+    size_t cameraOffset = 0;
+    CameraBlock* camera = static_cast<CameraBlock*>(frameRing.allocate(sizeof(CameraBlock), uniformAlignment,
+                                                                       cameraOffset));
+    if (!camera) {
+        frameRing.flush();
+        frameRing.endFrame();
+        return;
+    }
+    camera->view = view;
+    camera->projection = projection;
+    glBindBufferRange(GL_UNIFORM_BUFFER, CAMERA_BLOCK_BINDING, frameRing.buffer, cameraOffset, sizeof(CameraBlock));
+    state.issued(1);
+    
+    // Without room for the clusters the frame falls back to the first light
+    if (clustered && !lightClusters.write(frameRing, state)) {
+        clustered = false;
+    }
+    if (!clustered && !lights.empty() && std::memcmp(&lights[0], &appliedLight, sizeof(PointLight)) != 0) {
+        appliedLight = lights[0];
+        state.useProgram(shaderProgram.id);
+        glUniform3fv(shaderProgram.location("lightPos"), 1, glm::value_ptr(appliedLight.position));
+        glUniform3fv(shaderProgram.location("lightColor"), 1, glm::value_ptr(appliedLight.color));
+        state.issued(2);
+    }
+    
+    bool ready = false;
+    if (gpuCulling) {
+        frameRing.flush();
+        ready = instanceRenderer.cullIndirect(instances, selectedIndex, frustum, eye, pixelsPerUnit, state, profiler);
+    } else {
+        ProfileScope scope(profiler, "write");
+        ready = instanceRenderer.writeInstances(instances, selectedIndex, frameRing, jobs);
+        frameRing.flush();
+    }
+    if (!ready) {
+        frameRing.endFrame();
+        return;
+    }
+    
+    // Both passes replay what was culled above
+    auto drawPass = [&](DrawPass pass, bool depthPrepassed) {
+        if (gpuCulling) {
+            instanceRenderer.drawIndirect(instances, selectedIndex, wireframeMode, pass, depthPrepassed, state);
+        } else {
+            instanceRenderer.drawPackets(instances, pass, depthPrepassed, state);
+        }
+    };
+    if (depthPrepass) {
+        ProfileScope scope(profiler, "depth");
+        profiler.beginGpu("depth");
+        drawPass(DrawPass::Depth, false);
+        profiler.endGpu();
+    }
+    
+    ProfileScope scope(profiler, "draw");
+    profiler.beginGpu("draw");
+    if (overdrawView) {
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        state.issued(2);
+    }
+    if (measureOverdraw) {
+        overdraw.begin();
+    }
+    drawPass(overdrawView ? DrawPass::Overdraw : clustered ? DrawPass::ClusteredColor : DrawPass::Color, depthPrepass);
+    if (measureOverdraw) {
+        overdraw.end();
+    }
+    if (overdrawView) {
+        glDisable(GL_BLEND);
+        state.issued(1);
+    }
+    profiler.endGpu();
+    frameRing.endFrame();
+}
@@ -0,0 +1,1140 @@
+// Shared code of the OBJ viewer and its benchmark: mesh streaming, instance
+// storage and culling, and the instanced renderer
+#ifndef M1_CORE_H
+#define M1_CORE_H
+
+#include "M1Loader.h"
+#include "M1Simd.h"
+
+#include <GLFW/glfw3.h>
+
+// Shader sources; the scene ones hold every permutation of the lit shader
+extern const char* sceneVertexShaderSource;
+extern const char* sceneFragmentShaderSource;
+extern const char* cullComputeSource;
+
+// GL 4.3 tokens missing from the bundled GL 4.0 GLAD loader
+#ifndef GL_COMPUTE_SHADER
+#define GL_COMPUTE_SHADER 0x91B9
+#endif
+#ifndef GL_SHADER_STORAGE_BUFFER
+#define GL_SHADER_STORAGE_BUFFER 0x90D2
+#endif
+#ifndef GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT
+#define GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT 0x00000001
+#endif
+#ifndef GL_COMMAND_BARRIER_BIT
+#define GL_COMMAND_BARRIER_BIT 0x00000040
+#endif
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+// GL 4.1 / ARB_get_program_binary and KHR_parallel_shader_compile tokens
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+// GL_NVX_gpu_memory_info and GL_ATI_meminfo, both reporting in KB
+#ifndef GL_GPU_MEMORY_CURRENT_AVAILABLE_VIDMEM_NVX
+#define GL_GPU_MEMORY_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
+#endif
+#ifndef GL_VBO_FREE_MEMORY_ATI
+#define GL_VBO_FREE_MEMORY_ATI 0x87FB
+#endif
+
+// Capability checks against the current context
+bool hasGLVersion(GLint wantedMajor, GLint wantedMinor);
+bool hasGLExtension(const char* extension);
+
+// Free video memory in bytes as reported by the driver, or -1 when it has
+// no way to tell
+long long driverFreeVideoMemory();
+
+// GL 4.2/4.3 entry points used by GPU culling, fetched at runtime since
+// GLAD was generated for GL 4.0. They stay null on older contexts.
+struct GLComputeFunctions {
+    void (APIENTRYP dispatchCompute)(GLuint groupsX, GLuint groupsY, GLuint groupsZ) = nullptr;
+    void (APIENTRYP memoryBarrier)(GLbitfield barriers) = nullptr;
+    void (APIENTRYP multiDrawElementsIndirect)(GLenum mode, GLenum type, const void* indirect,
+                                               GLsizei drawCount, GLsizei stride) = nullptr;
+    
+    bool load();
+};
+
+extern GLComputeFunctions glCompute;
+
+// GL 4.4 / ARB_buffer_storage entry point for persistently mapped buffers
+struct GLBufferStorageFunctions {
+    void (APIENTRYP bufferStorage)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags) = nullptr;
+    
+    bool load();
+};
+
+extern GLBufferStorageFunctions glStorage;
+
+// GL 4.1 / ARB_get_program_binary entry points for the shader binary cache.
+// Only loaded when the driver offers at least one binary format.
+struct GLProgramBinaryFunctions {
+    void (APIENTRYP getProgramBinary)(GLuint program, GLsizei bufferSize, GLsizei* length, GLenum* format,
+                                      void* binary) = nullptr;
+    void (APIENTRYP programBinary)(GLuint program, GLenum format, const void* binary, GLsizei length) = nullptr;
+    void (APIENTRYP programParameteri)(GLuint program, GLenum name, GLint value) = nullptr;
+    
+    bool load();
+};
+
+extern GLProgramBinaryFunctions glProgramBinaries;
+
+// KHR_parallel_shader_compile (or its ARB twin): compiles and links run on
+// driver threads and can be polled with GL_COMPLETION_STATUS_KHR
+struct GLParallelCompileFunctions {
+    void (APIENTRYP maxShaderCompilerThreads)(GLuint count) = nullptr;
+    
+    bool load();
+};
+
+extern GLParallelCompileFunctions glParallelCompile;
+
+// Frames in flight the upload stream's staging buffer is split across
+const unsigned int UPLOAD_SEGMENTS = 3;
+
+// Moves buffer data to the GPU under a per-frame byte budget. Where
+// glBufferStorage exists the data goes through a persistently mapped staging
+// buffer with one segment per frame in flight, each fenced so it is only
+// rewritten once the GPU has copied out of it; otherwise it falls back to
+// glBufferSubData. Writes go through GL_COPY_WRITE_BUFFER and leave the
+// array and element array bindings alone.
+class UploadStream {
+public:
+    void init(size_t bytesPerFrame, bool persistent);
+    void destroy();
+    void beginFrame();
+    void endFrame();
+    size_t write(GLuint buffer, size_t offset, const void* data, size_t bytes);
+    size_t remaining() const { return budget - used; }
+    size_t frameBytes() const { return used; }
+    bool persistentlyMapped() const { return mapped != nullptr; }
+    
+private:
+    size_t budget = 0;
+    size_t used = 0;
+    GLuint staging = 0;
+    unsigned char* mapped = nullptr;
+    GLsync fences[UPLOAD_SEGMENTS] = {};
+    unsigned int segment = 0;
+};
+
+// Frames in flight the per-frame ring buffer is split across
+const unsigned int RING_SEGMENTS = 3;
+
+// Bytes per frame the ring buffer starts with; it grows to fit a frame
+const size_t RING_FRAME_BYTES = 1024 * 1024;
+
+// Per-frame uniform and instance data, written by the CPU straight into
+// memory the GPU reads. Where glBufferStorage exists the buffer is
+// persistently and coherently mapped, with one segment per frame in flight
+// fenced after that frame's draws, so a segment is only rewritten once the
+// GPU is done with it. Otherwise every frame orphans the buffer with
+// glBufferData and maps the fresh storage unsynchronized, so the driver
+// never waits on last frame's draws. Uses GL_COPY_WRITE_BUFFER and leaves
+// the array and uniform buffer bindings alone.
+class RingBuffer {
+public:
+    GLuint buffer = 0;
+    
+    void init(size_t bytesPerFrame, bool persistent);
+    void destroy();
+    bool beginFrame(size_t bytes);
+    void* allocate(size_t bytes, size_t alignment, size_t& offset);
+    void flush();
+    void endFrame();
+    bool persistentlyMapped() const { return persistent; }
+    
+private:
+    size_t segmentSize = 0;
+    size_t used = 0; // Within the current frame's segment
+    unsigned char* mapped = nullptr; // Start of the buffer, while writable
+    bool persistent = false;
+    GLsync fences[RING_SEGMENTS] = {};
+    unsigned int segment = 0;
+    
+    void createStorage(size_t bytesPerFrame);
+    void destroyStorage();
+};
+
+// Unbounded multi-producer, single-consumer queue (Vyukov). push() never
+// blocks and pop() never waits, so loader threads can hand results to the
+// render thread without a lock. Only one thread may call pop().
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() : head(&stub), tail(&stub) {}
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+    
+    ~MpscQueue() {
+        T value;
+        while (pop(value)) {
+        }
+        if (tail != &stub) {
+            delete tail;
+        }
+    }
+    
+    void push(T value) {
+        Node* node = new Node();
+        node->value = std::move(value);
+        Node* previous = head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+    
+    // The node holding the popped value becomes the new sentinel
+    bool pop(T& value) {
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            return false;
+        }
+        value = std::move(next->value);
+        next->value = T();
+        if (tail != &stub) {
+            delete tail;
+        }
+        tail = next;
+        return true;
+    }
+    
+private:
+    struct Node {
+        std::atomic<Node*> next{ nullptr };
+        T value;
+    };
+    
+    Node stub;
+    std::atomic<Node*> head;
+    Node* tail;
+};
+
+// Single-producer, single-consumer triple buffer. The writer fills back()
+// and publish() swaps it with the shared middle slot; the reader's acquire()
+// swaps the middle slot into front() when it holds something newer. Neither
+// side ever waits on the other, and the reader always gets the latest
+// complete value. Slots are reused, so writers should overwrite in place.
+template <typename T>
+class TripleBuffer {
+public:
+    T& back() { return slots[backIndex]; }
+    const T& front() const { return slots[frontIndex]; }
+    
+    void publish() {
+        backIndex = middle.exchange(backIndex | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+    
+    // Returns false, keeping the current front(), when nothing new was published
+    bool acquire() {
+        if ((middle.load(std::memory_order_relaxed) & FRESH) == 0) {
+            return false;
+        }
+        frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & INDEX_MASK;
+        return true;
+    }
+    
+private:
+    static const unsigned int INDEX_MASK = 3;
+    static const unsigned int FRESH = 4;
+    
+    T slots[3];
+    unsigned int backIndex = 0;  // Writer only
+    unsigned int frontIndex = 1; // Reader only
+    std::atomic<unsigned int> middle{ 2 };
+};
+
+// Wakes a thread sleeping until there is work for it. notify() may be
+// called from any thread; requests made while nobody waits are kept, so
+// the next wait() returns at once.
+class WakeSignal {
+public:
+    void notify() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requested = true;
+        }
+        condition.notify_one();
+    }
+    
+    // Blocks until notified or until timeout seconds pass, a negative timeout
+    // waiting indefinitely. True if notified; the request is consumed.
+    bool wait(double timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (timeout < 0.0) {
+            condition.wait(lock, [this] { return requested; });
+        } else {
+            condition.wait_for(lock, std::chrono::duration<double>(timeout), [this] { return requested; });
+        }
+        bool notified = requested;
+        requested = false;
+        return notified;
+    }
+    
+private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool requested = false;
+};
+
+// Fixed pool of threads for splitting per-frame loops across cores. Each
+// thread owns a deque of jobs: it pops from the back of its own and, once
+// that runs dry, steals from the front of the others', so threads that
+// finish their ranges early take over the rest. The thread calling
+// parallelFor() works alongside the pool and returns once every range is
+// done. Only one thread may call parallelFor(), and not from inside a job.
+class JobSystem {
+public:
+    JobSystem() {}
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+    ~JobSystem() { stop(); }
+    
+    void start(unsigned int workerCount);
+    void stop();
+    
+    // Workers plus the calling thread; jobs are told which one runs them
+    unsigned int threadCount() const { return threads; }
+    
+    // Calls function(begin, end, thread) over [0, count) in ranges of at
+    // least minRange, with thread below threadCount(). Loops too small to
+    // split run inline on the calling thread.
+    template <typename Function>
+    void parallelFor(size_t count, size_t minRange, Function function) {
+        if (count == 0) {
+            return;
+        }
+        if (threads == 1 || count <= minRange) {
+            function(size_t(0), count, callerThread());
+            return;
+        }
+        auto trampoline = [](void* context, size_t begin, size_t end, unsigned int thread) {
+            (*static_cast<Function*>(context))(begin, end, thread);
+        };
+        run(count, minRange, trampoline, &function);
+    }
+    
+private:
+    // Ranges a loop is split into per thread, so uneven ranges still balance
+    static const unsigned int JOBS_PER_THREAD = 4;
+    
+    struct Job {
+        void (*function)(void* context, size_t begin, size_t end, unsigned int thread);
+        void* context;
+        size_t begin;
+        size_t end;
+    };
+    
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+    
+    std::vector<std::thread> workers;
+    unsigned int threads = 1; // Set before any worker starts, so they never read workers
+    std::unique_ptr<Queue[]> queues; // One per thread, the caller's last
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    uint64_t generation = 0; // Bumped for every loop handed to the workers
+    bool stopping = false;
+    std::atomic<size_t> remaining{ 0 };
+    
+    unsigned int callerThread() const { return threads - 1; }
+    void run(size_t count, size_t minRange, void (*function)(void*, size_t, size_t, unsigned int), void* context);
+    bool runOne(unsigned int thread);
+    void work(unsigned int thread);
+};
+
+// Parses and optimizes meshes on a pool of worker threads, then streams the
+// finished buffers to the GPU from the render thread under the upload
+// stream's budget, so the window stays responsive while assets load.
+// Without workers, enqueue() prepares meshes on the calling thread.
+class MeshLoader {
+public:
+    MeshLoader() {}
+    MeshLoader(const MeshLoader&) = delete;
+    MeshLoader& operator=(const MeshLoader&) = delete;
+    ~MeshLoader() { stop(); }
+    
+    void start(unsigned int threadCount);
+    void stop();
+    void enqueue(std::shared_ptr<Mesh> mesh);
+    size_t update(UploadStream& stream, std::vector<const Mesh*>& finished);
+    size_t pending() const { return inFlight.load(std::memory_order_relaxed); }
+    size_t threadCount() const { return workers.size(); }
+    
+private:
+    std::vector<std::thread> workers;
+    std::mutex jobMutex;
+    std::condition_variable jobAvailable;
+    std::deque<std::shared_ptr<Mesh>> jobs;
+    bool stopping = false;
+    
+    // Prepared on a worker, waiting for the render thread
+    MpscQueue<std::shared_ptr<Mesh>> prepared;
+    
+    // Render thread only: meshes whose upload is under way, oldest first
+    std::deque<std::shared_ptr<Mesh>> uploads;
+    
+    // Queued, preparing or uploading
+    std::atomic<size_t> inFlight{ 0 };
+    
+    void work();
+    static void prepareMesh(Mesh& mesh);
+};
+
+// Path-keyed cache of loaded meshes, so each file is parsed and uploaded once
+// no matter how many instances use it. Meshes stay resident until
+// releaseUnused() or clear(); both must run while the GL context is current.
+class MeshCache {
+public:
+    std::shared_ptr<Mesh> load(const std::string& path, const MeshLoadOptions& options = MeshLoadOptions());
+    std::shared_ptr<Mesh> loadAsync(const std::string& path, MeshLoader& loader,
+                                    const MeshLoadOptions& options = MeshLoadOptions());
+    void releaseUnused();
+    void clear() { meshes.clear(); }
+    size_t size() const { return meshes.size(); }
+    
+    size_t hits = 0;
+    size_t misses = 0;
+    
+private:
+    std::unordered_map<std::string, std::shared_ptr<Mesh>> meshes;
+    
+    static std::string key(const std::string& path, const MeshLoadOptions& options);
+};
+
+// View frustum as six inward-facing planes (xyz = unit normal, w = distance)
+struct Frustum {
+    glm::vec4 planes[6];
+    
+    static Frustum fromMatrix(const glm::mat4& viewProjection);
+};
+
+// Scene instances as a contiguous structure of arrays. Transform setters mark
+// an instance dirty, and updateTransforms() rebuilds the cached model and
+// normal matrices of every dirty instance in one pass. The arrays are public
+// for reading; write transforms through the setters.
+class InstanceArray {
+public:
+    std::vector<std::shared_ptr<Mesh>> meshes;
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> rotations; // Euler angles in degrees, applied X, then Y, then Z
+    std::vector<glm::vec3> scales;
+    std::vector<glm::mat4> models;
+    std::vector<glm::mat3> normalMatrices;
+    
+    // World-space bounding spheres, split per component for the culling pass
+    std::vector<float> sphereX, sphereY, sphereZ, sphereRadius;
+    
+    // 1 once the instance's mesh is on the GPU; others are never visible
+    std::vector<uint8_t> resident;
+    
+    // Result of the last cull(): 1 if the instance intersects the frustum
+    std::vector<uint8_t> visible;
+    
+    // Result of the last selectLods(): LOD to draw each visible instance with
+    std::vector<uint8_t> lodLevels;
+    
+    // Dense id of each instance's mesh, numbered in order of first use, so
+    // draw packets can sort by mesh with a small key
+    std::vector<uint32_t> meshIds;
+    
+    // Bumped whenever transforms or membership change, so copies of the
+    // instance data on the GPU know when to refresh
+    uint64_t revision = 0;
+    
+    // Changes whenever instances are added or cleared, but not on transform
+    // edits. Values are unique across arrays, so a copy keeps its source's
+    // until either side changes membership.
+    uint64_t membership = 0;
+    
+    size_t size() const { return meshes.size(); }
+    bool empty() const { return meshes.empty(); }
+    void reserve(size_t count);
+    void clear();
+    size_t add(std::shared_ptr<Mesh> mesh, const glm::vec3& position = glm::vec3(0.0f),
+               const glm::vec3& rotation = glm::vec3(0.0f), const glm::vec3& scale = glm::vec3(1.0f));
+    bool append(const std::vector<std::shared_ptr<Mesh>>& meshTable, const uint32_t* meshIndices,
+                const float* positionData, const float* rotationData, const float* scaleData, size_t count);
+    
+    void setPosition(size_t index, const glm::vec3& position);
+    void setRotation(size_t index, const glm::vec3& rotation);
+    void setScale(size_t index, const glm::vec3& scale);
+    void meshResident(const Mesh* mesh);
+    void meshEvicted(const Mesh* mesh);
+    
+    size_t updateTransforms(JobSystem* jobs = nullptr);
+    size_t cull(const Frustum& frustum);
+    size_t cull(const Frustum& frustum, size_t begin, size_t end);
+    void selectLods(const glm::vec3& eye, float pixelsPerUnit);
+    void selectLods(const glm::vec3& eye, float pixelsPerUnit, size_t begin, size_t end);
+    
+private:
+    // Mesh-space bounding sphere (center, radius) of each instance's mesh
+    std::vector<glm::vec4> localSpheres;
+    std::unordered_map<const Mesh*, uint32_t> meshIdOf;
+    
+    // Smallest range of dirty instances worth handing to another thread
+    static const size_t TRANSFORM_JOB_INSTANCES = 1024;
+    std::vector<uint8_t> dirty;
+    std::vector<uint32_t> dirtyList;
+    
+    void markDirty(size_t index);
+};
+
+// Meshes must stay out of view this many frames before they may be evicted,
+// so ones at the edge of the frustum don't reload every other frame
+const uint64_t RESIDENCY_IDLE_FRAMES = 60;
+
+// Tallies the GPU memory the instances' meshes hold and, with a budget,
+// keeps it under that by evicting the meshes used least recently. A mesh
+// counts as used on every frame one of its instances is in the frustum,
+// resident or not, which update() tests on the CPU whichever path draws.
+// Evicting frees a mesh's buffers and stops its instances being drawn;
+// once one of them is back in view the mesh is queued on the loader again,
+// which reads it from its mesh cache file. Only meshes using the mesh cache
+// are evicted, and only out of view, so a view needing more memory than
+// the budget stays over it. Render thread only.
+class MeshResidency {
+public:
+    size_t budgetBytes = 0; // 0 only keeps the tally
+    
+    // As of the last update()
+    size_t residentBytes = 0;
+    size_t peakBytes = 0;
+    size_t residentMeshes = 0;
+    size_t evictions = 0;
+    size_t reloads = 0;
+    
+    // Call once per frame with fresh transforms, before drawing. Returns the
+    // number of meshes evicted; cached bindings to their VAOs are then stale.
+    size_t update(InstanceArray& instances, const Frustum& frustum, MeshLoader& loader);
+    size_t meshCount() const { return entries.size(); }
+    
+private:
+    struct Entry {
+        std::shared_ptr<Mesh> mesh;
+        uint64_t lastUsed = 0;
+        bool evicted = false;   // Released here and not resident since
+        bool reloading = false; // Queued on the loader after eviction
+    };
+    
+    std::vector<Entry> entries; // Indexed by InstanceArray::meshIds
+    uint64_t trackedMembership = 0;
+    uint64_t frame = 0;
+    std::vector<uint8_t> everyInstance, inView;
+    std::vector<size_t> candidates;
+    
+    void track(const InstanceArray& instances);
+};
+
+// A scene file lists the meshes a scene uses, then each instance's mesh and
+// transform. The binary form is laid out to be mapped and copied from in one
+// go: a header, the mesh paths, then per-instance arrays of mesh indices
+// (uint32) and positions, rotations and scales (3 floats each), each 16-byte
+// aligned. The text form is for writing scenes by hand, one directive per
+// line, '#' starting a comment:
+//   mesh <name> <path>                               path relative to the file
+//   instance <name> <px py pz> [<rx ry rz> [<sx sy sz>]]
+// The two are told apart by the binary form's magic. Every mesh path goes
+// through the cache once, however many instances use it.
+bool loadSceneFile(const std::string& path, InstanceArray& instances, MeshCache& cache, MeshLoader& loader);
+
+// Writes instances in the binary form, with mesh paths relative to the file
+bool saveSceneFile(const std::string& path, const InstanceArray& instances);
+
+// Linked program whose active uniform locations are looked up once at link
+// time instead of by string every frame
+class ShaderProgram {
+public:
+    GLuint id = 0;
+    
+    bool adopt(GLuint linkedProgram);
+    void destroy();
+    GLint location(const std::string& name) const;
+    void bindUniformBlock(const char* name, GLuint binding) const;
+    
+private:
+    std::unordered_map<std::string, GLint> uniforms;
+    
+    bool collectUniforms();
+};
+
+// One stage of a managed program: its type and the name of its source
+struct ShaderStage {
+    GLenum type;
+    std::string source;
+};
+
+// Builds programs from named sources, each permutation picked by #defines
+// inserted after the #version line. Linked programs are saved with
+// glGetProgramBinary under a hash of their final sources and the driver
+// strings, and later runs load them back instead of compiling. Everything
+// requested before finish() compiles at once, on the driver's own threads
+// where KHR_parallel_shader_compile exists.
+//
+// With a source directory, "<directory>/<name>" replaces the embedded
+// source of that name, which is written there first when missing, and
+// poll() rebuilds the programs whose files changed. A rebuild that fails
+// to compile keeps the old program.
+class ShaderManager {
+public:
+    std::string sourceDirectory;                 // Empty for only the embedded sources
+    std::string cacheDirectory = ".shadercache"; // Empty disables the binary cache
+    
+    // Since init()
+    unsigned int programsBuilt = 0;
+    unsigned int cacheHits = 0;
+    double buildSeconds = 0.0; // Spent in request() through finish()
+    
+    void init();
+    void destroy();
+    void addSource(const std::string& name, const char* embedded);
+    
+    // Starts building target; it is only replaced once the build links
+    void request(ShaderProgram& target, const std::vector<ShaderStage>& stages,
+                 const std::vector<std::string>& defines);
+    
+    // Waits for every requested build. False if any failed; those that never
+    // linked are forgotten.
+    bool finish();
+    
+    // Rereads changed source files and swaps in the rebuilds that finished,
+    // without waiting. True if any program was replaced.
+    bool poll();
+    
+    // Seconds between checks of the source files
+    static constexpr double SOURCE_POLL_SECONDS = 0.5;
+    
+    bool binaryCache() const { return binaries && !cacheDirectory.empty(); }
+    bool parallelCompile() const { return parallel; }
+    
+private:
+    enum class BuildStatus { Pending, Linked, Failed };
+    
+    struct Source {
+        const char* embedded;
+        std::string text;
+        std::filesystem::file_time_type stamp; // Of the file it was read from
+    };
+    
+    struct Build {
+        ShaderProgram* target;
+        std::vector<ShaderStage> stages;
+        std::vector<std::string> defines;
+        GLuint program = 0; // Building while non-zero
+        std::vector<GLuint> shaders;
+        uint64_t hash = 0;
+        bool fromCache = false;
+    };
+    
+    std::unordered_map<std::string, Source> sources;
+    std::vector<Build> builds;
+    std::string driver;
+    bool binaries = false;
+    bool parallel = false;
+    bool batching = false; // Builds requested since the last finish()
+    std::chrono::steady_clock::time_point batchStart;
+    std::chrono::steady_clock::time_point lastScan;
+    
+    void readSource(const std::string& name, Source& source);
+    void start(Build& build);
+    BuildStatus complete(Build& build, bool wait);
+    void abandon(Build& build);
+    std::string describe(const Build& build) const;
+    std::string binaryPath(uint64_t hash) const;
+    GLuint loadBinary(uint64_t hash);
+    void saveBinary(GLuint program, uint64_t hash);
+};
+
+// GL calls issued during one frame
+struct FrameStats {
+    unsigned int glCalls = 0;
+    unsigned int skippedCalls = 0; // Redundant state changes filtered out
+    unsigned int drawCalls = 0;
+    size_t triangles = 0;
+    size_t lights = 0;
+    size_t lightReferences = 0; // Light entries over all clusters
+    size_t visibleInstances = 0;
+    size_t culledInstances = 0;
+    bool gpuCulled = false; // Visibility stayed on the GPU, counts unknown
+    size_t uploadedBytes = 0; // Streamed by the mesh loader
+};
+
+// Shadows the GL state the render loop changes so redundant binds and mode
+// changes are skipped, and counts every call issued through it. Code that
+// changes this state directly must call invalidate() afterwards.
+class RenderState {
+public:
+    FrameStats stats;
+    
+    void beginFrame() { stats = FrameStats(); }
+    void invalidate();
+    void issued(unsigned int calls = 1) { stats.glCalls += calls; }
+    
+    void useProgram(GLuint program);
+    void bindVertexArray(GLuint vertexArray);
+    void bindArrayBuffer(GLuint buffer);
+    void polygonMode(GLenum mode);
+    void depthFunc(GLenum func);
+    void depthMask(bool write);
+    void colorMask(bool write);
+    void drawElementsInstanced(GLsizei indexCount, GLenum indexType, GLsizei instanceCount, GLuint firstIndex = 0);
+    void drawElementsIndirect(GLenum indexType, size_t commandOffset, GLsizei drawCount);
+    
+private:
+    // GL_NONE marks state that is unknown, so binding 0 is never skipped
+    GLuint currentProgram = GL_NONE;
+    GLuint currentVertexArray = GL_NONE;
+    GLuint currentArrayBuffer = GL_NONE;
+    GLenum currentPolygonMode = GL_NONE;
+    GLenum currentDepthFunc = GL_NONE;
+    int currentDepthMask = -1; // -1 while unknown, else 0 or 1
+    int currentColorMask = -1;
+};
+
+// Frames of history behind the profiler's rolling averages and percentiles
+const unsigned int PROFILER_HISTORY = 240;
+
+// GPU timer results are read back this many frames after they were issued,
+// by which point they are normally available, so reading them never stalls
+const unsigned int PROFILER_FRAMES_IN_FLIGHT = 3;
+
+// Most events a Chrome trace keeps; the oldest are overwritten first
+const size_t PROFILER_TRACE_EVENTS = 1 << 18;
+
+// Per-frame CPU and GPU stage timings. CPU stages are timed with scopes,
+// which may nest; GPU stages with GL_TIME_ELAPSED queries, which may not.
+// Stage names must be string literals, since only the pointer is kept.
+class FrameProfiler {
+public:
+    void init(bool recordTrace);
+    void destroy();
+    void beginFrame();
+    
+    void beginCpu(const char* name);
+    void endCpu();
+    void beginGpu(const char* name);
+    void endGpu();
+    
+    std::string summary() const;
+    bool writeTrace(const std::string& path) const;
+    
+private:
+    // Rolling window over the last PROFILER_HISTORY samples
+    struct History {
+        double samples[PROFILER_HISTORY] = {};
+        size_t head = 0;
+        size_t count = 0;
+        double sum = 0.0;
+        
+        void push(double milliseconds);
+        double average() const { return count > 0 ? sum / count : 0.0; }
+    };
+    
+    struct Stage {
+        const char* name;
+        bool gpu;
+        double frameMilliseconds = 0.0; // Summed over this frame's scopes
+        History history;
+    };
+    
+    // Queries issued during one frame, reused PROFILER_FRAMES_IN_FLIGHT frames later
+    struct GpuFrame {
+        std::vector<GLuint> queries;
+        std::vector<size_t> stages;
+        std::vector<double> submitted; // CPU time of each beginGpu(), for the trace
+        size_t used = 0;
+    };
+    
+    struct TraceEvent {
+        const char* name;
+        bool gpu;
+        double start; // Microseconds since init()
+        double duration;
+    };
+    
+    std::vector<Stage> stages;
+    std::vector<std::pair<size_t, double>> cpuScopes; // Open scopes: stage, start
+    GpuFrame gpuFrames[PROFILER_FRAMES_IN_FLIGHT];
+    bool gpuScopeOpen = false;
+    size_t droppedGpuFrames = 0;
+    
+    History frameTimes;
+    uint64_t frameCount = 0;
+    double frameStart = 0.0;
+    std::chrono::steady_clock::time_point epoch;
+    
+    bool tracing = false;
+    std::vector<TraceEvent> trace;
+    size_t traceHead = 0;
+    
+    double now() const;
+    size_t stageIndex(const char* name, bool gpu);
+    void collectGpuFrame(GpuFrame& frame);
+    void record(const char* name, bool gpu, double start, double duration);
+};
+
+// Counts the samples that pass the depth test during the color pass with
+// GL_SAMPLES_PASSED queries, which is how many fragments the lit shader
+// runs for. Results are read back PROFILER_FRAMES_IN_FLIGHT frames later,
+// like the GPU timers, and dropped if not ready. Ratios are per viewport
+// pixel, so uncovered background pulls them below one.
+class OverdrawCounter {
+public:
+    void init();
+    void destroy();
+    void begin();
+    void end();
+    void reset();
+    
+    double latest() const { return latestRatio; }
+    double average() const { return count > 0 ? sum / count : 0.0; }
+    
+private:
+    GLuint queries[PROFILER_FRAMES_IN_FLIGHT] = {};
+    double pixels[PROFILER_FRAMES_IN_FLIGHT] = {};
+    bool pending[PROFILER_FRAMES_IN_FLIGHT] = {};
+    unsigned int slot = 0;
+    double latestRatio = 0.0;
+    double sum = 0.0;
+    size_t count = 0;
+    
+    void collect(unsigned int querySlot);
+};
+
+// Times a CPU stage for the rest of the enclosing block
+class ProfileScope {
+public:
+    ProfileScope(FrameProfiler& frameProfiler, const char* name) : profiler(frameProfiler) { profiler.beginCpu(name); }
+    ~ProfileScope() { profiler.endCpu(); }
+    
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+    
+private:
+    FrameProfiler& profiler;
+};
+
+// Per-instance data streamed to the GPU each frame
+struct InstanceData {
+    glm::mat4 model;
+    glm::mat3 normalMatrix;
+    GLfloat selected;
+};
+
+// The std140 Camera uniform block every program shares, written once per
+// frame into the ring buffer instead of set as uniforms on each program
+struct CameraBlock {
+    glm::mat4 view;
+    glm::mat4 projection;
+};
+
+const GLuint CAMERA_BLOCK_BINDING = 0;
+
+// A point light in world space, laid out as the two texels the clustered
+// shader reads it from. Radius 0 means no falloff, lighting everything.
+struct PointLight {
+    glm::vec3 position;
+    float radius;
+    glm::vec3 color;
+    float padding;
+};
+
+// Clusters the view frustum is split into: screen tiles across and down,
+// times slices spaced exponentially in depth between the near and far planes
+const unsigned int CLUSTER_TILES_X = 16;
+const unsigned int CLUSTER_TILES_Y = 9;
+const unsigned int CLUSTER_SLICES = 24;
+const unsigned int CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+
+// Texture unit the clustered shader reads its light data from
+const GLuint LIGHT_TEXTURE_UNIT = 0;
+
+// Bins point lights into view-space clusters on the CPU each frame, for the
+// clustered forward shader. build() fills three tables, back to back as
+// RGBA32UI texels: the lights, two texels each; per cluster the first
+// entry and count of its lights in the index table; and the index table,
+// four light indices per texel. write() copies them into the frame's ring
+// buffer, which a buffer texture views whole, so the shader is told where
+// in it each table starts; this works on GL 3.3 as well.
+class LightClusters {
+public:
+    void init(const ShaderProgram& program);
+    void destroy();
+    size_t build(const std::vector<PointLight>& lights, const glm::mat4& view, const glm::mat4& projection);
+    bool write(RingBuffer& ring, RenderState& state);
+    size_t references() const { return indices.size(); }
+    void invalidateBuffer() { attachedBuffer = 0; }
+    
+private:
+    // Inclusive cluster bounds a light touches; culled when empty
+    struct LightRange {
+        unsigned int tileX[2];
+        unsigned int tileY[2];
+        unsigned int slice[2];
+        bool visible;
+    };
+    
+    GLuint texture = 0;
+    GLuint attachedBuffer = 0; // Buffer the texture currently views
+    GLint maxTexels = 0;
+    GLuint program = 0;
+    GLint lightTablesLocation = -1;
+    GLint sliceScaleBiasLocation = -1;
+    GLint ambientColorLocation = -1;
+    
+    std::vector<uint32_t> texels; // Four words per RGBA32UI texel
+    std::vector<uint32_t> clusterCounts;
+    std::vector<uint32_t> clusterFirst;
+    std::vector<uint32_t> indices;
+    std::vector<LightRange> lightRanges;
+    size_t lightCount = 0;
+    glm::vec2 sliceScaleBias = glm::vec2(0.0f);
+    glm::vec3 ambientColor = glm::vec3(0.0f);
+};
+
+// Per-instance input of the GPU culling pass, laid out for std430
+struct CullInstance {
+    glm::mat4 model;
+    glm::vec4 normalMatrix[3];
+    glm::vec4 sphere;
+    GLuint batch;
+    GLuint index; // Position in the InstanceArray
+    GLuint padding[2];
+};
+
+// One visible instance, recorded by the CPU culling jobs. Packets sort by
+// key, then front to back, then instance, so the order is the same however
+// the jobs were split.
+struct DrawPacket {
+    uint64_t key;
+    uint32_t instance;
+    uint32_t depth; // See drawPacketDepth()
+    
+    bool operator<(const DrawPacket& other) const {
+        if (key != other.key) {
+            return key < other.key;
+        }
+        return depth != other.depth ? depth < other.depth : instance < other.instance;
+    }
+};
+
+// Packet sort key, most significant first: mesh id, LOD, then polygon mode,
+// with fill before line. Packets with equal keys are drawn by the same
+// instanced call. There is no shader field: every pass draws all packets
+// with the one program it binds up front.
+inline uint64_t drawPacketKey(uint32_t meshId, uint32_t lod, bool wireframe) {
+    return (static_cast<uint64_t>(meshId) << 24) | (static_cast<uint64_t>(lod) << 16) | (wireframe ? 1 : 0);
+}
+
+// Bits of a non-negative float distance, which order like the float itself
+inline uint32_t drawPacketDepth(float distance) {
+    float clamped = distance > 0.0f ? distance : 0.0f;
+    uint32_t bits;
+    std::memcpy(&bits, &clamped, sizeof(bits));
+    return bits;
+}
+
+inline uint32_t drawPacketLod(uint64_t key) { return static_cast<uint32_t>(key >> 16) & 0xFF; }
+inline bool drawPacketWireframe(uint64_t key) { return (key & 1) != 0; }
+
+// What a pass draws the instances with: the single-light lit shader, depth
+// only for the pre-pass, the overdraw view's constant additive color, or
+// the clustered lit shader for many lights
+enum class DrawPass { Color, Depth, Overdraw, ClusteredColor };
+
+const unsigned int DRAW_PASS_COUNT = 4;
+
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// Draws instances grouped by mesh, one glDrawElementsInstanced per mesh.
+// GL 3.3 has no base instance, so the instance attribute pointers are
+// re-pointed at each batch's range of the shared instance buffer.
+//
+// On the CPU path recordPackets() culls, picks LODs and writes a draw
+// packet per visible instance into per-thread buffers, split across the
+// job system. sortPackets() merges those in key order and orders the runs
+// of equal keys front to back, writeInstances() fills their instance data
+// straight into the frame's ring buffer, again on the jobs, and
+// drawPackets() submits each run as one draw; only it touches GL.
+//
+// On GL 4.3 cullIndirect() moves culling to a compute shader instead: the
+// instance data stays resident on the GPU, and drawIndirect() submits each
+// mesh with one glMultiDrawElementsIndirect whose instance counts the
+// shader wrote.
+//
+// Both draw calls take a pass, so the depth pre-pass and the color pass
+// replay the same packets or commands. The selected object's wireframe is
+// left out of the pre-pass, since its lines don't cover its triangles.
+class InstanceRenderer {
+public:
+    void init(const ShaderProgram& colorProgram, const ShaderProgram& depthProgram,
+              const ShaderProgram& overdrawProgram, const ShaderProgram& clusteredProgram);
+    bool initGpuCulling(ShaderManager& shaders);
+    void destroy();
+    size_t recordPackets(InstanceArray& instances, const Frustum& frustum, const glm::vec3& eye,
+                         float pixelsPerUnit, int selectedIndex, bool wireframeMode, JobSystem& jobs);
+    void sortPackets();
+    size_t packetCount() const { return packets.size(); }
+    bool writeInstances(const InstanceArray& instances, int selectedIndex, RingBuffer& ring, JobSystem& jobs);
+    void drawPackets(const InstanceArray& instances, DrawPass pass, bool depthPrepassed, RenderState& state);
+    void invalidateBindings() { boundRange.clear(); }
+    bool cullIndirect(const InstanceArray& instances, int selectedIndex, const Frustum& frustum,
+                      const glm::vec3& eye, float pixelsPerUnit, RenderState& state, FrameProfiler& profiler);
+    void drawIndirect(const InstanceArray& instances, int selectedIndex, bool wireframeMode, DrawPass pass,
+                      bool depthPrepassed, RenderState& state);
+    
+private:
+    struct Batch {
+        const Mesh* mesh;
+        GLsizei first;
+        GLsizei count;
+    };
+    
+    // Packets [first, first + count) share a key; depth is the nearest one's
+    struct DrawRun {
+        size_t first;
+        size_t count;
+        uint32_t depth;
+    };
+    
+    // A pass's program and its mesh decoding uniforms
+    struct PassProgram {
+        GLuint id = 0;
+        GLint positionScaleLocation = -1;
+        GLint positionOffsetLocation = -1;
+    };
+    
+    // Indirect commands per mesh: one per LOD, then the selected instance
+    static const unsigned int COMMANDS_PER_MESH = MAX_LODS + 1;
+    
+    // Smallest range of instances worth handing to another thread
+    static const size_t RECORD_JOB_INSTANCES = 1024;
+    
+    PassProgram passPrograms[DRAW_PASS_COUNT];
+    
+    // Instance buffer and range each mesh's VAO currently points at, so
+    // attribute pointers are only respecified when a batch moves
+    std::unordered_map<GLuint, std::pair<GLuint, GLsizei>> boundRange;
+    std::vector<std::vector<DrawPacket>> threadPackets; // Written by the jobs, one per thread
+    std::vector<DrawPacket> packets;                    // Merged and sorted for submission
+    std::vector<DrawRun> runs;                          // Runs of packets, front to back
+    GLuint packetBuffer = 0;                            // Ring buffer holding this frame's instance data
+    GLsizei packetSlot = 0;                             // Its first instance slot there
+    std::vector<Batch> batches;
+    std::vector<size_t> instanceBatch;
+    std::unordered_map<const Mesh*, size_t> batchOfMesh;
+    
+    // GPU culling resources
+    ShaderProgram cullProgram;
+    GLuint cullInstanceBuffer = 0;
+    GLuint commandBuffer = 0;
+    GLuint visibleBuffer = 0;
+    GLuint lodErrorBuffer = 0;
+    uint64_t uploadedRevision = 0;
+    size_t uploadedCount = 0;
+    GLint planesLocation = -1;
+    GLint instanceCountLocation = -1;
+    GLint selectedIndexLocation = -1;
+    GLint eyeLocation = -1;
+    GLint pixelsPerUnitLocation = -1;
+    GLint lodPixelErrorLocation = -1;
+    std::vector<CullInstance> cullStaging;
+    std::vector<glm::vec4> lodErrorStaging;
+    std::vector<DrawElementsIndirectCommand> commands;
+    
+    GLsizei groupBatches(const InstanceArray& instances);
+    void bindInstances(const Mesh& mesh, GLuint buffer, GLsizei first, RenderState& state);
+    void findCullUniforms();
+    void setPassState(DrawPass pass, bool depthPrepassed, bool wireframe, RenderState& state);
+    const PassProgram& usePass(DrawPass pass, RenderState& state);
+    void uploadCullInstances(const InstanceArray& instances);
+};
+
+// Everything needed to draw an InstanceArray: the lit shader, the instanced
+// renderer with GPU culling when available, the state tracker and the
+// profiler. Shared by the viewer and the benchmark so both draw identically.
+//
+// With depthPrepass the visible instances are first drawn depth only, and
+// the lit pass then shades just the fragments whose depth matches, so
+// hidden surfaces cost no lighting. overdrawView swaps the lit shader for
+// an additive heat map of shaded layers; measureOverdraw counts them.
+//
+// A single light is drawn with the plain lit shader; with more, lights are
+// binned into clusters and each fragment only loops over its cluster's.
+// The first light also sets the ambient color.
+//
+// Every program comes from shaders, whose directories may be set before
+// init(); programs rebuilt by hot reload are picked up at the next draw().
+class SceneRenderer {
+public:
+    ShaderManager shaders;
+    ShaderProgram shaderProgram;
+    ShaderProgram depthProgram;
+    ShaderProgram overdrawProgram;
+    ShaderProgram clusteredProgram;
+    std::vector<PointLight> lights;
+    LightClusters lightClusters;
+    InstanceRenderer instanceRenderer;
+    RenderState state;
+    FrameProfiler profiler;
+    OverdrawCounter overdraw;
+    JobSystem jobs;
+    RingBuffer frameRing;
+    bool gpuCulling = false;
+    bool depthPrepass = false;
+    bool overdrawView = false;
+    bool measureOverdraw = false;
+    
+    // jobThreads extra threads share the CPU culling and transform updates
+    bool init(bool allowGpuCulling, bool recordTrace, unsigned int jobThreads);
+    void destroy();
+    
+    // Clears the framebuffer, then culls and draws the instances
+    void draw(InstanceArray& instances, int selectedIndex, bool wireframeMode, const glm::mat4& view,
+              const glm::mat4& projection, const glm::vec3& eye, float pixelsPerUnit);
+    
+    // Forgets every cached VAO binding, after mesh buffers were released
+    void invalidateMeshes() {
+        state.invalidate();
+        instanceRenderer.invalidateBindings();
+    }
+    
+private:
+    size_t uniformAlignment = 256;
+    PointLight appliedLight = {}; // Last light given to the single-light shader
+    
+    void bindPrograms();
+};
+
+// The viewer's light at (5, 5, 5), then count - 1 colored lights of the
+// given radius scattered just in front of a grid of half width halfWidth
+// on the z = 0 plane, the same for every run
+std::vector<PointLight> scatterLights(size_t count, float halfWidth, float radius);
+
+#endif // M1_CORE_H
@@ -0,0 +1,1500 @@
+#include "M1Loader.h"
+
+#ifdef M1_COUNT_ALLOCATIONS
+// Allocation counter hook: every global operator new bumps a per-thread
+// count, so a code path can be checked for general-purpose heap allocations
+// by comparing heapAllocationCount() before and after it. The array and
+// nothrow forms forward here by default.
+static thread_local uint64_t heapAllocations = 0;
+
+void* operator new(std::size_t size) {
+    heapAllocations++;
+    if (void* memory = std::malloc(size != 0 ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+#endif
+
+uint64_t heapAllocationCount() {
+#ifdef M1_COUNT_ALLOCATIONS
+    return heapAllocations;
+#else
+    return 0;
+#endif
+}
+
+// Fast OBJ tokenizer helpers. They walk the file buffer in place and never
+// allocate, returning the position just past what they consumed.
+static inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* skipBlanks(const char* p, const char* end) {
+    while (p < end && isBlank(*p)) {
+        p++;
+    }
+    return p;
+}
+
+static inline const char* skipLine(const char* p, const char* end) {
+    const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+    return nl ? nl + 1 : end;
+}
+
+static inline const char* parseFloat(const char* p, const char* end, float& value) {
+    p = skipBlanks(p, end);
+#if defined(__cpp_lib_to_chars)
+    // from_chars does not accept a leading '+'
+    if (p < end && *p == '+') {
+        p++;
+    }
+    std::from_chars_result result = std::from_chars(p, end, value);
+    return result.ec == std::errc() ? result.ptr : p;
+#else
+    // The buffer is null-terminated, so strtof cannot run past the end
+    char* next = nullptr;
+    value = std::strtof(p, &next);
+    return next;
+#endif
+}
+
+static inline const char* parseIndex(const char* p, const char* end, long& value) {
+    if (p < end && *p == '+') {
+        p++;
+    }
+    std::from_chars_result result = std::from_chars(p, end, value);
+    if (result.ec != std::errc()) {
+        value = 0;
+    }
+    return result.ptr;
+}
+
+// Smallest slice of an OBJ file worth handing to its own parser thread
+const size_t OBJ_MIN_CHUNK_BYTES = 1 << 20;
+
+// OBJ indices are 1-based, or negative to count back from the last element
+static inline GLuint resolveIndex(long index, size_t count) {
+    if (index > 0 && static_cast<size_t>(index) <= count) {
+        return static_cast<GLuint>(index - 1);
+    }
+    if (index < 0 && static_cast<size_t>(-index) <= count) {
+        return static_cast<GLuint>(count + index);
+    }
+    return INVALID_INDEX;
+}
+
+// Statements the OBJ loader reads; everything else is skipped
+enum class ObjLine { Other, Position, Normal, TexCoord, Face };
+
+// Classifies the line at p, which is past any leading blanks, and moves p to
+// its arguments. Both loader passes go through here, so what the counting
+// pass sees always matches what the parsing pass writes.
+static inline ObjLine classifyOBJLine(const char*& p, const char* end, bool keepTexCoords) {
+    if (p + 1 >= end) {
+        return ObjLine::Other;
+    }
+    if (p[0] == 'v' && isBlank(p[1])) {
+        p += 2;
+        return ObjLine::Position;
+    }
+    if (p[0] == 'v' && p[1] == 'n' && p + 2 < end && isBlank(p[2])) {
+        p += 3;
+        return ObjLine::Normal;
+    }
+    if (p[0] == 'v' && p[1] == 't' && p + 2 < end && isBlank(p[2]) && keepTexCoords) {
+        p += 3;
+        return ObjLine::TexCoord;
+    }
+    if (p[0] == 'f' && isBlank(p[1])) {
+        p += 2;
+        return ObjLine::Face;
+    }
+    return ObjLine::Other;
+}
+
+// Element counts of one chunk, or of all the chunks before it
+struct ObjChunkOffsets {
+    size_t positions = 0, normals = 0, uvs = 0, corners = 0;
+};
+
+// One newline-aligned slice of an OBJ file. The counting pass fills counts;
+// element counts are exact, while corners are an upper bound because a
+// malformed face emits nothing. The prefix sums of the earlier chunks' counts
+// in base make every index global at parse time, negative ones included.
+struct ObjChunk {
+    const char* begin = nullptr;
+    const char* end = nullptr;
+    ObjChunkOffsets counts;
+    ObjChunkOffsets base;
+    size_t corners = 0; // Corners written, at most counts.corners
+    size_t skippedFaces = 0;
+    uint64_t heapAllocations = 0; // By both passes, with M1_COUNT_ALLOCATIONS
+};
+
+static void countOBJChunk(ObjChunk& chunk, bool keepTexCoords) {
+    const char* p = chunk.begin;
+    const char* end = chunk.end;
+    while (p < end) {
+        p = skipBlanks(p, end);
+        switch (classifyOBJLine(p, end, keepTexCoords)) {
+        case ObjLine::Position:
+            chunk.counts.positions++;
+            break;
+        case ObjLine::Normal:
+            chunk.counts.normals++;
+            break;
+        case ObjLine::TexCoord:
+            chunk.counts.uvs++;
+            break;
+        case ObjLine::Face: {
+            // Corners are separated by blanks; an n-gon fans into n - 2 triangles
+            size_t cornerCount = 0;
+            bool inCorner = false;
+            while (p < end && *p != '\n' && *p != '#') {
+                bool blank = isBlank(*p);
+                if (!blank && !inCorner) {
+                    cornerCount++;
+                }
+                inCorner = !blank;
+                p++;
+            }
+            if (cornerCount >= 3) {
+                chunk.counts.corners += 3 * (cornerCount - 2);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        p = skipLine(p, end);
+    }
+}
+
+static void parseOBJChunk(ObjChunk& chunk, bool keepTexCoords, ObjArrays& arrays) {
+    glm::vec3* positions = arrays.positions.data() + chunk.base.positions;
+    glm::vec3* normals = arrays.normals.data() + chunk.base.normals;
+    glm::vec2* uvs = keepTexCoords ? arrays.uvs.data() + chunk.base.uvs : nullptr;
+    GLuint* vertexIndices = arrays.vertexIndices.data() + chunk.base.corners;
+    GLuint* normalIndices = arrays.normalIndices.data() + chunk.base.corners;
+    GLuint* uvIndices = keepTexCoords ? arrays.uvIndices.data() + chunk.base.corners : nullptr;
+    size_t positionCount = 0, normalCount = 0, uvCount = 0;
+    
+    const char* p = chunk.begin;
+    const char* end = chunk.end;
+    while (p < end) {
+        p = skipBlanks(p, end);
+        ObjLine line = classifyOBJLine(p, end, keepTexCoords);
+        
+        if (line == ObjLine::Position) {
+            glm::vec3 vertex(0.0f);
+            p = parseFloat(p, end, vertex.x);
+            p = parseFloat(p, end, vertex.y);
+            p = parseFloat(p, end, vertex.z);
+            positions[positionCount++] = vertex;
+        }
+        else if (line == ObjLine::Normal) {
+            glm::vec3 normal(0.0f);
+            p = parseFloat(p, end, normal.x);
+            p = parseFloat(p, end, normal.y);
+            p = parseFloat(p, end, normal.z);
+            normals[normalCount++] = normal;
+        }
+        else if (line == ObjLine::TexCoord) {
+            glm::vec2 uv(0.0f);
+            p = parseFloat(p, end, uv.x);
+            p = parseFloat(p, end, uv.y);
+            uvs[uvCount++] = uv;
+        }
+        else if (line == ObjLine::Face) {
+            // Accepts v, v/vt, v//vn and v/vt/vn corners; polygons are fan-triangulated
+            GLuint firstVertex = 0, firstNormal = 0, firstUV = 0;
+            GLuint prevVertex = 0, prevNormal = 0, prevUV = 0;
+            size_t faceStart = chunk.corners;
+            int corner = 0;
+            bool valid = true;
+            
+            auto addCorner = [&](GLuint v, GLuint n, GLuint t) {
+                vertexIndices[chunk.corners] = v;
+                normalIndices[chunk.corners] = n;
+                if (uvIndices) {
+                    uvIndices[chunk.corners] = t;
+                }
+                chunk.corners++;
+            };
+            
+            while (true) {
+                p = skipBlanks(p, end);
+                if (p >= end || *p == '\n' || *p == '#') {
+                    break;
+                }
+                
+                long vertexIndex = 0, textureIndex = 0, normalIndex = 0;
+                const char* cornerStart = p;
+                p = parseIndex(p, end, vertexIndex);
+                if (p < end && *p == '/') {
+                    p++;
+                    if (p < end && *p != '/') {
+                        p = parseIndex(p, end, textureIndex);
+                    }
+                    if (p < end && *p == '/') {
+                        p = parseIndex(p + 1, end, normalIndex);
+                    }
+                }
+                if (p == cornerStart) {
+                    // Not a number; give up on the rest of the line
+                    valid = false;
+                    break;
+                }
+                
+                GLuint v = resolveIndex(vertexIndex, chunk.base.positions + positionCount);
+                GLuint n = normalIndex != 0 ? resolveIndex(normalIndex, chunk.base.normals + normalCount) : INVALID_INDEX;
+                GLuint t = textureIndex != 0 && keepTexCoords ? resolveIndex(textureIndex, chunk.base.uvs + uvCount) : INVALID_INDEX;
+                if (v == INVALID_INDEX) {
+                    valid = false;
+                }
+                
+                if (corner == 0) {
+                    firstVertex = v;
+                    firstNormal = n;
+                    firstUV = t;
+                } else if (corner >= 2 && valid) {
+                    addCorner(firstVertex, firstNormal, firstUV);
+                    addCorner(prevVertex, prevNormal, prevUV);
+                    addCorner(v, n, t);
+                }
+                prevVertex = v;
+                prevNormal = n;
+                prevUV = t;
+                corner++;
+            }
+            
+            if (!valid || corner < 3) {
+                // Take back whatever part of the polygon was already written
+                chunk.corners = faceStart;
+                chunk.skippedFaces++;
+            }
+        }
+        
+        p = skipLine(p, end);
+    }
+}
+
+// Runs function(0) .. function(count - 1), one per thread, on count threads
+// including the caller
+template <typename Function>
+static void parallelFor(size_t count, Function function) {
+    std::vector<std::thread> threads;
+    threads.reserve(count > 0 ? count - 1 : 0);
+    for (size_t i = 1; i < count; i++) {
+        threads.emplace_back(function, i);
+    }
+    if (count > 0) {
+        function(0);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Parses an OBJ file into arrays whose vectors are still empty. Chunk
+// bookkeeping comes from the calling thread's scratch arena.
+bool Mesh::parseOBJ(const std::string& filePath, ObjArrays& arrays, ObjParseStats& stats) {
+    ScratchArena& arena = scratchArena();
+    
+    // Tokens are parsed in place from a read-only mapping, so the text itself
+    // never lands on the heap
+    MappedFile source;
+    if (!source.open(filePath)) {
+        std::cerr << "Failed to open file: " << filePath << std::endl;
+        return false;
+    }
+    mappedBytes = source.size;
+    const char* data = reinterpret_cast<const char*>(source.data);
+    size_t size = source.size;
+#if !defined(__cpp_lib_to_chars)
+    // parseFloat's strtof fallback needs a null-terminated buffer
+    std::vector<char> terminated(data, data + size);
+    terminated.push_back('\0');
+    data = terminated.data();
+#endif
+    
+    // Split at line boundaries into one chunk per thread
+    size_t threads = options.parseThreads != 0 ? options.parseThreads : std::max(1u, std::thread::hardware_concurrency());
+    size_t chunkCount = std::max<size_t>(1, std::min(threads, size / OBJ_MIN_CHUNK_BYTES));
+    ScratchVector<ObjChunk> chunks(chunkCount, ObjChunk(), arena);
+    chunks[0].begin = data;
+    for (size_t c = 1; c < chunkCount; c++) {
+        const char* split = std::max(chunks[c - 1].begin, data + size / chunkCount * c);
+        chunks[c].begin = split > data ? skipLine(split - 1, data + size) : data;
+        chunks[c - 1].end = chunks[c].begin;
+    }
+    chunks[chunkCount - 1].end = data + size;
+    
+    // Count every chunk's elements first, so the arrays below are allocated
+    // once at their final size instead of growing
+    parallelFor(chunkCount, [&](size_t c) {
+        uint64_t before = heapAllocationCount();
+        countOBJChunk(chunks[c], options.keepTexCoords);
+        chunks[c].heapAllocations += heapAllocationCount() - before;
+    });
+    
+    ObjChunkOffsets total;
+    for (ObjChunk& chunk : chunks) {
+        chunk.base = total;
+        total.positions += chunk.counts.positions;
+        total.normals += chunk.counts.normals;
+        total.uvs += chunk.counts.uvs;
+        total.corners += chunk.counts.corners;
+    }
+    
+    arrays.positions.resize(total.positions);
+    arrays.normals.resize(total.normals);
+    arrays.uvs.resize(total.uvs);
+    arrays.vertexIndices.resize(total.corners);
+    arrays.normalIndices.resize(total.corners);
+    arrays.uvIndices.resize(options.keepTexCoords ? total.corners : 0);
+    
+    parallelFor(chunkCount, [&](size_t c) {
+        uint64_t before = heapAllocationCount();
+        parseOBJChunk(chunks[c], options.keepTexCoords, arrays);
+        chunks[c].heapAllocations += heapAllocationCount() - before;
+    });
+    
+    // Malformed faces leave part of their chunk's corner range unused; close the gaps
+    size_t corners = 0;
+    stats = ObjParseStats();
+    for (const ObjChunk& chunk : chunks) {
+        if (corners != chunk.base.corners) {
+            size_t from = chunk.base.corners;
+            std::copy_n(arrays.vertexIndices.begin() + from, chunk.corners, arrays.vertexIndices.begin() + corners);
+            std::copy_n(arrays.normalIndices.begin() + from, chunk.corners, arrays.normalIndices.begin() + corners);
+            if (options.keepTexCoords) {
+                std::copy_n(arrays.uvIndices.begin() + from, chunk.corners, arrays.uvIndices.begin() + corners);
+            }
+        }
+        corners += chunk.corners;
+        stats.skippedFaces += chunk.skippedFaces;
+        stats.heapAllocations += chunk.heapAllocations;
+    }
+    arrays.vertexIndices.resize(corners);
+    arrays.normalIndices.resize(corners);
+    arrays.uvIndices.resize(options.keepTexCoords ? corners : 0);
+    
+    stats.bytes = size;
+    stats.threads = chunkCount;
+    if (stats.skippedFaces > 0) {
+        std::cerr << "Skipped " << stats.skippedFaces << " malformed faces in " << filePath << std::endl;
+    }
+    return true;
+}
+
+void Mesh::loadOBJ(const std::string& filePath) {
+    auto startTime = std::chrono::steady_clock::now();
+    uint64_t startAllocations = heapAllocationCount();
+    
+    ObjArrays arrays(scratchArena());
+    ObjParseStats stats;
+    if (!parseOBJ(filePath, arrays, stats)) {
+        return;
+    }
+    buildIndexedMesh(arrays);
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    double megabytes = stats.bytes / (1024.0 * 1024.0);
+    double dedupRatio = vertices.empty() ? 0.0 : static_cast<double>(indices.size()) / vertices.size();
+    std::cout << "Loaded " << vertices.size() << " vertices, " << indices.size() << " indices ("
+              << (indexType == GL_UNSIGNED_SHORT ? 16 : 32) << "-bit) from " << filePath
+              << std::fixed << std::setprecision(2)
+              << ", dedup ratio " << dedupRatio << "x"
+              << " in " << seconds * 1000.0 << " ms (" << (seconds > 0.0 ? megabytes / seconds : 0.0) << " MB/s, "
+              << stats.threads << (stats.threads == 1 ? " parser thread)" : " parser threads)")
+              << std::defaultfloat << std::setprecision(6) << std::endl;
+#ifdef M1_COUNT_ALLOCATIONS
+    // The count and parse passes should make none; the rest is per mesh, not per face
+    std::cout << "Heap allocations loading " << filePath << ": " << stats.heapAllocations << " parsing "
+              << arrays.vertexIndices.size() / 3 << " triangles, " << heapAllocationCount() - startAllocations
+              << " on the loading thread" << std::endl;
+#else
+    (void)startAllocations;
+#endif
+}
+
+// Hash key for a face corner; two corners share a vertex only if all three match
+struct VertexKey {
+    GLuint position, normal, uv;
+    
+    bool operator==(const VertexKey& other) const {
+        return position == other.position && normal == other.normal && uv == other.uv;
+    }
+};
+
+static inline size_t hashVertexKey(const VertexKey& key) {
+    uint64_t h = key.position * 0x9E3779B97F4A7C15ull;
+    h ^= (key.normal + 0x7F4A7C15u) * 0xC2B2AE3D27D4EB4Full;
+    h ^= (key.uv + 0x165667B1u) * 0x165667B19E3779F9ull;
+    return static_cast<size_t>(h ^ (h >> 29));
+}
+
+void Mesh::buildIndexedMesh(const ObjArrays& arrays) {
+    const ScratchVector<glm::vec3>& temp_vertices = arrays.positions;
+    const ScratchVector<glm::vec3>& temp_normals = arrays.normals;
+    const ScratchVector<glm::vec2>& temp_uvs = arrays.uvs;
+    const ScratchVector<GLuint>& vertexIndices = arrays.vertexIndices;
+    const ScratchVector<GLuint>& normalIndices = arrays.normalIndices;
+    const ScratchVector<GLuint>& uvIndices = arrays.uvIndices;
+    size_t cornerCount = vertexIndices.size();
+    
+    // Open-addressing table of output vertex ids, kept at most half full
+    size_t capacity = 16;
+    while (capacity < cornerCount * 2) {
+        capacity <<= 1;
+    }
+    size_t mask = capacity - 1;
+    ScratchArena& arena = scratchArena();
+    ScratchVector<GLuint> slots(capacity, INVALID_INDEX, arena);
+    ScratchVector<VertexKey> keys(arena);
+    keys.reserve(temp_vertices.size());
+    
+    indices.clear();
+    indices.reserve(cornerCount);
+    
+    for (size_t i = 0; i < cornerCount; i++) {
+        VertexKey key = { vertexIndices[i], normalIndices[i], uvIndices.empty() ? INVALID_INDEX : uvIndices[i] };
+        
+        size_t slot = hashVertexKey(key) & mask;
+        while (slots[slot] != INVALID_INDEX && !(keys[slots[slot]] == key)) {
+            slot = (slot + 1) & mask;
+        }
+        
+        if (slots[slot] == INVALID_INDEX) {
+            slots[slot] = static_cast<GLuint>(keys.size());
+            keys.push_back(key);
+        }
+        indices.push_back(slots[slot]);
+    }
+    
+    vertices.resize(keys.size());
+    normals.resize(keys.size());
+    if (options.keepTexCoords) {
+        uvs.resize(keys.size());
+    }
+    
+    for (size_t i = 0; i < keys.size(); i++) {
+        vertices[i] = temp_vertices[keys[i].position];
+        normals[i] = keys[i].normal != INVALID_INDEX ? temp_normals[keys[i].normal] : glm::vec3(0.0f, 1.0f, 0.0f);
+        if (options.keepTexCoords) {
+            uvs[i] = keys[i].uv != INVALID_INDEX ? temp_uvs[keys[i].uv] : glm::vec2(0.0f);
+        }
+    }
+    
+    indexType = vertices.size() <= 0x10000 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    
+    // Everything is alive at this point: the parsed arrays, the table and the result
+    trackMemory(arrays.bytes() + vectorBytes(slots) + vectorBytes(keys) + cpuBytes());
+    
+    computeBounds();
+}
+
+// AABB, plus a bounding sphere around the AABB center that is grown to
+// reach the farthest vertex
+void Mesh::computeBounds() {
+    if (vertices.empty()) {
+        return;
+    }
+    
+    boundsMin = boundsMax = vertices[0];
+    for (const glm::vec3& vertex : vertices) {
+        boundsMin = glm::min(boundsMin, vertex);
+        boundsMax = glm::max(boundsMax, vertex);
+    }
+    
+    boundingCenter = (boundsMin + boundsMax) * 0.5f;
+    float radiusSquared = 0.0f;
+    for (const glm::vec3& vertex : vertices) {
+        glm::vec3 offset = vertex - boundingCenter;
+        radiusSquared = std::max(radiusSquared, glm::dot(offset, offset));
+    }
+    boundingRadius = std::sqrt(radiusSquared);
+}
+
+// Simulates a FIFO post-transform cache. ACMR is transformed vertices per
+// triangle, ATVR is transformed vertices per unique vertex (1.0 is ideal).
+static void analyzeVertexCache(const std::vector<GLuint>& indices, size_t vertexCount,
+                               float& acmr, float& atvr) {
+    std::vector<unsigned int> cacheTime(vertexCount, 0);
+    unsigned int timestamp = VERTEX_CACHE_SIZE + 1;
+    size_t misses = 0;
+    
+    for (GLuint index : indices) {
+        if (timestamp - cacheTime[index] > VERTEX_CACHE_SIZE) {
+            cacheTime[index] = timestamp++;
+            misses++;
+        }
+    }
+    
+    acmr = indices.empty() ? 0.0f : static_cast<float>(misses) / (indices.size() / 3);
+    atvr = vertexCount == 0 ? 0.0f : static_cast<float>(misses) / vertexCount;
+}
+
+// Tipsify (Sander, Nehab and Barczak 2007): fans around the most recently
+// cached vertex whose remaining triangles still fit in the cache. Writes the
+// reordered triangles and the start of each cluster, where a new cluster
+// begins every time the walk has to jump to a vertex outside the cache.
+static void tipsify(const std::vector<GLuint>& indices, size_t vertexCount,
+                    std::vector<GLuint>& result, std::vector<size_t>& clusters) {
+    size_t triangleCount = indices.size() / 3;
+    
+    // Vertex -> triangle adjacency in compressed rows
+    std::vector<unsigned int> liveTriangles(vertexCount, 0);
+    for (GLuint index : indices) {
+        liveTriangles[index]++;
+    }
+    std::vector<size_t> adjacencyOffset(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; v++) {
+        adjacencyOffset[v + 1] = adjacencyOffset[v] + liveTriangles[v];
+    }
+    std::vector<GLuint> adjacency(indices.size());
+    std::vector<size_t> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+    for (size_t i = 0; i < indices.size(); i++) {
+        adjacency[fill[indices[i]]++] = static_cast<GLuint>(i / 3);
+    }
+    
+    std::vector<unsigned int> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<GLuint> deadEnd;
+    std::vector<GLuint> candidates;
+    unsigned int timestamp = VERTEX_CACHE_SIZE + 1;
+    size_t cursor = 0;
+    
+    result.clear();
+    result.reserve(indices.size());
+    clusters.clear();
+    
+    long fanning = vertexCount > 0 ? 0 : -1;
+    bool newCluster = true;
+    
+    while (fanning >= 0) {
+        if (newCluster) {
+            clusters.push_back(result.size() / 3);
+            newCluster = false;
+        }
+        
+        candidates.clear();
+        for (size_t a = adjacencyOffset[fanning]; a < adjacencyOffset[fanning + 1]; a++) {
+            GLuint triangle = adjacency[a];
+            if (emitted[triangle]) {
+                continue;
+            }
+            for (int c = 0; c < 3; c++) {
+                GLuint v = indices[triangle * 3 + c];
+                result.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                liveTriangles[v]--;
+                if (timestamp - cacheTime[v] > VERTEX_CACHE_SIZE) {
+                    cacheTime[v] = timestamp++;
+                }
+            }
+            emitted[triangle] = true;
+        }
+        
+        // Prefer the candidate that has been in the cache longest while its
+        // remaining triangles can still be emitted before it is evicted
+        long next = -1;
+        int bestPriority = -1;
+        for (GLuint v : candidates) {
+            if (liveTriangles[v] == 0) {
+                continue;
+            }
+            int priority = 0;
+            if (timestamp - cacheTime[v] + 2 * liveTriangles[v] <= VERTEX_CACHE_SIZE) {
+                priority = static_cast<int>(timestamp - cacheTime[v]);
+            }
+            if (priority > bestPriority) {
+                bestPriority = priority;
+                next = v;
+            }
+        }
+        
+        if (next < 0) {
+            // Dead end: back up through recently emitted vertices, then scan forward
+            while (!deadEnd.empty() && next < 0) {
+                GLuint v = deadEnd.back();
+                deadEnd.pop_back();
+                if (liveTriangles[v] > 0) {
+                    next = v;
+                }
+            }
+            while (next < 0 && cursor < vertexCount) {
+                if (liveTriangles[cursor] > 0) {
+                    next = static_cast<long>(cursor);
+                }
+                cursor++;
+            }
+            newCluster = true;
+        }
+        
+        fanning = next;
+    }
+}
+
+// Sorts Tipsify clusters so outward-facing ones are drawn first, which lets
+// the depth test reject more of the fragments behind them
+static void optimizeOverdraw(const std::vector<GLuint>& indices, const std::vector<glm::vec3>& positions,
+                             const std::vector<size_t>& clusters, std::vector<GLuint>& result) {
+    size_t triangleCount = indices.size() / 3;
+    
+    glm::vec3 meshCentroid(0.0f);
+    for (const glm::vec3& position : positions) {
+        meshCentroid += position;
+    }
+    meshCentroid /= static_cast<float>(std::max<size_t>(positions.size(), 1));
+    
+    std::vector<std::pair<float, size_t>> order;
+    order.reserve(clusters.size());
+    
+    for (size_t c = 0; c < clusters.size(); c++) {
+        size_t begin = clusters[c];
+        size_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+        
+        glm::vec3 centroid(0.0f), normal(0.0f);
+        float area = 0.0f;
+        for (size_t t = begin; t < end; t++) {
+            const glm::vec3& p0 = positions[indices[t * 3 + 0]];
+            const glm::vec3& p1 = positions[indices[t * 3 + 1]];
+            const glm::vec3& p2 = positions[indices[t * 3 + 2]];
+            glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+            float triangleArea = glm::length(n);
+            centroid += (p0 + p1 + p2) * (triangleArea / 3.0f);
+            normal += n;
+            area += triangleArea;
+        }
+        
+        float sortKey = 0.0f;
+        float normalLength = glm::length(normal);
+        if (area > 0.0f && normalLength > 0.0f) {
+            sortKey = glm::dot(centroid / area - meshCentroid, normal / normalLength);
+        }
+        order.push_back(std::make_pair(-sortKey, c));
+    }
+    
+    std::stable_sort(order.begin(), order.end(),
+                     [](const std::pair<float, size_t>& a, const std::pair<float, size_t>& b) { return a.first < b.first; });
+    
+    result.clear();
+    result.reserve(indices.size());
+    for (const std::pair<float, size_t>& entry : order) {
+        size_t c = entry.second;
+        size_t begin = clusters[c];
+        size_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+        result.insert(result.end(), indices.begin() + begin * 3, indices.begin() + end * 3);
+    }
+}
+
+// Symmetric 4x4 error quadric of Garland & Heckbert: the weighted sum of
+// squared distances to a set of planes, stored as its ten distinct
+// coefficients plus the total weight
+struct Quadric {
+    double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+    double weight = 0;
+    
+    void addPlane(const glm::dvec3& n, double d, double planeWeight) {
+        a2 += planeWeight * n.x * n.x; ab += planeWeight * n.x * n.y; ac += planeWeight * n.x * n.z; ad += planeWeight * n.x * d;
+        b2 += planeWeight * n.y * n.y; bc += planeWeight * n.y * n.z; bd += planeWeight * n.y * d;
+        c2 += planeWeight * n.z * n.z; cd += planeWeight * n.z * d;
+        d2 += planeWeight * d * d;
+        weight += planeWeight;
+    }
+    
+    Quadric& operator+=(const Quadric& q) {
+        a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad; b2 += q.b2;
+        bc += q.bc; bd += q.bd; c2 += q.c2; cd += q.cd; d2 += q.d2;
+        weight += q.weight;
+        return *this;
+    }
+    
+    // Mean squared distance from p to the planes, so merged quadrics stay
+    // comparable however many planes they hold
+    double evaluate(const glm::vec3& p) const {
+        double x = p.x, y = p.y, z = p.z;
+        double error = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+                     + b2 * y * y + 2 * bc * y * z + 2 * bd * y
+                     + c2 * z * z + 2 * cd * z + d2;
+        return weight > 0 ? std::max(error, 0.0) / weight : 0.0;
+    }
+};
+
+// Open edges get a plane perpendicular to their face with this weight, so
+// collapses keep mesh borders in place
+const double SIMPLIFY_BORDER_WEIGHT = 10.0;
+
+static glm::dvec3 triangleNormal(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2) {
+    return glm::cross(glm::dvec3(p1 - p0), glm::dvec3(p2 - p0));
+}
+
+// Quadric error metric simplification restricted to collapsing a vertex onto
+// one of its neighbours, so every level indexes the original vertex buffer.
+// Runs progressively, recording a level each time the index count drops to
+// the next entry of targetIndexCounts (descending). Vertices on attribute
+// seams are never moved, so seams cannot tear. errors receives the largest
+// collapse error of each level, as a distance in model units.
+static void simplifyMesh(const std::vector<GLuint>& indices, const std::vector<glm::vec3>& positions,
+                         const std::vector<size_t>& targetIndexCounts,
+                         std::vector<std::vector<GLuint>>& levels, std::vector<float>& errors) {
+    size_t vertexCount = positions.size();
+    
+    // Vertices sharing a position with another vertex lie on a seam
+    std::vector<GLuint> byPosition(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++) {
+        byPosition[v] = static_cast<GLuint>(v);
+    }
+    std::sort(byPosition.begin(), byPosition.end(), [&](GLuint a, GLuint b) {
+        const glm::vec3& pa = positions[a];
+        const glm::vec3& pb = positions[b];
+        return pa.x != pb.x ? pa.x < pb.x : pa.y != pb.y ? pa.y < pb.y : pa.z < pb.z;
+    });
+    std::vector<uint8_t> locked(vertexCount, 0);
+    for (size_t i = 1; i < vertexCount; i++) {
+        if (positions[byPosition[i]] == positions[byPosition[i - 1]]) {
+            locked[byPosition[i]] = locked[byPosition[i - 1]] = 1;
+        }
+    }
+    
+    // Face planes, plus border planes along edges only one triangle uses
+    std::vector<Quadric> quadrics(vertexCount);
+    std::unordered_map<uint64_t, int> edgeUses;
+    for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+        for (int e = 0; e < 3; e++) {
+            uint64_t a = indices[t + e], b = indices[t + (e + 1) % 3];
+            edgeUses[std::min(a, b) << 32 | std::max(a, b)]++;
+        }
+    }
+    for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+        const glm::vec3& p0 = positions[indices[t]];
+        glm::dvec3 normal = triangleNormal(p0, positions[indices[t + 1]], positions[indices[t + 2]]);
+        double area = glm::length(normal);
+        if (area == 0.0) {
+            continue;
+        }
+        normal /= area;
+        for (int c = 0; c < 3; c++) {
+            quadrics[indices[t + c]].addPlane(normal, -glm::dot(normal, glm::dvec3(p0)), 1.0);
+        }
+        for (int e = 0; e < 3; e++) {
+            uint64_t a = indices[t + e], b = indices[t + (e + 1) % 3];
+            if (edgeUses[std::min(a, b) << 32 | std::max(a, b)] != 1) {
+                continue;
+            }
+            glm::dvec3 edge = glm::dvec3(positions[b] - positions[a]);
+            glm::dvec3 borderNormal = glm::cross(edge, normal);
+            double length = glm::length(borderNormal);
+            if (length == 0.0) {
+                continue;
+            }
+            borderNormal /= length;
+            double d = -glm::dot(borderNormal, glm::dvec3(positions[a]));
+            quadrics[a].addPlane(borderNormal, d, SIMPLIFY_BORDER_WEIGHT);
+            quadrics[b].addPlane(borderNormal, d, SIMPLIFY_BORDER_WEIGHT);
+        }
+    }
+    
+    struct Collapse {
+        GLuint from, to;
+        double cost;
+    };
+    
+    std::vector<GLuint> current = indices;
+    std::vector<GLuint> triangleStart, triangleList;
+    std::vector<Collapse> collapses;
+    std::vector<GLuint> collapsedTo(vertexCount);
+    std::vector<uint8_t> touched(vertexCount);
+    double maxCost = 0.0;
+    size_t level = 0;
+    
+    while (level < targetIndexCounts.size()) {
+        if (current.size() <= targetIndexCounts[level]) {
+            levels.push_back(current);
+            errors.push_back(static_cast<float>(std::sqrt(maxCost)));
+            level++;
+            continue;
+        }
+        
+        // Vertex to triangle adjacency of the current level
+        size_t triangleCount = current.size() / 3;
+        triangleStart.assign(vertexCount + 1, 0);
+        for (GLuint index : current) {
+            triangleStart[index + 1]++;
+        }
+        for (size_t v = 0; v < vertexCount; v++) {
+            triangleStart[v + 1] += triangleStart[v];
+        }
+        triangleList.resize(current.size());
+        std::vector<GLuint> fill(triangleStart.begin(), triangleStart.end() - 1);
+        for (size_t i = 0; i < current.size(); i++) {
+            triangleList[fill[current[i]]++] = static_cast<GLuint>(i / 3);
+        }
+        
+        // Every edge in both directions, cheapest first
+        collapses.clear();
+        for (size_t i = 0; i < current.size(); i++) {
+            GLuint from = current[i];
+            GLuint to = current[i - i % 3 + (i % 3 + 1) % 3];
+            if (!locked[from]) {
+                Quadric q = quadrics[from];
+                q += quadrics[to];
+                collapses.push_back({ from, to, q.evaluate(positions[to]) });
+            }
+            if (!locked[to]) {
+                Quadric q = quadrics[to];
+                q += quadrics[from];
+                collapses.push_back({ to, from, q.evaluate(positions[from]) });
+            }
+        }
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) {
+            return a.cost < b.cost;
+        });
+        
+        // Greedily apply collapses whose one-ring no other collapse in this
+        // pass has touched, and that flip no triangle
+        for (size_t v = 0; v < vertexCount; v++) {
+            collapsedTo[v] = static_cast<GLuint>(v);
+        }
+        std::fill(touched.begin(), touched.end(), 0);
+        size_t removedTriangles = 0;
+        size_t wantedTriangles = triangleCount - targetIndexCounts[level] / 3;
+        for (const Collapse& collapse : collapses) {
+            if (removedTriangles >= wantedTriangles) {
+                break;
+            }
+            if (touched[collapse.from] || touched[collapse.to]) {
+                continue;
+            }
+            
+            bool flips = false;
+            size_t degenerate = 0;
+            for (GLuint k = triangleStart[collapse.from]; k < triangleStart[collapse.from + 1] && !flips; k++) {
+                const GLuint* triangle = &current[triangleList[k] * 3];
+                if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to) {
+                    degenerate++;
+                    continue;
+                }
+                glm::vec3 corners[3], moved[3];
+                for (int c = 0; c < 3; c++) {
+                    corners[c] = positions[triangle[c]];
+                    moved[c] = triangle[c] == collapse.from ? positions[collapse.to] : corners[c];
+                }
+                glm::dvec3 before = triangleNormal(corners[0], corners[1], corners[2]);
+                glm::dvec3 after = triangleNormal(moved[0], moved[1], moved[2]);
+                flips = glm::dot(before, after) <= 0.0;
+            }
+            if (flips) {
+                continue;
+            }
+            
+            collapsedTo[collapse.from] = collapse.to;
+            quadrics[collapse.to] += quadrics[collapse.from];
+            maxCost = std::max(maxCost, collapse.cost);
+            removedTriangles += degenerate;
+            touched[collapse.to] = 1;
+            for (GLuint k = triangleStart[collapse.from]; k < triangleStart[collapse.from + 1]; k++) {
+                const GLuint* triangle = &current[triangleList[k] * 3];
+                touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = 1;
+            }
+        }
+        
+        if (removedTriangles == 0) {
+            // Nothing left that can collapse; the last level is as far as it goes
+            levels.push_back(current);
+            errors.push_back(static_cast<float>(std::sqrt(maxCost)));
+            break;
+        }
+        
+        // Apply the collapses and drop the triangles they made degenerate
+        size_t write = 0;
+        for (size_t t = 0; t < current.size(); t += 3) {
+            GLuint a = collapsedTo[current[t]], b = collapsedTo[current[t + 1]], c = collapsedTo[current[t + 2]];
+            if (a != b && b != c && a != c) {
+                current[write++] = a;
+                current[write++] = b;
+                current[write++] = c;
+            }
+        }
+        current.resize(write);
+    }
+}
+
+// Builds up to MAX_LODS levels, each about half the triangles of the last,
+// and appends them after the full-detail indices
+void Mesh::buildLods() {
+    lods.assign(1, { 0, static_cast<GLsizei>(indices.size()), 0.0f });
+    if (!options.generateLods || indices.empty() || boundingRadius <= 0.0f) {
+        return;
+    }
+    
+    auto startTime = std::chrono::steady_clock::now();
+    
+    std::vector<size_t> targets;
+    for (unsigned int level = 1; level < MAX_LODS; level++) {
+        size_t target = (indices.size() >> level) / 3 * 3;
+        if (target < 3 * LOD_MIN_TRIANGLES) {
+            break;
+        }
+        targets.push_back(target);
+    }
+    
+    std::vector<std::vector<GLuint>> levels;
+    std::vector<float> errors;
+    simplifyMesh(indices, vertices, targets, levels, errors);
+    
+    size_t levelBytes = 0;
+    for (const auto& level : levels) {
+        levelBytes += vectorBytes(level);
+    }
+    trackMemory(cpuBytes() + levelBytes);
+    indices.reserve(indices.size() + levelBytes / sizeof(GLuint));
+    
+    // A level has to be a real reduction over the one before it to be worth drawing
+    for (size_t level = 0; level < levels.size(); level++) {
+        if (levels[level].size() > static_cast<size_t>(lods.back().indexCount) * 3 / 4) {
+            break;
+        }
+        lods.push_back({ static_cast<GLuint>(indices.size()), static_cast<GLsizei>(levels[level].size()),
+                         errors[level] / boundingRadius });
+        indices.insert(indices.end(), levels[level].begin(), levels[level].end());
+    }
+    
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    std::cout << "Built " << lods.size() << " LODs for " << name << ":";
+    for (const MeshLod& lod : lods) {
+        std::cout << " " << lod.indexCount / 3;
+    }
+    std::cout << " triangles, max error " << std::fixed << std::setprecision(2) << lods.back().error * 100.0f
+              << "% of radius (" << milliseconds << " ms)" << std::defaultfloat << std::setprecision(6) << std::endl;
+}
+
+void Mesh::optimizeMesh() {
+    if (indices.empty()) {
+        return;
+    }
+    
+    auto startTime = std::chrono::steady_clock::now();
+    
+    // Statistics are reported for the full-detail level
+    std::vector<GLuint> fullDetail(indices.begin(), indices.begin() + lods[0].indexCount);
+    float acmrBefore, atvrBefore;
+    analyzeVertexCache(fullDetail, vertices.size(), acmrBefore, atvrBefore);
+    
+    // Each LOD is a separate triangle list, reordered on its own
+    std::vector<GLuint> optimized;
+    optimized.reserve(indices.size());
+    size_t clusterCount = 0;
+    for (const MeshLod& lod : lods) {
+        std::vector<GLuint> lodIndices(indices.begin() + lod.firstIndex,
+                                       indices.begin() + lod.firstIndex + lod.indexCount);
+        
+        // Triangle order for the post-transform cache
+        std::vector<GLuint> cacheOrder;
+        std::vector<size_t> clusters;
+        tipsify(lodIndices, vertices.size(), cacheOrder, clusters);
+        clusterCount += clusters.size();
+        
+        // Cluster order for overdraw, unless it costs too much cache efficiency
+        std::vector<GLuint> overdrawOrder;
+        optimizeOverdraw(cacheOrder, vertices, clusters, overdrawOrder);
+        
+        float acmrCache, atvrCache, acmrOverdraw, atvrOverdraw;
+        analyzeVertexCache(cacheOrder, vertices.size(), acmrCache, atvrCache);
+        analyzeVertexCache(overdrawOrder, vertices.size(), acmrOverdraw, atvrOverdraw);
+        const std::vector<GLuint>& chosen = acmrOverdraw <= acmrCache * 1.05f ? overdrawOrder : cacheOrder;
+        optimized.insert(optimized.end(), chosen.begin(), chosen.end());
+    }
+    indices.swap(optimized);
+    
+    // Vertex order for fetch locality: number vertices by first use. Full
+    // detail comes first, so coarser levels reuse its ordering.
+    std::vector<GLuint> remap(vertices.size(), INVALID_INDEX);
+    GLuint nextVertex = 0;
+    for (GLuint& index : indices) {
+        if (remap[index] == INVALID_INDEX) {
+            remap[index] = nextVertex++;
+        }
+        index = remap[index];
+    }
+    
+    // Vertices no triangle references are dropped
+    std::vector<glm::vec3> fetchVertices(nextVertex), fetchNormals(nextVertex);
+    std::vector<glm::vec2> fetchUVs(uvs.empty() ? 0 : nextVertex);
+    for (size_t v = 0; v < remap.size(); v++) {
+        if (remap[v] == INVALID_INDEX) {
+            continue;
+        }
+        fetchVertices[remap[v]] = vertices[v];
+        fetchNormals[remap[v]] = normals[v];
+        if (!uvs.empty()) {
+            fetchUVs[remap[v]] = uvs[v];
+        }
+    }
+    vertices.swap(fetchVertices);
+    normals.swap(fetchNormals);
+    uvs.swap(fetchUVs);
+    
+    fullDetail.assign(indices.begin(), indices.begin() + lods[0].indexCount);
+    float acmrAfter, atvrAfter;
+    analyzeVertexCache(fullDetail, vertices.size(), acmrAfter, atvrAfter);
+    
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    std::cout << std::fixed << std::setprecision(3)
+              << "Optimized " << name << ": ACMR " << acmrBefore << " -> " << acmrAfter
+              << ", ATVR " << atvrBefore << " -> " << atvrAfter
+              << " (" << clusterCount << " clusters, " << std::setprecision(2) << milliseconds << " ms)"
+              << std::defaultfloat << std::setprecision(6) << std::endl;
+}
+
+VertexFormat VertexFormat::create(VertexLayout layout, bool hasTexCoords,
+                                 const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+    VertexFormat format;
+    format.layout = layout;
+    
+    // Avoid dividing by zero on flat meshes
+    glm::vec3 extent = glm::max(boundsMax - boundsMin, glm::vec3(1e-6f));
+    
+    switch (layout) {
+        case VertexLayout::Float32:
+            format.add(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat));
+            format.add(ATTRIB_NORMAL, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat));
+            if (hasTexCoords) {
+                format.add(ATTRIB_TEXCOORD, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat));
+            }
+            break;
+        case VertexLayout::Half:
+            // Centering keeps the values small, where half floats are most precise
+            format.positionOffset = (boundsMin + boundsMax) * 0.5f;
+            format.add(ATTRIB_POSITION, 3, GL_HALF_FLOAT, GL_FALSE, 4 * sizeof(GLushort));
+            format.add(ATTRIB_NORMAL, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(GLuint));
+            if (hasTexCoords) {
+                format.add(ATTRIB_TEXCOORD, 2, GL_HALF_FLOAT, GL_FALSE, 2 * sizeof(GLushort));
+            }
+            break;
+        case VertexLayout::Unorm16:
+            format.positionScale = extent;
+            format.positionOffset = boundsMin;
+            format.add(ATTRIB_POSITION, 3, GL_UNSIGNED_SHORT, GL_TRUE, 4 * sizeof(GLushort));
+            format.add(ATTRIB_NORMAL, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(GLuint));
+            if (hasTexCoords) {
+                format.add(ATTRIB_TEXCOORD, 2, GL_HALF_FLOAT, GL_FALSE, 2 * sizeof(GLushort));
+            }
+            break;
+    }
+    
+    return format;
+}
+
+void VertexFormat::add(GLuint location, GLint components, GLenum type, GLboolean normalized, GLuint size) {
+    attributes[attributeCount++] = { location, components, type, normalized, static_cast<GLuint>(stride) };
+    stride += size;
+}
+
+void VertexFormat::pack(const glm::vec3& position, const glm::vec3& normal, const glm::vec2* uv, unsigned char* out) const {
+    float normalLength = glm::length(normal);
+    glm::vec3 unitNormal = normalLength > 0.0f ? normal / normalLength : glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::vec3 local = (position - positionOffset) / positionScale;
+    
+    for (int i = 0; i < attributeCount; i++) {
+        const VertexAttribute& attribute = attributes[i];
+        unsigned char* dst = out + attribute.offset;
+        
+        if (attribute.location == ATTRIB_POSITION) {
+            if (attribute.type == GL_FLOAT) {
+                memcpy(dst, &local, sizeof(glm::vec3));
+            } else {
+                GLushort packed[4] = { 0, 0, 0, 0 };
+                for (int c = 0; c < 3; c++) {
+                    packed[c] = attribute.type == GL_HALF_FLOAT
+                        ? glm::packHalf1x16(local[c])
+                        : static_cast<GLushort>(std::lround(glm::clamp(local[c], 0.0f, 1.0f) * 65535.0f));
+                }
+                memcpy(dst, packed, sizeof(packed));
+            }
+        } else if (attribute.location == ATTRIB_NORMAL) {
+            if (attribute.type == GL_FLOAT) {
+                memcpy(dst, &unitNormal, sizeof(glm::vec3));
+            } else {
+                GLuint packed = glm::packSnorm3x10_1x2(glm::vec4(unitNormal, 0.0f));
+                memcpy(dst, &packed, sizeof(packed));
+            }
+        } else if (attribute.location == ATTRIB_TEXCOORD) {
+            glm::vec2 texCoord = uv ? *uv : glm::vec2(0.0f);
+            if (attribute.type == GL_FLOAT) {
+                memcpy(dst, &texCoord, sizeof(glm::vec2));
+            } else {
+                GLushort packed[2] = { glm::packHalf1x16(texCoord.x), glm::packHalf1x16(texCoord.y) };
+                memcpy(dst, packed, sizeof(packed));
+            }
+        }
+    }
+}
+
+// Runs the CPU side of loading: the mesh cache when it's fresh, otherwise
+// parsing, LOD generation, optimization and packing. Safe on any thread,
+// since it makes no GL calls. Returns false if nothing could be loaded.
+bool Mesh::prepare() {
+    loadStart = std::chrono::steady_clock::now();
+    pending.reset(new PendingUpload());
+    peakBytes = 0;
+    mappedBytes = 0;
+    warm = options.useMeshCache && loadMeshCache();
+    if (!warm) {
+        loadOBJ(name);
+        buildLods();
+        if (options.optimize) {
+            optimizeMesh();
+        }
+        packMesh();
+    }
+    
+    // Everything allocated from it during this load is gone by now
+    scratchArena().reset();
+    prepareMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+    return !empty();
+}
+
+// CPU-side mesh data still held, which is what stays behind after upload
+size_t Mesh::cpuBytes() const {
+    return vectorBytes(vertices) + vectorBytes(normals) + vectorBytes(uvs) + vectorBytes(indices) + vectorBytes(lods);
+}
+
+// Interleaves the vertices and narrows the indices into the byte layout the
+// GPU buffers use, and writes them to the mesh cache
+void Mesh::packMesh() {
+    format = VertexFormat::create(options.vertexLayout, !uvs.empty(), boundsMin, boundsMax);
+    
+    // Interleave all attributes into a single buffer
+    std::vector<unsigned char> vertexData(vertices.size() * format.stride);
+    for (size_t i = 0; i < vertices.size(); i++) {
+        format.pack(vertices[i], normals[i], uvs.empty() ? nullptr : &uvs[i], &vertexData[i * format.stride]);
+    }
+    
+    size_t indexSize = indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+    std::vector<unsigned char> indexData(indices.size() * indexSize);
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (indexType == GL_UNSIGNED_SHORT) {
+            GLushort index = static_cast<GLushort>(indices[i]);
+            memcpy(&indexData[i * indexSize], &index, indexSize);
+        } else {
+            memcpy(&indexData[i * indexSize], &indices[i], indexSize);
+        }
+    }
+    indexCount = static_cast<GLsizei>(indices.size());
+    
+    if (options.useMeshCache && indexCount > 0) {
+        writeMeshCache(vertexData, indexData);
+    }
+    
+    trackMemory(cpuBytes() + vectorBytes(vertexData) + vectorBytes(indexData));
+    if (!options.keepCpuData) {
+        std::vector<glm::vec3>().swap(vertices);
+        std::vector<glm::vec3>().swap(normals);
+        std::vector<glm::vec2>().swap(uvs);
+        std::vector<GLuint>().swap(indices);
+    }
+    
+    pending->vertexStorage.swap(vertexData);
+    pending->indexStorage.swap(indexData);
+    pending->vertexData = pending->vertexStorage.data();
+    pending->indexData = pending->indexStorage.data();
+    pending->vertexBytes = pending->vertexStorage.size();
+    pending->indexBytes = pending->indexStorage.size();
+}
+
+ScratchArena& scratchArena() {
+    static thread_local ScratchArena arena;
+    return arena;
+}
+
+void* ScratchArena::allocate(size_t bytes, size_t alignment) {
+    if (!blocks.empty()) {
+        size_t start = (offset + alignment - 1) & ~(alignment - 1);
+        if (start + bytes <= blocks.back().size) {
+            offset = start + bytes;
+            return blocks.back().data + start;
+        }
+    }
+    
+    // Blocks come from operator new, which already aligns for any scalar type
+    addBlock(std::max(bytes, blocks.empty() ? SCRATCH_BLOCK_BYTES : blocks.back().size * 2));
+    offset = bytes;
+    return blocks.back().data;
+}
+
+void ScratchArena::reset() {
+    size_t size = capacity();
+    if (size > SCRATCH_RETAIN_BYTES) {
+        release();
+    } else if (blocks.size() > 1) {
+        release();
+        addBlock(size);
+    }
+    offset = 0;
+}
+
+size_t ScratchArena::capacity() const {
+    size_t size = 0;
+    for (const Block& block : blocks) {
+        size += block.size;
+    }
+    return size;
+}
+
+void ScratchArena::addBlock(size_t size) {
+    blocks.push_back({ static_cast<unsigned char*>(::operator new(size)), size });
+}
+
+void ScratchArena::release() {
+    for (const Block& block : blocks) {
+        ::operator delete(block.data);
+    }
+    blocks.clear();
+    offset = 0;
+}
+
+bool MappedFile::open(const std::string& path) {
+    close();
+#ifdef _WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+        close();
+        return false;
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        close();
+        return false;
+    }
+    data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close();
+        return false;
+    }
+    void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    data = address != MAP_FAILED ? static_cast<const unsigned char*>(address) : nullptr;
+    size = static_cast<size_t>(info.st_size);
+#endif
+    if (!data) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::close() {
+#ifdef _WIN32
+    if (data) {
+        UnmapViewOfFile(data);
+    }
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+    }
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+    mapping = NULL;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (data) {
+        munmap(const_cast<unsigned char*>(data), size);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    fd = -1;
+#endif
+    data = nullptr;
+    size = 0;
+}
+
+std::string Mesh::meshCachePath() const {
+    return name + ".meshcache";
+}
+
+// Every option that changes the processed buffers has to be part of the key
+uint32_t Mesh::meshCacheOptionsKey() const {
+    return static_cast<uint32_t>(options.vertexLayout)
+        | (options.keepTexCoords ? 1u << 8 : 0u)
+        | (options.optimize ? 1u << 9 : 0u)
+        | (options.generateLods ? 1u << 10 : 0u);
+}
+
+bool Mesh::readSourceStamp(uint64_t& size, int64_t& time) const {
+    std::error_code error;
+    size = std::filesystem::file_size(name, error);
+    if (error) {
+        return false;
+    }
+    time = static_cast<int64_t>(std::filesystem::last_write_time(name, error).time_since_epoch().count());
+    return !error;
+}
+
+bool Mesh::loadMeshCache() {
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    if (!readSourceStamp(sourceSize, sourceTime)) {
+        return false;
+    }
+    
+    // Kept mapped until the upload finishes
+    MappedFile& cache = pending->cacheFile;
+    if (!cache.open(meshCachePath()) || cache.size < sizeof(MeshCacheHeader)) {
+        cache.close();
+        return false;
+    }
+    
+    mappedBytes = cache.size;
+    MeshCacheHeader header;
+    memcpy(&header, cache.data, sizeof(header));
+    
+    // Sizes are compared by subtraction so a corrupt header can't overflow
+    // its way past the checks
+    auto fits = [&](uint64_t offset, uint64_t bytes) {
+        return offset <= cache.size && bytes <= cache.size - offset;
+    };
+    uint64_t indexSize = header.indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+    
+    std::string sourcePath = std::filesystem::absolute(name).string();
+    bool valid = memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) == 0
+        && header.version == MESH_CACHE_VERSION
+        && header.sourceSize == sourceSize
+        && header.sourceTime == sourceTime
+        && header.optionsKey == meshCacheOptionsKey()
+        && header.pathLength == sourcePath.size()
+        && fits(sizeof(header), header.pathLength)
+        && memcmp(cache.data + sizeof(header), sourcePath.data(), sourcePath.size()) == 0
+        && (header.indexType == GL_UNSIGNED_SHORT || header.indexType == GL_UNSIGNED_INT)
+        && header.vertexLayout <= static_cast<uint32_t>(VertexLayout::Unorm16)
+        && fits(header.vertexOffset, header.vertexBytes)
+        && fits(header.indexOffset, header.indexBytes)
+        && header.indexBytes == header.indexCount * indexSize
+        && header.indexCount <= static_cast<uint64_t>(std::numeric_limits<GLsizei>::max())
+        && header.lodCount >= 1 && header.lodCount <= MAX_LODS;
+    for (uint32_t l = 0; valid && l < header.lodCount; l++) {
+        valid = header.lodFirstIndex[l] + uint64_t(header.lodIndexCount[l]) <= header.indexCount;
+    }
+    
+    // The stride depends on the layout, so the vertex data is checked once
+    // the layout is known to be one
+    glm::vec3 cachedMin(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+    glm::vec3 cachedMax(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+    VertexFormat cachedFormat;
+    if (valid) {
+        cachedFormat = VertexFormat::create(static_cast<VertexLayout>(header.vertexLayout), header.hasTexCoords != 0,
+                                            cachedMin, cachedMax);
+        valid = header.vertexBytes == uint64_t(header.vertexCount) * uint64_t(cachedFormat.stride);
+    }
+    if (!valid) {
+        std::cout << "Mesh cache for " << name << " is stale, rebuilding" << std::endl;
+        cache.close();
+        return false;
+    }
+    
+    indexType = header.indexType;
+    indexCount = static_cast<GLsizei>(header.indexCount);
+    boundsMin = cachedMin;
+    boundsMax = cachedMax;
+    boundingCenter = glm::vec3(header.boundingSphere[0], header.boundingSphere[1], header.boundingSphere[2]);
+    boundingRadius = header.boundingSphere[3];
+    lods.clear();
+    for (uint32_t l = 0; l < header.lodCount; l++) {
+        lods.push_back({ header.lodFirstIndex[l], static_cast<GLsizei>(header.lodIndexCount[l]), header.lodError[l] });
+    }
+    format = cachedFormat;
+    
+    // Straight from the mapping to the driver, no CPU-side copies
+    pending->vertexData = cache.data + header.vertexOffset;
+    pending->vertexBytes = header.vertexBytes;
+    pending->indexData = cache.data + header.indexOffset;
+    pending->indexBytes = header.indexBytes;
+    return true;
+}
+
+void Mesh::writeMeshCache(const std::vector<unsigned char>& vertexData, const std::vector<unsigned char>& indexData) const {
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    if (!readSourceStamp(header.sourceSize, header.sourceTime)) {
+        return;
+    }
+    
+    std::string sourcePath = std::filesystem::absolute(name).string();
+    memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.optionsKey = meshCacheOptionsKey();
+    header.pathLength = static_cast<uint32_t>(sourcePath.size());
+    header.vertexCount = static_cast<uint32_t>(vertices.size());
+    header.indexCount = static_cast<uint32_t>(indexCount);
+    header.indexType = indexType;
+    header.vertexLayout = static_cast<uint32_t>(format.layout);
+    header.hasTexCoords = uvs.empty() ? 0 : 1;
+    for (int c = 0; c < 3; c++) {
+        header.boundsMin[c] = boundsMin[c];
+        header.boundsMax[c] = boundsMax[c];
+        header.boundingSphere[c] = boundingCenter[c];
+    }
+    header.boundingSphere[3] = boundingRadius;
+    header.lodCount = static_cast<uint32_t>(lods.size());
+    for (size_t l = 0; l < lods.size(); l++) {
+        header.lodFirstIndex[l] = lods[l].firstIndex;
+        header.lodIndexCount[l] = static_cast<uint32_t>(lods[l].indexCount);
+        header.lodError[l] = lods[l].error;
+    }
+    header.vertexOffset = (sizeof(header) + sourcePath.size() + 15) & ~uint64_t(15);
+    header.vertexBytes = vertexData.size();
+    header.indexOffset = (header.vertexOffset + header.vertexBytes + 15) & ~uint64_t(15);
+    header.indexBytes = indexData.size();
+    
+    // Write to a temporary file first so a concurrent reader never sees a partial cache
+    std::string cachePath = meshCachePath();
+    std::string tempPath = cachePath + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            std::cerr << "Failed to write mesh cache: " << cachePath << std::endl;
+            return;
+        }
+        const char padding[16] = {};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(sourcePath.data(), sourcePath.size());
+        file.write(padding, header.vertexOffset - sizeof(header) - sourcePath.size());
+        file.write(reinterpret_cast<const char*>(vertexData.data()), vertexData.size());
+        file.write(padding, header.indexOffset - header.vertexOffset - header.vertexBytes);
+        file.write(reinterpret_cast<const char*>(indexData.data()), indexData.size());
+        if (!file) {
+            std::cerr << "Failed to write mesh cache: " << cachePath << std::endl;
+            return;
+        }
+    }
+    
+    std::error_code error;
+    std::filesystem::rename(tempPath, cachePath, error);
+    if (error) {
+        std::cerr << "Failed to write mesh cache: " << cachePath << " (" << error.message() << ")" << std::endl;
+        std::filesystem::remove(tempPath, error);
+    }
+}
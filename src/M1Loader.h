@@ -0,0 +1,400 @@
+// CPU side of mesh loading: OBJ parsing, vertex deduplication, LOD
+// generation, cache optimization, packing and the binary mesh cache. Makes no
+// GL calls, so it can run without a context; GLAD is only included for the
+// GL types and enums the packed buffers are described with.
+#ifndef M1_LOADER_H
+#define M1_LOADER_H
+
+// Platform headers for memory-mapped files. windows.h must come before GLAD,
+// which would otherwise include it without NOMINMAX.
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+// Heap allocations made so far by the calling thread; always 0 unless built
+// with M1_COUNT_ALLOCATIONS, which installs a counting global operator new
+uint64_t heapAllocationCount();
+
+// Marks a missing or out-of-range index while parsing
+const GLuint INVALID_INDEX = 0xFFFFFFFFu;
+
+// How vertices are packed into the interleaved vertex buffer
+enum class VertexLayout {
+    Float32,  // float3 position, float3 normal (24 bytes)
+    Half,     // half3 position around the AABB center, 2_10_10_10 normal (12 bytes)
+    Unorm16   // 16-bit normalized position within the AABB, 2_10_10_10 normal (12 bytes)
+};
+
+const GLuint ATTRIB_POSITION = 0;
+const GLuint ATTRIB_NORMAL = 1;
+const GLuint ATTRIB_TEXCOORD = 2;
+const GLuint ATTRIB_INSTANCE_MODEL = 3; // Takes locations 3-6
+const GLuint ATTRIB_INSTANCE_SELECTED = 7;
+const GLuint ATTRIB_INSTANCE_NORMAL_MATRIX = 8; // Takes locations 8-10
+
+struct VertexAttribute {
+    GLuint location;
+    GLint components;
+    GLenum type;
+    GLboolean normalized;
+    GLuint offset;
+};
+
+// Describes one interleaved vertex: attribute layout plus the transform that
+// decodes quantized positions in the vertex shader
+struct VertexFormat {
+    VertexLayout layout = VertexLayout::Float32;
+    VertexAttribute attributes[3];
+    int attributeCount = 0;
+    GLsizei stride = 0;
+    glm::vec3 positionScale = glm::vec3(1.0f);
+    glm::vec3 positionOffset = glm::vec3(0.0f);
+    
+    static VertexFormat create(VertexLayout layout, bool hasTexCoords,
+                               const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+    void add(GLuint location, GLint components, GLenum type, GLboolean normalized, GLuint size);
+    void pack(const glm::vec3& position, const glm::vec3& normal, const glm::vec2* uv, unsigned char* out) const;
+    void apply() const; // Makes GL calls; defined with the renderer
+};
+
+// Per-load settings for Mesh
+struct MeshLoadOptions {
+    VertexLayout vertexLayout = VertexLayout::Unorm16;
+    
+    // Keep texture coordinates, splitting vertices along UV seams. The viewer's
+    // shaders do not sample textures, so by default UVs are dropped and
+    // vertices merge on position and normal alone.
+    bool keepTexCoords = false;
+    
+    // Reorder triangles and vertices for the post-transform cache, overdraw
+    // and vertex fetch locality before upload
+    bool optimize = true;
+    
+    // Simplify the mesh into coarser levels of detail for distant instances
+    bool generateLods = true;
+    
+    // Read and write the processed mesh from "<file>.meshcache" next to the source
+    bool useMeshCache = true;
+    
+    // Threads for parsing the OBJ text, 0 for one per core. Files smaller than
+    // OBJ_MIN_CHUNK_BYTES per thread use fewer; the result does not depend on it.
+    unsigned int parseThreads = 0;
+    
+    // Keep the unpacked vertices and indices on the CPU once they are packed.
+    // Nothing in the viewer reads them back, so by default only the GPU copy
+    // outlives the load.
+    bool keepCpuData = false;
+};
+
+// FIFO cache size assumed by the mesh optimizer and its statistics
+const unsigned int VERTEX_CACHE_SIZE = 16;
+
+// Levels of detail per mesh, including the full-detail level 0
+const unsigned int MAX_LODS = 4;
+
+// Simplification stops before a level would drop below this many triangles
+const size_t LOD_MIN_TRIANGLES = 32;
+
+// A coarser LOD is drawn once its simplification error projects to at most
+// this many pixels
+const float LOD_PIXEL_ERROR = 1.0f;
+
+// One level of detail: a range of the mesh's shared index buffer
+struct MeshLod {
+    GLuint firstIndex;
+    GLsizei indexCount;
+    float error; // Largest simplification error, relative to the bounding radius
+};
+
+// First block of a scratch arena; later ones double in size
+const size_t SCRATCH_BLOCK_BYTES = 1 << 16;
+
+// Arenas hold on to at most this much between loads, so one huge mesh does
+// not pin its scratch memory for the rest of the run
+const size_t SCRATCH_RETAIN_BYTES = 16 << 20;
+
+// Linear allocator for a load's temporary arrays. Allocation bumps a pointer
+// through the current block and nothing is freed on its own. reset() drops
+// everything at once and, when a load needed more than one block, replaces
+// them with a single block as large as all of them (up to
+// SCRATCH_RETAIN_BYTES), so loading many similar meshes stops going to the
+// heap for scratch memory after the first.
+class ScratchArena {
+public:
+    ScratchArena() {}
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+    ~ScratchArena() { release(); }
+    
+    void* allocate(size_t bytes, size_t alignment);
+    void reset();
+    size_t capacity() const;
+    
+private:
+    struct Block {
+        unsigned char* data;
+        size_t size;
+    };
+    
+    std::vector<Block> blocks;
+    size_t offset = 0; // Into the last block
+    
+    void addBlock(size_t size);
+    void release();
+};
+
+// The calling thread's arena. Loader threads keep theirs between loads.
+ScratchArena& scratchArena();
+
+// Standard allocator over a ScratchArena; deallocation is a no-op
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+    
+    ScratchArena* arena;
+    
+    ArenaAllocator(ScratchArena& scratch) : arena(&scratch) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+    
+    T* allocate(size_t count) { return static_cast<T*>(arena->allocate(count * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+    
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+// Vector whose storage lives in a ScratchArena; it must not outlive the
+// arena's next reset()
+template <typename T>
+using ScratchVector = std::vector<T, ArenaAllocator<T>>;
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+    
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+    
+    bool open(const std::string& path);
+    void close();
+    
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+#endif
+};
+
+// Bytes held by a vector, for the per-load memory report
+template <typename T, typename Allocator>
+inline size_t vectorBytes(const std::vector<T, Allocator>& values) {
+    return values.capacity() * sizeof(T);
+}
+
+// The loader's intermediate arrays, allocated once at their final size in a
+// scratch arena (the loading thread's, in loadOBJ); every chunk parses
+// straight into its own range of them
+struct ObjArrays {
+    ScratchVector<glm::vec3> positions;
+    ScratchVector<glm::vec3> normals;
+    ScratchVector<glm::vec2> uvs;
+    ScratchVector<GLuint> vertexIndices, normalIndices, uvIndices;
+    
+    explicit ObjArrays(ScratchArena& arena)
+        : positions(arena), normals(arena), uvs(arena), vertexIndices(arena), normalIndices(arena), uvIndices(arena) {}
+    
+    size_t bytes() const {
+        return vectorBytes(positions) + vectorBytes(normals) + vectorBytes(uvs)
+            + vectorBytes(vertexIndices) + vectorBytes(normalIndices) + vectorBytes(uvIndices);
+    }
+};
+
+// Counts from parsing one OBJ file into ObjArrays
+struct ObjParseStats {
+    size_t bytes = 0;
+    size_t threads = 0;
+    size_t skippedFaces = 0;
+    uint64_t heapAllocations = 0; // By the count and parse passes, with M1_COUNT_ALLOCATIONS
+};
+
+// Binary mesh cache layout: header, source path, then vertex and index data
+// at 16-byte aligned offsets, ready to hand to glBufferData
+const char MESH_CACHE_MAGIC[4] = { 'M', '1', 'M', 'C' };
+const uint32_t MESH_CACHE_VERSION = 3;
+
+struct MeshCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    uint32_t optionsKey;
+    uint32_t pathLength;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t indexType;
+    uint32_t vertexLayout;
+    uint32_t hasTexCoords;
+    float boundsMin[3];
+    float boundsMax[3];
+    float boundingSphere[4];
+    uint32_t lodCount;
+    uint32_t lodFirstIndex[MAX_LODS];
+    uint32_t lodIndexCount[MAX_LODS];
+    float lodError[MAX_LODS];
+    uint64_t vertexOffset;
+    uint64_t vertexBytes;
+    uint64_t indexOffset;
+    uint64_t indexBytes;
+};
+
+// Defined with the renderer
+class UploadStream;
+
+// Mesh resource loaded from an OBJ file: GPU buffers plus bounds. Shared
+// between instances through MeshCache, so never copied.
+class Mesh {
+public:
+    std::vector<glm::vec3> vertices;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> uvs; // Only filled with MeshLoadOptions::keepTexCoords
+    std::vector<GLuint> indices;
+    GLenum indexType = GL_UNSIGNED_INT; // GL_UNSIGNED_SHORT when the vertex count fits
+    
+    GLsizei indexCount = 0; // Across all LODs
+    
+    // Index ranges from full detail down, all sharing the vertex buffer
+    std::vector<MeshLod> lods;
+    
+    glm::vec3 boundsMin = glm::vec3(0.0f);
+    glm::vec3 boundsMax = glm::vec3(0.0f);
+    glm::vec3 boundingCenter = glm::vec3(0.0f);
+    float boundingRadius = 0.0f;
+    
+    VertexFormat format;
+    GLuint VAO = 0, VBO = 0, EBO = 0;
+    size_t gpuBytes = 0; // Vertex and index buffer sizes, set once resident
+    
+    // Set on the GL thread once every buffer is uploaded. Until then the
+    // other fields belong to whichever thread runs prepare().
+    bool resident = false;
+    
+    std::string name;
+    
+    MeshLoadOptions options;
+    
+    // Only records what to load. prepare() does the CPU work on any thread
+    // and streamUpload() the GL work; load() runs both on the GL thread.
+    Mesh(const std::string& objFilePath, const MeshLoadOptions& loadOptions = MeshLoadOptions()) {
+        name = objFilePath;
+        options = loadOptions;
+    }
+    
+    Mesh(const Mesh&) = delete;
+    Mesh& operator=(const Mesh&) = delete;
+    
+    // Meshes that never reached the GPU own no buffers, so CPU-only users of
+    // the loader destroy them without a context
+    ~Mesh() {
+        if (VAO != 0 || VBO != 0 || EBO != 0) {
+            glDeleteVertexArrays(1, &VAO);
+            glDeleteBuffers(1, &VBO);
+            glDeleteBuffers(1, &EBO);
+        }
+    }
+    
+    void loadOBJ(const std::string& filePath);
+    bool parseOBJ(const std::string& filePath, ObjArrays& arrays, ObjParseStats& stats);
+    void buildIndexedMesh(const ObjArrays& arrays);
+    bool prepare();
+    bool streamUpload(UploadStream& stream);
+    void load();
+    
+    void computeBounds();
+    void buildLods();
+    void optimizeMesh();
+    void packMesh();
+    void uploadMesh(const void* vertexData, size_t vertexBytes, const void* indexData, size_t indexBytes);
+    void finishUpload();
+    void releaseBuffers();
+    std::string meshCachePath() const;
+    uint32_t meshCacheOptionsKey() const;
+    bool readSourceStamp(uint64_t& size, int64_t& time) const;
+    bool loadMeshCache();
+    void writeMeshCache(const std::vector<unsigned char>& vertexData, const std::vector<unsigned char>& indexData) const;
+    bool empty() const { return indexCount == 0; }
+    bool loadedFromCache() const { return warm; } // By the last prepare()
+    
+private:
+    // Packed buffers waiting for upload, pointing either into the mapped
+    // mesh cache or into the vectors here. Freed once the mesh is resident.
+    struct PendingUpload {
+        MappedFile cacheFile;
+        std::vector<unsigned char> vertexStorage, indexStorage;
+        const unsigned char* vertexData = nullptr;
+        const unsigned char* indexData = nullptr;
+        size_t vertexBytes = 0, indexBytes = 0;
+        size_t uploadedBytes = 0; // Vertex bytes first, then index bytes
+    };
+    
+    std::unique_ptr<PendingUpload> pending;
+    bool warm = false;
+    double prepareMilliseconds = 0.0;
+    std::chrono::steady_clock::time_point loadStart;
+    
+    // Memory report for the current load: the most heap the large buffers
+    // held at once, and the size of the file mapped for reading
+    size_t peakBytes = 0;
+    size_t mappedBytes = 0;
+    
+    void trackMemory(size_t bytes) { peakBytes = std::max(peakBytes, bytes); }
+    size_t cpuBytes() const;
+};
+
+#endif // M1_LOADER_H
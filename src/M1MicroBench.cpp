@@ -0,0 +1,363 @@
+// Microbenchmarks for each stage of the mesh loader, on synthetic grids from
+// 1k to 10M triangles and on assets/Suzanne.obj, and for the instance
+// transform and culling kernels at every SIMD level. Links only the loader
+// and the kernels, so it runs without a window or GL context.
+#include "M1Loader.h"
+#include "M1Simd.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+
+// Synthetic grid sizes in triangles
+const size_t MICROBENCH_GRID_SIZES[] = { 1000, 10000, 100000, 1000000, 10000000 };
+
+// Instance counts for the transform and culling kernels
+const size_t MICROBENCH_INSTANCE_COUNTS[] = { 1000, 100000 };
+
+// Swallows the loader's per-stage log lines while a benchmark runs, so the
+// benchmark report stays readable
+class QuietLog {
+public:
+    QuietLog() { saved = std::cout.rdbuf(&discard); }
+    ~QuietLog() { std::cout.rdbuf(saved); }
+
+private:
+    struct NullBuffer : std::streambuf {
+        int overflow(int c) override { return c; }
+    };
+    
+    NullBuffer discard;
+    std::streambuf* saved;
+};
+
+// Writes a rippled, square grid of at least the given number of triangles as
+// an OBJ with a normal per vertex, or reuses the one written by an earlier
+// run. Returns the path, or an empty string when it can't be written.
+static std::string syntheticOBJ(size_t triangles) {
+    std::filesystem::path directory = std::filesystem::temp_directory_path() / "m1-microbench";
+    std::filesystem::path path = directory / ("grid-" + std::to_string(triangles) + ".obj");
+    std::error_code error;
+    if (std::filesystem::exists(path, error)) {
+        return path.string();
+    }
+    std::filesystem::create_directories(directory, error);
+    
+    size_t side = static_cast<size_t>(std::ceil(std::sqrt(triangles / 2.0)));
+    std::string tempPath = path.string() + ".tmp";
+    FILE* file = std::fopen(tempPath.c_str(), "wb");
+    if (!file) {
+        return std::string();
+    }
+    
+    // Formatted into a buffer and written in large blocks; the 10M triangle
+    // file is several hundred MB
+    std::string text;
+    char line[128];
+    auto append = [&](int length) {
+        text.append(line, length);
+        if (text.size() >= (1 << 20)) {
+            std::fwrite(text.data(), 1, text.size(), file);
+            text.clear();
+        }
+    };
+    for (size_t y = 0; y <= side; y++) {
+        for (size_t x = 0; x <= side; x++) {
+            float u = static_cast<float>(x) / side, v = static_cast<float>(y) / side;
+            float height = 0.05f * std::sin(u * 20.0f) * std::cos(v * 20.0f);
+            append(std::snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n", u * 2.0f - 1.0f, height, v * 2.0f - 1.0f));
+        }
+    }
+    for (size_t y = 0; y <= side; y++) {
+        for (size_t x = 0; x <= side; x++) {
+            float u = static_cast<float>(x) / side, v = static_cast<float>(y) / side;
+            glm::vec3 normal = glm::normalize(glm::vec3(-0.5f * std::cos(u * 20.0f) * std::cos(v * 20.0f), 2.0f,
+                                                        0.5f * std::sin(u * 20.0f) * std::sin(v * 20.0f)));
+            append(std::snprintf(line, sizeof(line), "vn %.4f %.4f %.4f\n", normal.x, normal.y, normal.z));
+        }
+    }
+    for (size_t y = 0; y < side; y++) {
+        for (size_t x = 0; x < side; x++) {
+            size_t a = y * (side + 1) + x + 1, b = a + 1, c = a + side + 1, d = c + 1;
+            append(std::snprintf(line, sizeof(line), "f %zu//%zu %zu//%zu %zu//%zu\nf %zu//%zu %zu//%zu %zu//%zu\n",
+                                 a, a, c, c, b, b, b, b, c, c, d, d));
+        }
+    }
+    std::fwrite(text.data(), 1, text.size(), file);
+    bool written = std::ferror(file) == 0;
+    written = std::fclose(file) == 0 && written;
+    
+    std::filesystem::rename(tempPath, path, error);
+    if (!written || error) {
+        std::filesystem::remove(tempPath, error);
+        return std::string();
+    }
+    return path.string();
+}
+
+static bool inputAvailable(benchmark::State& state, const std::string& path) {
+    std::error_code error;
+    if (path.empty() || !std::filesystem::exists(path, error)) {
+        state.SkipWithError(("missing input " + path).c_str());
+        return false;
+    }
+    return true;
+}
+
+// OBJ text to the loader's intermediate arrays
+static void benchmarkParse(benchmark::State& state, const std::string& path) {
+    QuietLog quiet;
+    if (!inputAvailable(state, path)) {
+        return;
+    }
+    Mesh mesh(path);
+    ObjParseStats stats;
+    size_t triangles = 0;
+    for (auto _ : state) {
+        {
+            ObjArrays arrays(scratchArena());
+            mesh.parseOBJ(path, arrays, stats);
+            triangles = arrays.vertexIndices.size() / 3;
+            benchmark::DoNotOptimize(arrays.positions.data());
+        }
+        scratchArena().reset();
+    }
+    state.SetBytesProcessed(state.iterations() * stats.bytes);
+    state.SetItemsProcessed(state.iterations() * triangles);
+    state.counters["threads"] = static_cast<double>(stats.threads);
+}
+
+// Face corners to a shared vertex list and an index buffer
+static void benchmarkDedup(benchmark::State& state, const std::string& path) {
+    QuietLog quiet;
+    if (!inputAvailable(state, path)) {
+        return;
+    }
+    // The parsed input lives in its own arena, so the dedup table's scratch
+    // memory can be dropped after every iteration
+    ScratchArena inputArena;
+    ObjArrays arrays(inputArena);
+    ObjParseStats stats;
+    Mesh mesh(path);
+    mesh.parseOBJ(path, arrays, stats);
+    scratchArena().reset();
+    
+    for (auto _ : state) {
+        mesh.buildIndexedMesh(arrays);
+        benchmark::DoNotOptimize(mesh.indices.data());
+        scratchArena().reset();
+    }
+    state.SetItemsProcessed(state.iterations() * (arrays.vertexIndices.size() / 3));
+    state.counters["vertices"] = static_cast<double>(mesh.vertices.size());
+}
+
+// LOD generation by edge-collapse simplification
+static void benchmarkSimplify(benchmark::State& state, const std::string& path) {
+    QuietLog quiet;
+    if (!inputAvailable(state, path)) {
+        return;
+    }
+    Mesh mesh(path);
+    mesh.loadOBJ(path);
+    scratchArena().reset();
+    std::vector<GLuint> fullDetail = mesh.indices;
+    
+    for (auto _ : state) {
+        state.PauseTiming();
+        mesh.indices = fullDetail;
+        state.ResumeTiming();
+        mesh.buildLods();
+        benchmark::DoNotOptimize(mesh.indices.data());
+    }
+    state.SetItemsProcessed(state.iterations() * (fullDetail.size() / 3));
+    state.counters["lods"] = static_cast<double>(mesh.lods.size());
+}
+
+// Triangle and vertex reordering for the post-transform cache, overdraw and
+// fetch locality, over every LOD
+static void benchmarkOptimize(benchmark::State& state, const std::string& path) {
+    QuietLog quiet;
+    if (!inputAvailable(state, path)) {
+        return;
+    }
+    Mesh mesh(path);
+    mesh.loadOBJ(path);
+    mesh.buildLods();
+    scratchArena().reset();
+    std::vector<glm::vec3> vertices = mesh.vertices, normals = mesh.normals;
+    std::vector<GLuint> indices = mesh.indices;
+    
+    for (auto _ : state) {
+        state.PauseTiming();
+        mesh.vertices = vertices;
+        mesh.normals = normals;
+        mesh.indices = indices;
+        state.ResumeTiming();
+        mesh.optimizeMesh();
+        benchmark::DoNotOptimize(mesh.indices.data());
+    }
+    state.SetItemsProcessed(state.iterations() * (indices.size() / 3));
+}
+
+// A warm prepare() from the binary mesh cache, which the first, cold one
+// writes. This maps and validates the file; the buffers in it are only read
+// by the upload.
+static void benchmarkCacheRead(benchmark::State& state, const std::string& path) {
+    QuietLog quiet;
+    if (!inputAvailable(state, path)) {
+        return;
+    }
+    Mesh mesh(path);
+    mesh.prepare();
+    mesh.prepare();
+    if (!mesh.loadedFromCache()) {
+        state.SkipWithError(("mesh cache not written for " + path).c_str());
+        return;
+    }
+    
+    for (auto _ : state) {
+        mesh.prepare();
+        benchmark::DoNotOptimize(mesh.indexCount);
+    }
+    state.SetItemsProcessed(state.iterations() * (mesh.lods.empty() ? 0 : mesh.lods[0].indexCount / 3));
+}
+
+// Repeatable random instances spread over a cube 200 units wide, about an
+// eighth of which fall inside the 100 unit box the culling planes describe
+struct KernelInput {
+    std::vector<glm::vec3> positions, rotations, scales;
+    std::vector<float> x, y, z, radius;
+    std::vector<uint8_t> resident;
+    float planes[24] = { 1, 0, 0, 50, -1, 0, 0, 50, 0, 1, 0, 50, 0, -1, 0, 50, 0, 0, 1, 50, 0, 0, -1, 50 };
+    
+    explicit KernelInput(size_t count) {
+        uint32_t seed = 12345;
+        auto random = [&seed](float low, float high) {
+            seed = seed * 1664525u + 1013904223u;
+            return low + (high - low) * static_cast<float>(seed >> 8) / 16777216.0f;
+        };
+        for (size_t i = 0; i < count; i++) {
+            glm::vec3 position(random(-100, 100), random(-100, 100), random(-100, 100));
+            positions.push_back(position);
+            rotations.push_back(glm::vec3(random(-180, 180), random(-180, 180), random(-180, 180)));
+            float scale = random(0.5f, 2.0f);
+            scales.push_back(i % 4 == 0 ? glm::vec3(scale, random(0.5f, 2.0f), scale) : glm::vec3(scale));
+            x.push_back(position.x);
+            y.push_back(position.y);
+            z.push_back(position.z);
+            radius.push_back(scale);
+            resident.push_back(1);
+        }
+    }
+};
+
+// The chained glm::translate/rotate/scale and inverse transpose each object
+// used to be drawn with, as the baseline for the kernels
+static void benchmarkTransformsGlm(benchmark::State& state, size_t count) {
+    KernelInput input(count);
+    std::vector<glm::mat4> models(count);
+    std::vector<glm::mat3> normalMatrices(count);
+    for (auto _ : state) {
+        for (size_t i = 0; i < count; i++) {
+            glm::mat4 model = glm::translate(glm::mat4(1.0f), input.positions[i]);
+            model = glm::rotate(model, glm::radians(input.rotations[i].x), glm::vec3(1.0f, 0.0f, 0.0f));
+            model = glm::rotate(model, glm::radians(input.rotations[i].y), glm::vec3(0.0f, 1.0f, 0.0f));
+            model = glm::rotate(model, glm::radians(input.rotations[i].z), glm::vec3(0.0f, 0.0f, 1.0f));
+            models[i] = glm::scale(model, input.scales[i]);
+            normalMatrices[i] = glm::transpose(glm::inverse(glm::mat3(models[i])));
+        }
+        benchmark::DoNotOptimize(models.data());
+        benchmark::DoNotOptimize(normalMatrices.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+
+static void benchmarkTransforms(benchmark::State& state, const SimdKernels& kernels, size_t count) {
+    KernelInput input(count);
+    std::vector<glm::mat4> models(count);
+    std::vector<glm::mat3> normalMatrices(count);
+    for (auto _ : state) {
+        kernels.buildTransforms(glm::value_ptr(input.positions[0]), glm::value_ptr(input.rotations[0]),
+                                glm::value_ptr(input.scales[0]), glm::value_ptr(models[0]),
+                                glm::value_ptr(normalMatrices[0]), nullptr, count);
+        benchmark::DoNotOptimize(models.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+
+static void benchmarkCull(benchmark::State& state, const SimdKernels& kernels, size_t count) {
+    KernelInput input(count);
+    std::vector<uint8_t> visible(count);
+    size_t visibleCount = 0;
+    for (auto _ : state) {
+        visibleCount = kernels.cullSpheres(input.x.data(), input.y.data(), input.z.data(), input.radius.data(),
+                                           input.resident.data(), input.planes, visible.data(), count);
+        benchmark::DoNotOptimize(visible.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+    state.counters["visible"] = static_cast<double>(visibleCount);
+}
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    
+    // Grids are written on first use and kept in the temp directory; the
+    // largest take a while to generate and to run, so filter with
+    // --benchmark_filter when iterating on one stage
+    std::vector<std::pair<std::string, std::string>> inputs;
+    for (size_t triangles : MICROBENCH_GRID_SIZES) {
+        inputs.push_back({ "grid-" + std::to_string(triangles), std::string() });
+    }
+    inputs.push_back({ "Suzanne", "../assets/Suzanne.obj" });
+    
+    struct Stage {
+        const char* name;
+        void (*run)(benchmark::State&, const std::string&);
+    };
+    const Stage stages[] = {
+        { "Parse", benchmarkParse },
+        { "Dedup", benchmarkDedup },
+        { "Simplify", benchmarkSimplify },
+        { "Optimize", benchmarkOptimize },
+        { "CacheRead", benchmarkCacheRead },
+    };
+    for (const Stage& stage : stages) {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            std::string name = std::string(stage.name) + "/" + inputs[i].first;
+            benchmark::RegisterBenchmark(name.c_str(), [&inputs, i, run = stage.run](benchmark::State& state) {
+                // Generated lazily, so filtered-out sizes are never written
+                if (inputs[i].second.empty()) {
+                    inputs[i].second = syntheticOBJ(MICROBENCH_GRID_SIZES[i]);
+                }
+                run(state, inputs[i].second);
+            })->Unit(benchmark::kMillisecond);
+        }
+    }
+    
+    // Every SIMD level this build and CPU support, next to the glm baseline
+    std::vector<const SimdKernels*> levels;
+    for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Neon, SimdLevel::Avx2 }) {
+        if (const SimdKernels* kernels = simdKernelsFor(level)) {
+            levels.push_back(kernels);
+        }
+    }
+    for (size_t count : MICROBENCH_INSTANCE_COUNTS) {
+        std::string size = "/" + std::to_string(count);
+        benchmark::RegisterBenchmark(("Transforms/glm" + size).c_str(), benchmarkTransformsGlm, count)
+            ->Unit(benchmark::kMicrosecond);
+        for (const SimdKernels* kernels : levels) {
+            std::string name = std::string(kernels->name) + size;
+            benchmark::RegisterBenchmark(("Transforms/" + name).c_str(), benchmarkTransforms, *kernels, count)
+                ->Unit(benchmark::kMicrosecond);
+            benchmark::RegisterBenchmark(("Cull/" + name).c_str(), benchmarkCull, *kernels, count)
+                ->Unit(benchmark::kMicrosecond);
+        }
+    }
+    
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
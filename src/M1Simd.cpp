@@ -0,0 +1,222 @@
+// Scalar, SSE2 and NEON kernels and the runtime choice between them and the
+// AVX2 ones. SSE2 is part of every x86-64 CPU and NEON of every 64-bit ARM
+// one, so only AVX2 needs detecting.
+#include "M1Simd.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define M1_SIMD_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define M1_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <cmath>
+
+#ifdef M1_SIMD_SSE2
+struct Sse2Lanes {
+    typedef __m128 Float;
+    typedef __m128i Int;
+    static const unsigned int WIDTH = 4;
+    
+    static Float load(const float* p) { return _mm_loadu_ps(p); }
+    static void store(float* p, Float v) { _mm_storeu_ps(p, v); }
+    static Float set(float v) { return _mm_set1_ps(v); }
+    static Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+    static Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+    static Float div(Float a, Float b) { return _mm_div_ps(a, b); }
+    static Float madd(Float a, Float b, Float c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+    static Float negate(Float v) { return _mm_xor_ps(v, _mm_set1_ps(-0.0f)); }
+    static Float bitAnd(Float a, Float b) { return _mm_and_ps(a, b); }
+    static Float bitXor(Float a, Float b) { return _mm_xor_ps(a, b); }
+    static Float equal(Float a, Float b) { return _mm_cmpeq_ps(a, b); }
+    static Float greaterEqual(Float a, Float b) { return _mm_cmpge_ps(a, b); }
+    static Float select(Float mask, Float a, Float b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+    static Int roundToInt(Float v) { return _mm_cvtps_epi32(v); }
+    static Float toFloat(Int v) { return _mm_cvtepi32_ps(v); }
+    static Int addInt(Int v, int n) { return _mm_add_epi32(v, _mm_set1_epi32(n)); }
+    
+    static Float bitSet(Int v, int bit) {
+        __m128i mask = _mm_set1_epi32(bit);
+        return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(v, mask), mask));
+    }
+    
+    static unsigned int maskBits(Float mask) { return static_cast<unsigned int>(_mm_movemask_ps(mask)); }
+};
+#endif
+
+#ifdef M1_SIMD_NEON
+struct NeonLanes {
+    typedef float32x4_t Float;
+    typedef int32x4_t Int;
+    static const unsigned int WIDTH = 4;
+    
+    static Float load(const float* p) { return vld1q_f32(p); }
+    static void store(float* p, Float v) { vst1q_f32(p, v); }
+    static Float set(float v) { return vdupq_n_f32(v); }
+    static Float add(Float a, Float b) { return vaddq_f32(a, b); }
+    static Float sub(Float a, Float b) { return vsubq_f32(a, b); }
+    static Float mul(Float a, Float b) { return vmulq_f32(a, b); }
+    static Float div(Float a, Float b) { return vdivq_f32(a, b); }
+    static Float madd(Float a, Float b, Float c) { return vfmaq_f32(c, a, b); }
+    static Float negate(Float v) { return vnegq_f32(v); }
+    
+    static Float bitAnd(Float a, Float b) {
+        return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b)));
+    }
+    
+    static Float bitXor(Float a, Float b) {
+        return vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b)));
+    }
+    
+    static Float equal(Float a, Float b) { return vreinterpretq_f32_u32(vceqq_f32(a, b)); }
+    static Float greaterEqual(Float a, Float b) { return vreinterpretq_f32_u32(vcgeq_f32(a, b)); }
+    static Float select(Float mask, Float a, Float b) { return vbslq_f32(vreinterpretq_u32_f32(mask), a, b); }
+    static Int roundToInt(Float v) { return vcvtnq_s32_f32(v); }
+    static Float toFloat(Int v) { return vcvtq_f32_s32(v); }
+    static Int addInt(Int v, int n) { return vaddq_s32(v, vdupq_n_s32(n)); }
+    static Float bitSet(Int v, int bit) { return vreinterpretq_f32_u32(vtstq_s32(v, vdupq_n_s32(bit))); }
+    
+    // NEON has no movemask; weight each lane's mask by its bit and sum
+    static unsigned int maskBits(Float mask) {
+        static const uint32_t weights[4] = { 1, 2, 4, 8 };
+        return vaddvq_u32(vandq_u32(vreinterpretq_u32_f32(mask), vld1q_u32(weights)));
+    }
+};
+#endif
+
+#include "M1SimdKernels.h"
+
+// Builds translate * rotateX * rotateY * rotateZ * scale in closed form, which
+// is what chaining glm::translate/rotate/scale produces. The normal matrix of
+// R * S is R * S^-1; under uniform scale the model's own upper 3x3 is used,
+// since the fragment shader normalizes the result anyway.
+static void buildTransformsScalar(const float* positionData, const float* rotationData, const float* scaleData,
+                                  float* modelData, float* normalMatrixData, const uint32_t* indices, size_t count) {
+    const glm::vec3* positions = reinterpret_cast<const glm::vec3*>(positionData);
+    const glm::vec3* rotations = reinterpret_cast<const glm::vec3*>(rotationData);
+    const glm::vec3* scales = reinterpret_cast<const glm::vec3*>(scaleData);
+    glm::mat4* models = reinterpret_cast<glm::mat4*>(modelData);
+    glm::mat3* normalMatrices = reinterpret_cast<glm::mat3*>(normalMatrixData);
+    
+    for (size_t n = 0; n < count; n++) {
+        size_t i = indices ? indices[n] : n;
+        const glm::vec3& scale = scales[i];
+        
+        glm::vec3 angles = rotations[i] * (glm::pi<float>() / 180.0f);
+        float sx = std::sin(angles.x), cx = std::cos(angles.x);
+        float sy = std::sin(angles.y), cy = std::cos(angles.y);
+        float sz = std::sin(angles.z), cz = std::cos(angles.z);
+        
+        glm::vec3 column0(cy * cz, sx * sy * cz + cx * sz, sx * sz - cx * sy * cz);
+        glm::vec3 column1(-cy * sz, cx * cz - sx * sy * sz, cx * sy * sz + sx * cz);
+        glm::vec3 column2(sy, -sx * cy, cx * cy);
+        
+        glm::mat4& model = models[i];
+        model[0] = glm::vec4(column0 * scale.x, 0.0f);
+        model[1] = glm::vec4(column1 * scale.y, 0.0f);
+        model[2] = glm::vec4(column2 * scale.z, 0.0f);
+        model[3] = glm::vec4(positions[i], 1.0f);
+        
+        glm::mat3& normalMatrix = normalMatrices[i];
+        if (scale.x == scale.y && scale.x == scale.z) {
+            normalMatrix = glm::mat3(model);
+        } else {
+            normalMatrix[0] = column0 / scale.x;
+            normalMatrix[1] = column1 / scale.y;
+            normalMatrix[2] = column2 / scale.z;
+        }
+    }
+}
+
+// Branch free over flat float arrays, so the compiler may vectorize it too
+static size_t cullSpheresScalar(const float* x, const float* y, const float* z, const float* r,
+                                const uint8_t* resident, const float* planes, uint8_t* visible, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        visible[i] = resident[i];
+    }
+    for (unsigned int p = 0; p < 6; p++) {
+        float a = planes[p * 4 + 0], b = planes[p * 4 + 1], c = planes[p * 4 + 2], d = planes[p * 4 + 3];
+        for (size_t i = 0; i < count; i++) {
+            float distance = a * x[i] + b * y[i] + c * z[i] + d;
+            visible[i] &= static_cast<uint8_t>(distance >= -r[i]);
+        }
+    }
+    
+    size_t visibleCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        visibleCount += visible[i];
+    }
+    return visibleCount;
+}
+
+static_assert(sizeof(glm::vec3) == 3 * sizeof(float) && sizeof(glm::mat3) == 9 * sizeof(float)
+              && sizeof(glm::mat4) == 16 * sizeof(float), "kernels take glm types as packed float arrays");
+
+static const SimdKernels scalarKernels = { SimdLevel::Scalar, "scalar", 1, buildTransformsScalar, cullSpheresScalar };
+
+#ifdef M1_SIMD_SSE2
+static const SimdKernels sse2Kernels = { SimdLevel::Sse2, "sse2", Sse2Lanes::WIDTH,
+                                         buildTransformsBatched<Sse2Lanes>, cullSpheresBatched<Sse2Lanes> };
+#endif
+
+#ifdef M1_SIMD_NEON
+static const SimdKernels neonKernels = { SimdLevel::Neon, "neon", NeonLanes::WIDTH,
+                                         buildTransformsBatched<NeonLanes>, cullSpheresBatched<NeonLanes> };
+#endif
+
+// AVX2 and FMA, and an OS that saves the YMM registers
+static bool cpuHasAvx2() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int info[4];
+    __cpuid(info, 1);
+    bool fma = (info[2] & (1 << 12)) != 0;
+    bool osSavesYmm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    return fma && osSavesYmm && (info[1] & (1 << 5)) != 0;
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    return false;
+#endif
+}
+
+const SimdKernels* simdKernelsFor(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::Scalar:
+        return &scalarKernels;
+#ifdef M1_SIMD_SSE2
+    case SimdLevel::Sse2:
+        return &sse2Kernels;
+#endif
+#ifdef M1_SIMD_NEON
+    case SimdLevel::Neon:
+        return &neonKernels;
+#endif
+    case SimdLevel::Avx2:
+        return cpuHasAvx2() ? avx2Kernels() : nullptr;
+    default:
+        return nullptr;
+    }
+}
+
+const SimdKernels& simdKernels() {
+    static const SimdKernels* best = [] {
+        for (SimdLevel level : { SimdLevel::Avx2, SimdLevel::Neon, SimdLevel::Sse2 }) {
+            if (const SimdKernels* kernels = simdKernelsFor(level)) {
+                return kernels;
+            }
+        }
+        return &scalarKernels;
+    }();
+    return *best;
+}
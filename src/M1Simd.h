@@ -0,0 +1,45 @@
+// Batched kernels for large instance arrays: model and normal matrices from
+// position, Euler rotation and scale, and the sphere-vs-frustum test. Each
+// has a scalar version and SIMD versions for SSE2, AVX2 and NEON; the best
+// one the CPU supports is picked at runtime. Only raw float arrays cross
+// this interface, so the AVX2 translation unit can be built with its own
+// compiler flags without sharing any inline code with the rest.
+#ifndef M1_SIMD_H
+#define M1_SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+
+enum class SimdLevel { Scalar, Sse2, Neon, Avx2 };
+
+// Positions, rotations (degrees, applied X, then Y, then Z) and scales are
+// 3 floats per instance; models are column-major 4x4 and normal matrices
+// column-major 3x3. With indices, only those instances are read and
+// written; otherwise the first count.
+typedef void (*BuildTransformsKernel)(const float* positions, const float* rotations, const float* scales,
+                                      float* models, float* normalMatrices, const uint32_t* indices, size_t count);
+
+// Sets visible[i] to resident[i] if the sphere is inside or touching all six
+// planes (a, b, c, d with unit normals, 24 floats). Returns the visible count.
+typedef size_t (*CullSpheresKernel)(const float* x, const float* y, const float* z, const float* radius,
+                                    const uint8_t* resident, const float* planes, uint8_t* visible, size_t count);
+
+struct SimdKernels {
+    SimdLevel level;
+    const char* name;
+    unsigned int width; // Instances per batch
+    BuildTransformsKernel buildTransforms;
+    CullSpheresKernel cullSpheres;
+};
+
+// The widest kernels this CPU runs, detected once
+const SimdKernels& simdKernels();
+
+// The kernels of one level, or nullptr when this build or CPU lacks them;
+// lets benchmarks compare levels side by side
+const SimdKernels* simdKernelsFor(SimdLevel level);
+
+// Defined in M1SimdAvx2.cpp; nullptr unless it was built with AVX2 and FMA
+const SimdKernels* avx2Kernels();
+
+#endif // M1_SIMD_H
@@ -0,0 +1,52 @@
+// AVX2 kernels, 8 instances per batch. This file alone is built with AVX2
+// and FMA enabled, and is only called once the CPU has been checked for
+// them; without those flags it builds to nothing and AVX2 is never picked.
+#include "M1Simd.h"
+
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+#include <immintrin.h>
+
+struct Avx2Lanes {
+    typedef __m256 Float;
+    typedef __m256i Int;
+    static const unsigned int WIDTH = 8;
+    
+    static Float load(const float* p) { return _mm256_loadu_ps(p); }
+    static void store(float* p, Float v) { _mm256_storeu_ps(p, v); }
+    static Float set(float v) { return _mm256_set1_ps(v); }
+    static Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+    static Float sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+    static Float div(Float a, Float b) { return _mm256_div_ps(a, b); }
+    static Float madd(Float a, Float b, Float c) { return _mm256_fmadd_ps(a, b, c); }
+    static Float negate(Float v) { return _mm256_xor_ps(v, _mm256_set1_ps(-0.0f)); }
+    static Float bitAnd(Float a, Float b) { return _mm256_and_ps(a, b); }
+    static Float bitXor(Float a, Float b) { return _mm256_xor_ps(a, b); }
+    static Float equal(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+    static Float greaterEqual(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static Float select(Float mask, Float a, Float b) { return _mm256_blendv_ps(b, a, mask); }
+    static Int roundToInt(Float v) { return _mm256_cvtps_epi32(v); }
+    static Float toFloat(Int v) { return _mm256_cvtepi32_ps(v); }
+    static Int addInt(Int v, int n) { return _mm256_add_epi32(v, _mm256_set1_epi32(n)); }
+    
+    static Float bitSet(Int v, int bit) {
+        __m256i mask = _mm256_set1_epi32(bit);
+        return _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(v, mask), mask));
+    }
+    
+    static unsigned int maskBits(Float mask) { return static_cast<unsigned int>(_mm256_movemask_ps(mask)); }
+};
+
+#include "M1SimdKernels.h"
+
+static const SimdKernels kernels = { SimdLevel::Avx2, "avx2", Avx2Lanes::WIDTH,
+                                     buildTransformsBatched<Avx2Lanes>, cullSpheresBatched<Avx2Lanes> };
+
+const SimdKernels* avx2Kernels() {
+    return &kernels;
+}
+#else
+const SimdKernels* avx2Kernels() {
+    return nullptr;
+}
+#endif
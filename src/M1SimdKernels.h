@@ -0,0 +1,182 @@
+// Vector kernels shared by every SIMD level, written once against a lane
+// type V that wraps one instruction set:
+//
+//   Float, Int, WIDTH        register types and lanes per register
+//   load, store, set         unaligned loads/stores and broadcasts
+//   add, sub, mul, div       lane-wise arithmetic
+//   madd(a, b, c)            a * b + c, fused where the instruction set has it
+//   negate, bitAnd, bitXor   sign flip and bitwise ops on floats
+//   equal, greaterEqual      comparisons giving all-ones lane masks
+//   select(mask, a, b)       a where mask is set, b elsewhere
+//   roundToInt, toFloat      round to nearest and back
+//   addInt, bitSet(v, bit)   integer add; mask of lanes with bit set in v
+//   maskBits(mask)           one bit per lane, lane 0 lowest
+//
+// Everything here lives in an anonymous namespace on purpose: each kernel
+// translation unit gets its own copy compiled for its own instruction set,
+// so the linker can never pick an AVX2 build of a shared inline function for
+// code that runs on a CPU without it. For the same reason no glm or standard
+// library code is used.
+#ifndef M1_SIMD_KERNELS_H
+#define M1_SIMD_KERNELS_H
+
+#include "M1Simd.h"
+
+namespace {
+
+// Cephes-style sine and cosine: reduce to [-pi/4, pi/4] by a multiple of
+// pi/2, evaluate both minimax polynomials, then swap and negate by quadrant.
+// Within a couple of ulps of libm for the angles instances use.
+template <typename V>
+inline void sinCos(typename V::Float x, typename V::Float& sine, typename V::Float& cosine) {
+    typedef typename V::Float F;
+    typename V::Int quadrant = V::roundToInt(V::mul(x, V::set(0.636619772f)));
+    F q = V::toFloat(quadrant);
+    
+    // pi/2 split in three parts so each product with q is exact
+    F r = V::sub(x, V::mul(q, V::set(1.5703125f)));
+    r = V::sub(r, V::mul(q, V::set(4.837512969970703125e-4f)));
+    r = V::sub(r, V::mul(q, V::set(7.54978995489188216e-8f)));
+    F r2 = V::mul(r, r);
+    
+    F sinPoly = V::madd(V::set(-1.9515295891e-4f), r2, V::set(8.3321608736e-3f));
+    sinPoly = V::madd(sinPoly, r2, V::set(-1.6666654611e-1f));
+    sinPoly = V::madd(sinPoly, V::mul(r2, r), r);
+    
+    F cosPoly = V::madd(V::set(2.443315711809948e-5f), r2, V::set(-1.388731625493765e-3f));
+    cosPoly = V::madd(cosPoly, r2, V::set(4.166664568298827e-2f));
+    cosPoly = V::madd(cosPoly, V::mul(r2, r2), V::madd(V::set(-0.5f), r2, V::set(1.0f)));
+    
+    // Odd quadrants swap the two; quadrants 2-3 negate the sine, 1-2 the cosine
+    F swap = V::bitSet(quadrant, 1);
+    F signBit = V::set(-0.0f);
+    sine = V::select(swap, cosPoly, sinPoly);
+    cosine = V::select(swap, sinPoly, cosPoly);
+    sine = V::bitXor(sine, V::bitAnd(V::bitSet(quadrant, 2), signBit));
+    cosine = V::bitXor(cosine, V::bitAnd(V::bitSet(V::addInt(quadrant, 1), 2), signBit));
+}
+
+// Same closed form as the scalar kernel, WIDTH instances at a time. Inputs
+// are gathered into lanes and results scattered back, which also covers the
+// index list; a short last batch repeats its final instance in the spare
+// lanes and only writes the real ones.
+template <typename V>
+void buildTransformsBatched(const float* positions, const float* rotations, const float* scales,
+                            float* models, float* normalMatrices, const uint32_t* indices, size_t count) {
+    typedef typename V::Float F;
+    const unsigned int width = V::WIDTH;
+    alignas(32) float lanes[9][V::WIDTH];
+    alignas(32) float results[18][V::WIDTH];
+    size_t slots[V::WIDTH];
+    
+    for (size_t n = 0; n < count; n += width) {
+        unsigned int used = count - n < width ? static_cast<unsigned int>(count - n) : width;
+        for (unsigned int k = 0; k < width; k++) {
+            size_t m = n + (k < used ? k : used - 1);
+            size_t i = indices ? indices[m] : m;
+            slots[k] = i;
+            for (unsigned int c = 0; c < 3; c++) {
+                lanes[c][k] = positions[i * 3 + c];
+                lanes[3 + c][k] = rotations[i * 3 + c];
+                lanes[6 + c][k] = scales[i * 3 + c];
+            }
+        }
+        
+        F toRadians = V::set(3.14159265358979f / 180.0f);
+        F sinX, cosX, sinY, cosY, sinZ, cosZ;
+        sinCos<V>(V::mul(V::load(lanes[3]), toRadians), sinX, cosX);
+        sinCos<V>(V::mul(V::load(lanes[4]), toRadians), sinY, cosY);
+        sinCos<V>(V::mul(V::load(lanes[5]), toRadians), sinZ, cosZ);
+        
+        F columns[9] = {
+            V::mul(cosY, cosZ),
+            V::add(V::mul(V::mul(sinX, sinY), cosZ), V::mul(cosX, sinZ)),
+            V::sub(V::mul(sinX, sinZ), V::mul(V::mul(cosX, sinY), cosZ)),
+            V::negate(V::mul(cosY, sinZ)),
+            V::sub(V::mul(cosX, cosZ), V::mul(V::mul(sinX, sinY), sinZ)),
+            V::add(V::mul(V::mul(cosX, sinY), sinZ), V::mul(sinX, cosZ)),
+            sinY,
+            V::negate(V::mul(sinX, cosY)),
+            V::mul(cosX, cosY),
+        };
+        F scale[3] = { V::load(lanes[6]), V::load(lanes[7]), V::load(lanes[8]) };
+        
+        // Under uniform scale the model's upper 3x3 serves as the normal
+        // matrix; otherwise R * S^-1
+        F uniform = V::bitAnd(V::equal(scale[0], scale[1]), V::equal(scale[0], scale[2]));
+        for (unsigned int c = 0; c < 9; c++) {
+            F model = V::mul(columns[c], scale[c / 3]);
+            V::store(results[c], model);
+            V::store(results[9 + c], V::select(uniform, model, V::div(columns[c], scale[c / 3])));
+        }
+        
+        for (unsigned int k = 0; k < used; k++) {
+            float* model = models + slots[k] * 16;
+            float* normal = normalMatrices + slots[k] * 9;
+            for (unsigned int column = 0; column < 3; column++) {
+                model[column * 4 + 0] = results[column * 3 + 0][k];
+                model[column * 4 + 1] = results[column * 3 + 1][k];
+                model[column * 4 + 2] = results[column * 3 + 2][k];
+                model[column * 4 + 3] = 0.0f;
+            }
+            model[12] = lanes[0][k];
+            model[13] = lanes[1][k];
+            model[14] = lanes[2][k];
+            model[15] = 1.0f;
+            for (unsigned int c = 0; c < 9; c++) {
+                normal[c] = results[9 + c][k];
+            }
+        }
+    }
+}
+
+// Distances are summed in the scalar kernel's order, without fusing, so
+// every level agrees on which spheres touch a plane
+template <typename V>
+size_t cullSpheresBatched(const float* x, const float* y, const float* z, const float* radius,
+                          const uint8_t* resident, const float* planes, uint8_t* visible, size_t count) {
+    typedef typename V::Float F;
+    const unsigned int width = V::WIDTH;
+    alignas(32) float tail[4][V::WIDTH] = {};
+    size_t visibleCount = 0;
+    
+    for (size_t n = 0; n < count; n += width) {
+        unsigned int used = count - n < width ? static_cast<unsigned int>(count - n) : width;
+        const float* source[4] = { x + n, y + n, z + n, radius + n };
+        if (used < width) {
+            for (unsigned int k = 0; k < used; k++) {
+                tail[0][k] = x[n + k];
+                tail[1][k] = y[n + k];
+                tail[2][k] = z[n + k];
+                tail[3][k] = radius[n + k];
+            }
+            for (unsigned int c = 0; c < 4; c++) {
+                source[c] = tail[c];
+            }
+        }
+        F px = V::load(source[0]), py = V::load(source[1]), pz = V::load(source[2]);
+        F limit = V::negate(V::load(source[3]));
+        
+        auto touching = [&](const float* plane) {
+            F distance = V::add(V::add(V::add(V::mul(V::set(plane[0]), px), V::mul(V::set(plane[1]), py)),
+                                       V::mul(V::set(plane[2]), pz)), V::set(plane[3]));
+            return V::greaterEqual(distance, limit);
+        };
+        F inside = touching(planes);
+        for (unsigned int p = 1; p < 6; p++) {
+            inside = V::bitAnd(inside, touching(planes + p * 4));
+        }
+        
+        unsigned int bits = V::maskBits(inside);
+        for (unsigned int k = 0; k < used; k++) {
+            uint8_t result = resident[n + k] & static_cast<uint8_t>((bits >> k) & 1);
+            visible[n + k] = result;
+            visibleCount += result;
+        }
+    }
+    return visibleCount;
+}
+
+} // namespace
+
+#endif // M1_SIMD_KERNELS_H